@@ -60,36 +60,121 @@ size_t nts::find_min_index(const std::vector<float> &v)
   return std::min_element(v.begin(), v.end()) - v.begin();
 };
 
-// MARK: MERGE_TRACES_WITHIN_RT
-void nts::merge_traces_within_rt(std::vector<float> &rt, std::vector<float> &mz, std::vector<float> &intensity)
+// MARK: FIND_MAX_TRACES_WITHIN_RT
+std::vector<int> nts::find_max_traces_within_rt(const std::vector<float> &rt, const std::vector<float> &intensity)
 {
-  std::vector<float> rt_out;
-  std::vector<float> mz_out;
-  std::vector<float> intensity_out;
-  for (size_t z = 0; z < rt.size(); z++)
+  // index of the most intense trace for each rt, in order of first appearance of the rt
+  const int n = rt.size();
+
+  std::vector<int> out;
+  out.reserve(n);
+
+  bool is_sorted = true;
+  for (int z = 1; z < n && is_sorted; z++)
+    if (!(rt[z] >= rt[z - 1]))
+      is_sorted = false;
+
+  if (is_sorted)
   {
-    if (std::find(rt_out.begin(), rt_out.end(), rt[z]) == rt_out.end())
-    {
-      rt_out.push_back(rt[z]);
-      mz_out.push_back(mz[z]);
-      intensity_out.push_back(intensity[z]);
-    }
-    else
+    // rt from get_spectra_targets is already ordered, equal rt values are adjacent
+    for (int z = 0; z < n; z++)
     {
-      auto it = std::find(rt_out.begin(), rt_out.end(), rt[z]);
-      int index = std::distance(rt_out.begin(), it);
-      if (intensity[z] > intensity_out[index])
+      if (z == 0 || rt[z] != rt[z - 1])
+      {
+        out.push_back(z);
+      }
+      else if (intensity[z] > intensity[out.back()])
       {
-        mz_out[index] = mz[z];
-        intensity_out[index] = intensity[z];
+        out.back() = z;
       }
     }
+    return out;
+  }
+
+  std::unordered_map<float, int> rt_position;
+  rt_position.reserve(n);
+
+  for (int z = 0; z < n; z++)
+  {
+    auto it = rt_position.emplace(rt[z], out.size());
+    if (it.second)
+    {
+      out.push_back(z);
+    }
+    else if (intensity[z] > intensity[out[it.first->second]])
+    {
+      out[it.first->second] = z;
+    }
+  }
+
+  return out;
+};
+
+// MARK: MERGE_TRACES_WITHIN_RT
+void nts::merge_traces_within_rt(std::vector<float> &rt, std::vector<float> &mz, std::vector<float> &intensity)
+{
+  const std::vector<int> idx = nts::find_max_traces_within_rt(rt, intensity);
+
+  const int n = idx.size();
+
+  if (n == static_cast<int>(rt.size()))
+    return;
+
+  std::vector<float> rt_out(n);
+  std::vector<float> mz_out(n);
+  std::vector<float> intensity_out(n);
+
+  for (int i = 0; i < n; i++)
+  {
+    rt_out[i] = rt[idx[i]];
+    mz_out[i] = mz[idx[i]];
+    intensity_out[i] = intensity[idx[i]];
   }
+
   rt = rt_out;
   mz = mz_out;
   intensity = intensity_out;
 };
 
+void nts::merge_traces_within_rt(std::vector<sc::MS_TARGETS_SPECTRA> &spectra)
+{
+  const int n_spectra = spectra.size();
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int j = 0; j < n_spectra; j++)
+  {
+    sc::MS_TARGETS_SPECTRA &sp = spectra[j];
+
+    const std::vector<int> idx = nts::find_max_traces_within_rt(sp.rt, sp.intensity);
+
+    const int n = idx.size();
+
+    if (n == static_cast<int>(sp.rt.size()))
+      continue;
+
+    sc::MS_TARGETS_SPECTRA merged;
+    merged.resize_all(n);
+
+    for (int i = 0; i < n; i++)
+    {
+      const int &k = idx[i];
+      merged.id[i] = sp.id[k];
+      merged.polarity[i] = sp.polarity[k];
+      merged.level[i] = sp.level[k];
+      merged.pre_mz[i] = sp.pre_mz[k];
+      merged.pre_mzlow[i] = sp.pre_mzlow[k];
+      merged.pre_mzhigh[i] = sp.pre_mzhigh[k];
+      merged.pre_ce[i] = sp.pre_ce[k];
+      merged.rt[i] = sp.rt[k];
+      merged.mobility[i] = sp.mobility[k];
+      merged.mz[i] = sp.mz[k];
+      merged.intensity[i] = sp.intensity[k];
+    }
+
+    sp = std::move(merged);
+  }
+};
+
 // MARK: TRIM_TO_EQUAL_LENGTH_AROUND_MAX_POSITION
 void nts::trim_to_equal_length_around_max_position(std::vector<float> &x, const size_t max_position)
 {
@@ -104,6 +189,109 @@ void nts::trim_to_equal_length_around_max_position(std::vector<float> &x, const
   x = x_out;
 };
 
+// MARK: EXTRACT_ANALYSES_TARGETS
+void nts::extract_analyses_targets(std::vector<MS_ANALYSIS_TARGETS> &analyses, const float &minIntLv1, const float &minIntLv2, const bool &mergeWithinRt)
+{
+  std::vector<int> jobs;
+
+  for (size_t i = 0; i < analyses.size(); i++)
+  {
+    MS_ANALYSIS_TARGETS &a = analyses[i];
+    a.spectra.clear();
+    a.number_traces.clear();
+    a.error.clear();
+
+    const int n_targets = a.targets.id.size();
+    a.spectra.resize(n_targets);
+    a.number_traces.resize(n_targets, 0);
+
+    if (n_targets > 0 && std::filesystem::exists(a.file))
+      jobs.push_back(i);
+  }
+
+  const int number_jobs = jobs.size();
+
+  if (number_jobs == 0)
+    return;
+
+  // one analysis per thread, spare threads are handed to the nested regions of get_spectra_targets
+  const int max_threads = omp_get_max_threads();
+  const int outer_threads = std::min(number_jobs, max_threads);
+  const int inner_threads = std::max(1, max_threads / outer_threads);
+  const int max_active_levels = omp_get_max_active_levels();
+
+  if (outer_threads > 1 && inner_threads > 1)
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel for num_threads(outer_threads) schedule(dynamic)
+  for (int k = 0; k < number_jobs; k++)
+  {
+    omp_set_num_threads(inner_threads);
+
+    MS_ANALYSIS_TARGETS &a = analyses[jobs[k]];
+
+    try
+    {
+      const sc::MS_TARGETS_SPECTRA res = sc::extract_spectra_targets(a.file, a.targets, a.headers, minIntLv1, minIntLv2);
+
+      const int n_targets = a.targets.id.size();
+
+      std::unordered_map<std::string, int> id_first_target;
+      for (int j = 0; j < n_targets; j++)
+        id_first_target.emplace(a.targets.id[j], j);
+
+      const int n_traces = res.id.size();
+
+      for (int z = 0; z < n_traces; z++)
+      {
+        auto it = id_first_target.find(res.id[z]);
+
+        if (it == id_first_target.end())
+          continue;
+
+        sc::MS_TARGETS_SPECTRA &sp = a.spectra[it->second];
+        sp.id.push_back(res.id[z]);
+        sp.polarity.push_back(res.polarity[z]);
+        sp.level.push_back(res.level[z]);
+        sp.pre_mz.push_back(res.pre_mz[z]);
+        sp.pre_mzlow.push_back(res.pre_mzlow[z]);
+        sp.pre_mzhigh.push_back(res.pre_mzhigh[z]);
+        sp.pre_ce.push_back(res.pre_ce[z]);
+        sp.rt.push_back(res.rt[z]);
+        sp.mobility.push_back(res.mobility[z]);
+        sp.mz.push_back(res.mz[z]);
+        sp.intensity.push_back(res.intensity[z]);
+      }
+
+      // targets sharing an id receive the same traces, as with MS_TARGETS_SPECTRA::operator[]
+      for (int j = 0; j < n_targets; j++)
+      {
+        const int first = id_first_target[a.targets.id[j]];
+        if (first != j)
+          a.spectra[j] = a.spectra[first];
+      }
+
+      for (int j = 0; j < n_targets; j++)
+        a.number_traces[j] = a.spectra[j].id.size();
+
+      if (mergeWithinRt)
+        nts::merge_traces_within_rt(a.spectra);
+    }
+    catch (const std::exception &e)
+    {
+      a.error = e.what();
+    }
+  }
+
+  omp_set_max_active_levels(max_active_levels);
+
+  for (const MS_ANALYSIS_TARGETS &a : analyses)
+  {
+    if (!a.error.empty())
+      throw std::runtime_error("Error extracting targets from " + a.file + ": " + a.error);
+  }
+};
+
 // MARK: TRAPEZOIDAL_AREA
 float nts::trapezoidal_area(const std::vector<float> &x, const std::vector<float> &intensity)
 {
@@ -143,44 +331,202 @@ float nts::fit_gaussian_cost_function(const std::vector<float> &x, const std::ve
   return cost;
 };
 
+// MARK: SOLVE_LINEAR_SYSTEM_3X3
+bool nts::solve_linear_system_3x3(const double (&M)[3][3], const double (&v)[3], double (&out)[3])
+{
+  const double det = M[0][0] * (M[1][1] * M[2][2] - M[1][2] * M[2][1]) -
+                     M[0][1] * (M[1][0] * M[2][2] - M[1][2] * M[2][0]) +
+                     M[0][2] * (M[1][0] * M[2][1] - M[1][1] * M[2][0]);
+
+  if (!std::isfinite(det) || std::abs(det) < 1e-300)
+    return false;
+
+  out[0] = (v[0] * (M[1][1] * M[2][2] - M[1][2] * M[2][1]) -
+            M[0][1] * (v[1] * M[2][2] - M[1][2] * v[2]) +
+            M[0][2] * (v[1] * M[2][1] - M[1][1] * v[2])) / det;
+
+  out[1] = (M[0][0] * (v[1] * M[2][2] - M[1][2] * v[2]) -
+            v[0] * (M[1][0] * M[2][2] - M[1][2] * M[2][0]) +
+            M[0][2] * (M[1][0] * v[2] - v[1] * M[2][0])) / det;
+
+  out[2] = (M[0][0] * (M[1][1] * v[2] - v[1] * M[2][1]) -
+            M[0][1] * (M[1][0] * v[2] - v[1] * M[2][0]) +
+            v[0] * (M[1][0] * M[2][1] - M[1][1] * M[2][0])) / det;
+
+  return std::isfinite(out[0]) && std::isfinite(out[1]) && std::isfinite(out[2]);
+};
+
+// MARK: FIT_GAUSSIAN_LOG_PARABOLA
+bool nts::fit_gaussian_log_parabola(const std::vector<float> &x, const std::vector<float> &y, float &A_fitted, float &mu_fitted, float &sigma_fitted)
+{
+  // closed form estimate from log(y) = a + b * x + c * x^2, weighted by y^2 to damp the noisy tails (Guo 2011)
+  const int n = x.size();
+
+  if (n < 3)
+    return false;
+
+  const double x0 = x[nts::find_max_index(y)];
+
+  double M[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+  double v[3] = {0, 0, 0};
+  int n_positive = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    if (!(y[i] > 0))
+      continue;
+
+    n_positive++;
+
+    const double xi = x[i] - x0;
+    const double w = static_cast<double>(y[i]) * y[i];
+    const double ly = std::log(static_cast<double>(y[i]));
+    const double xp[3] = {1, xi, xi * xi};
+
+    for (int r = 0; r < 3; r++)
+    {
+      for (int c = 0; c < 3; c++)
+        M[r][c] += w * xp[r] * xp[c];
+      v[r] += w * xp[r] * ly;
+    }
+  }
+
+  if (n_positive < 3)
+    return false;
+
+  double coef[3];
+
+  if (!nts::solve_linear_system_3x3(M, v, coef))
+    return false;
+
+  if (!(coef[2] < 0))
+    return false;
+
+  const double sigma = std::sqrt(-1 / (2 * coef[2]));
+  const double mu = x0 - coef[1] / (2 * coef[2]);
+  const double A = std::exp(coef[0] - coef[1] * coef[1] / (4 * coef[2]));
+
+  if (!std::isfinite(sigma) || !std::isfinite(mu) || !std::isfinite(A))
+    return false;
+
+  A_fitted = A;
+  mu_fitted = mu;
+  sigma_fitted = sigma;
+
+  return true;
+};
+
 // MARK: FIT_GAUSSIAN
 void nts::fit_gaussian(const std::vector<float> &x, const std::vector<float> &y, float &A_fitted, float &mu_fitted, float &sigma_fitted)
 {
+  // Levenberg-Marquardt with the analytic Jacobian, steps are only accepted when the cost decreases
+  // so the result is never worse than the initial guess
+  const int max_iterations = 50;
+  const double tolerance = 1e-10;
 
-  // Optimization parameters
-  const float learning_rate = 0.001;
-  const int max_iterations = 10000;
-  const float tolerance = 1e-08;
+  const int n = x.size();
 
-  for (int iter = 0; iter < max_iterations; ++iter)
-  {
-    float current_cost = fit_gaussian_cost_function(x, y, A_fitted, mu_fitted, sigma_fitted);
+  if (n == 0)
+    return;
 
-    // Numerical gradient calculation
-    float grad_A = (fit_gaussian_cost_function(x, y, A_fitted + tolerance, mu_fitted, sigma_fitted) - current_cost) / tolerance;
-    float grad_mu = (fit_gaussian_cost_function(x, y, A_fitted, mu_fitted + tolerance, sigma_fitted) - current_cost) / tolerance;
-    float grad_sigma = (fit_gaussian_cost_function(x, y, A_fitted, mu_fitted, sigma_fitted + tolerance) - current_cost) / tolerance;
+  double p[3] = {A_fitted, mu_fitted, sigma_fitted};
 
-    // Update parameters using gradient descent
-    A_fitted -= learning_rate * grad_A;
-    mu_fitted -= learning_rate * grad_mu;
-    sigma_fitted -= learning_rate * grad_sigma;
+  if (!(p[2] > 0))
+    p[2] = 2;
 
-    if (sigma_fitted <= 0)
+  auto cost_of = [&](const double (&q)[3])
+  {
+    double cost = 0;
+    for (int i = 0; i < n; i++)
     {
-      sigma_fitted = 2; // Set to a small positive number if non-positive
+      const double d = x[i] - q[1];
+      const double r = y[i] - q[0] * std::exp(-d * d / (2 * q[2] * q[2]));
+      cost += r * r;
     }
-    if (sigma_fitted > 1e6)
-    { // Arbitrary upper bound for sigma
-      sigma_fitted = 10;
+    return cost;
+  };
+
+  double cost = cost_of(p);
+  double lambda = 1e-3;
+
+  for (int iter = 0; iter < max_iterations; ++iter)
+  {
+    double JtJ[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+    double Jtr[3] = {0, 0, 0};
+
+    const double s2 = p[2] * p[2];
+
+    for (int i = 0; i < n; i++)
+    {
+      const double d = x[i] - p[1];
+      const double e = std::exp(-d * d / (2 * s2));
+      const double f = p[0] * e;
+      const double r = y[i] - f;
+      const double J[3] = {e, f * d / s2, f * d * d / (s2 * p[2])};
+
+      for (int a = 0; a < 3; a++)
+      {
+        for (int b = 0; b < 3; b++)
+          JtJ[a][b] += J[a] * J[b];
+        Jtr[a] += J[a] * r;
+      }
     }
 
-    // Check convergence
-    if (abs(grad_A) < tolerance && abs(grad_mu) < tolerance && abs(grad_sigma) < tolerance)
+    bool improved = false;
+    double new_cost = cost;
+    double delta[3] = {0, 0, 0};
+
+    while (lambda < 1e10)
     {
-      break;
+      double M[3][3];
+      for (int a = 0; a < 3; a++)
+        for (int b = 0; b < 3; b++)
+          M[a][b] = JtJ[a][b];
+
+      for (int a = 0; a < 3; a++)
+        M[a][a] += lambda * std::max(JtJ[a][a], 1e-12);
+
+      if (nts::solve_linear_system_3x3(M, Jtr, delta))
+      {
+        const double q[3] = {p[0] + delta[0], p[1] + delta[1], p[2] + delta[2]};
+
+        if (q[2] > 0)
+        {
+          new_cost = cost_of(q);
+
+          if (new_cost < cost)
+          {
+            p[0] = q[0];
+            p[1] = q[1];
+            p[2] = q[2];
+            lambda = std::max(lambda / 10, 1e-12);
+            improved = true;
+            break;
+          }
+        }
+      }
+
+      lambda *= 10;
     }
+
+    if (!improved)
+      break;
+
+    const double cost_reduction = cost - new_cost;
+
+    cost = new_cost;
+
+    const double step = std::abs(delta[0]) / (std::abs(p[0]) + tolerance) +
+                        std::abs(delta[1]) / (p[2] + tolerance) +
+                        std::abs(delta[2]) / (p[2] + tolerance);
+
+    if (cost_reduction <= tolerance * cost || step < 1e-8)
+      break;
   }
+
+  A_fitted = p[0];
+  mu_fitted = p[1];
+  sigma_fitted = p[2];
 };
 
 // MARK: CALCULATE_GAUSSIAN_RSQUARED
@@ -200,66 +546,40 @@ float nts::calculate_gaussian_rsquared(const std::vector<float> &x, const std::v
 };
 
 // MARK: CALCULATE_GAUSSIAN_FIT
-Rcpp::List nts::calculate_gaussian_fit(const std::string &ft,
-                                       const std::vector<float> &rt,
-                                       const std::vector<float> &intensity,
-                                       const float &baseCut)
+nts::MS_GAUSSIAN_FIT nts::calculate_gaussian_fit(const float *rt,
+                                                const float *intensity,
+                                                const int &n,
+                                                const float &baseCut,
+                                                std::vector<float> &rt_trimmed,
+                                                std::vector<float> &int_trimmed)
 {
 
-  float noise = 0;
-  float sn = 0;
-  float A_fitted = 0;
-  float mu_fitted = 0;
-  float sigma_fitted = 0;
-  float r_squared = 0;
+  MS_GAUSSIAN_FIT quality;
 
-  Rcpp::List quality = Rcpp::List::create(
-      Rcpp::Named("feature") = ft,
-      Rcpp::Named("noise") = noise,
-      Rcpp::Named("sn") = sn,
-      Rcpp::Named("gauss_a") = A_fitted,
-      Rcpp::Named("gauss_u") = mu_fitted,
-      Rcpp::Named("gauss_s") = sigma_fitted,
-      Rcpp::Named("gauss_f") = r_squared);
-
-  size_t max_position = nts::find_max_index(intensity);
+  if (n <= 0)
+    return quality;
+
+  size_t max_position = std::max_element(intensity, intensity + n) - intensity;
   const float max_intensity = intensity[max_position];
 
-  const size_t min_position = nts::find_min_index(intensity);
-  noise = intensity[min_position];
-  sn = max_intensity / noise;
-  noise = round(noise);
-  sn = round(sn * 10) / 10;
-  quality["noise"] = noise;
-  quality["sn"] = sn;
+  const size_t min_position = std::min_element(intensity, intensity + n) - intensity;
+  float noise = intensity[min_position];
+  float sn = max_intensity / noise;
+  quality.noise = round(noise);
+  quality.sn = round(sn * 10) / 10;
 
   const float low_cut = max_intensity * baseCut;
 
-  const int n = rt.size();
-
-  std::vector<float> rt_trimmed(n);
-  std::vector<float> int_trimmed(n);
+  rt_trimmed.clear();
+  int_trimmed.clear();
 
   for (int z = 0; z < n; z++)
   {
-    int_trimmed[z] = intensity[z] - low_cut;
-    rt_trimmed[z] = rt[z];
-  }
-
-  auto it_int_trimmed = int_trimmed.begin();
-  auto it_rt_trimmed = rt_trimmed.begin();
-
-  while (it_int_trimmed != int_trimmed.end())
-  {
-    if (*it_int_trimmed <= 0)
-    {
-      it_int_trimmed = int_trimmed.erase(it_int_trimmed);
-      it_rt_trimmed = rt_trimmed.erase(it_rt_trimmed);
-    }
-    else
+    const float int_z = intensity[z] - low_cut;
+    if (!(int_z <= 0))
     {
-      ++it_int_trimmed;
-      ++it_rt_trimmed;
+      int_trimmed.push_back(int_z);
+      rt_trimmed.push_back(rt[z]);
     }
   }
 
@@ -270,40 +590,119 @@ Rcpp::List nts::calculate_gaussian_fit(const std::string &ft,
 
   max_position = nts::find_max_index(int_trimmed);
 
-  trim_to_equal_length_around_max_position(rt_trimmed, max_position);
-  trim_to_equal_length_around_max_position(int_trimmed, max_position);
+  // equal number of points on both sides of the apex, shifted in place
+  const size_t n_points = std::min(max_position, int_trimmed.size() - max_position - 1);
+  const size_t first = max_position - n_points;
+  n_trimmed = 2 * n_points + 1;
+
+  if (first > 0)
+  {
+    std::move(rt_trimmed.begin() + first, rt_trimmed.begin() + first + n_trimmed, rt_trimmed.begin());
+    std::move(int_trimmed.begin() + first, int_trimmed.begin() + first + n_trimmed, int_trimmed.begin());
+  }
 
-  n_trimmed = rt_trimmed.size();
+  rt_trimmed.resize(n_trimmed);
+  int_trimmed.resize(n_trimmed);
 
   if (n_trimmed < 3)
     return quality;
 
   max_position = nts::find_max_index(int_trimmed);
 
-  A_fitted = int_trimmed[max_position];
-  mu_fitted = rt_trimmed[max_position];
-  sigma_fitted = (rt_trimmed.back() - rt_trimmed.front()) / 4.0;
+  float A_fitted = int_trimmed[max_position];
+  float mu_fitted = rt_trimmed[max_position];
+  float sigma_fitted = (rt_trimmed.back() - rt_trimmed.front()) / 4.0;
+
+  // the log-parabola estimate replaces the apex guess when it starts closer to the data
+  float A_parabola = 0;
+  float mu_parabola = 0;
+  float sigma_parabola = 0;
+
+  if (fit_gaussian_log_parabola(rt_trimmed, int_trimmed, A_parabola, mu_parabola, sigma_parabola))
+  {
+    if (fit_gaussian_cost_function(rt_trimmed, int_trimmed, A_parabola, mu_parabola, sigma_parabola) <
+        fit_gaussian_cost_function(rt_trimmed, int_trimmed, A_fitted, mu_fitted, sigma_fitted))
+    {
+      A_fitted = A_parabola;
+      mu_fitted = mu_parabola;
+      sigma_fitted = sigma_parabola;
+    }
+  }
 
   fit_gaussian(rt_trimmed, int_trimmed, A_fitted, mu_fitted, sigma_fitted);
 
-  r_squared = calculate_gaussian_rsquared(rt_trimmed, int_trimmed, A_fitted, mu_fitted, sigma_fitted);
+  const float r_squared = calculate_gaussian_rsquared(rt_trimmed, int_trimmed, A_fitted, mu_fitted, sigma_fitted);
+
+  quality.gauss_a = round(A_fitted);
+  quality.gauss_u = round(mu_fitted * 10) / 10;
+  quality.gauss_s = round(sigma_fitted * 10) / 10;
+  quality.gauss_f = round(r_squared * 10000) / 10000;
+
+  return quality;
+};
+
+Rcpp::List nts::calculate_gaussian_fit(const std::string &ft,
+                                       const std::vector<float> &rt,
+                                       const std::vector<float> &intensity,
+                                       const float &baseCut)
+{
+
+  std::vector<float> rt_trimmed;
+  std::vector<float> int_trimmed;
+
+  const MS_GAUSSIAN_FIT q = calculate_gaussian_fit(rt.data(), intensity.data(), rt.size(), baseCut, rt_trimmed, int_trimmed);
+
+  Rcpp::List quality = Rcpp::List::create(
+      Rcpp::Named("feature") = ft,
+      Rcpp::Named("noise") = q.noise,
+      Rcpp::Named("sn") = q.sn,
+      Rcpp::Named("gauss_a") = q.gauss_a,
+      Rcpp::Named("gauss_u") = q.gauss_u,
+      Rcpp::Named("gauss_s") = q.gauss_s,
+      Rcpp::Named("gauss_f") = q.gauss_f);
+
+  return quality;
+};
+
+nts::MS_FEATURES_QUALITY nts::calculate_gaussian_fit(const std::vector<int64_t> &offsets,
+                                                    const std::vector<float> &rt,
+                                                    const std::vector<float> &intensity,
+                                                    const float &baseCut)
+{
+
+  MS_FEATURES_QUALITY quality;
+
+  const int number_features = offsets.empty() ? 0 : offsets.size() - 1;
+
+  quality.resize_all(number_features);
+
+#pragma omp parallel
+  {
+    std::vector<float> rt_trimmed;
+    std::vector<float> int_trimmed;
+
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < number_features; i++)
+    {
+      const int n = offsets[i + 1] - offsets[i];
 
-  A_fitted = round(A_fitted);
-  mu_fitted = round(mu_fitted * 10) / 10;
-  sigma_fitted = round(sigma_fitted * 10) / 10;
-  r_squared = round(r_squared * 10000) / 10000;
+      const MS_GAUSSIAN_FIT q = calculate_gaussian_fit(rt.data() + offsets[i], intensity.data() + offsets[i], n, baseCut, rt_trimmed, int_trimmed);
 
-  quality["gauss_a"] = A_fitted;
-  quality["gauss_u"] = mu_fitted;
-  quality["gauss_s"] = sigma_fitted;
-  quality["gauss_f"] = r_squared;
+      quality.noise[i] = q.noise;
+      quality.sn[i] = q.sn;
+      quality.gauss_a[i] = q.gauss_a;
+      quality.gauss_u[i] = q.gauss_u;
+      quality.gauss_s[i] = q.gauss_s;
+      quality.gauss_f[i] = q.gauss_f;
+    }
+  }
 
   return quality;
 };
 
 // MARK: FIND_ISOTOPIC_CANDIDATES
 std::vector<int> nts::find_isotopic_candidates(
-    const int &number_features,
+    const MS_FEATURES_RT_INDEX &rt_index,
     const std::vector<std::string> &features,
     const std::vector<float> &mzs,
     const std::vector<float> &rts,
@@ -330,7 +729,10 @@ std::vector<int> nts::find_isotopic_candidates(
   rtmin = rt - rtW;
   rtmax = rt + rtW;
 
-  for (int z = 0; z < number_features; ++z)
+  std::vector<int> window;
+  rt_index.find(rtmin, rtmax, mz, max_mz_chain, window);
+
+  for (const int &z : window)
   {
     if (rts[z] >= rtmin && rts[z] <= rtmax && mzs[z] > mz && mzs[z] <= max_mz_chain && pols[z] == pol && features[z] != feature)
     {
@@ -356,13 +758,47 @@ bool nts::is_max_gap_reached(const int &s, const int &maxGaps, const std::vector
   return false;
 };
 
-// MARK: ANNOTATE_ISOTOPES
-void nts::annotate_isotopes(MS_ANNOTATION &af,
-                            const MS_ISOTOPE_COMBINATIONS &combinations,
-                            const MS_CANDIDATE_CHAIN &candidates_chain,
-                            const int &maxIsotopes,
-                            const int &maxCharge,
-                            const int &maxGaps)
+// MARK: GET_ISOTOPE_COMBINATIONS
+const nts::MS_ISOTOPE_COMBINATIONS &nts::get_isotope_combinations(const std::vector<std::string> &elements,
+                                                                  const int &max_number_elements)
+{
+  // the combinations only depend on the elements and length, so they are built once per process
+  static std::mutex cache_mutex;
+  static std::map<std::pair<std::vector<std::string>, int>, std::unique_ptr<const MS_ISOTOPE_COMBINATIONS>> cache;
+
+  std::vector<std::string> key_elements = elements;
+  std::sort(key_elements.begin(), key_elements.end());
+  key_elements.erase(std::unique(key_elements.begin(), key_elements.end()), key_elements.end());
+
+  const std::pair<std::vector<std::string>, int> key(key_elements, max_number_elements);
+
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  auto it = cache.find(key);
+
+  if (it != cache.end())
+    return *it->second;
+
+  MS_ISOTOPE_SET isotopes;
+  isotopes.filter(key_elements);
+
+  std::unique_ptr<const MS_ISOTOPE_COMBINATIONS> combinations(new MS_ISOTOPE_COMBINATIONS(isotopes, max_number_elements));
+  const MS_ISOTOPE_COMBINATIONS &out = *combinations;
+  cache[key] = std::move(combinations);
+
+  return out;
+};
+
+// MARK: RESOLVE_ISOTOPES
+void nts::resolve_isotopes(MS_ANNOTATION &rows,
+                           std::vector<std::pair<int, float>> &consulted,
+                           const std::vector<int> &iso_step,
+                           const std::vector<float> &iso_mass_distance_error,
+                           const MS_ISOTOPE_COMBINATIONS &combinations,
+                           const MS_CANDIDATE_CHAIN &candidates_chain,
+                           const int &maxIsotopes,
+                           const int &maxCharge,
+                           const int &maxGaps)
 {
 
   bool is_Mplus = false;
@@ -405,25 +841,19 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
       if (nts::is_max_gap_reached(s, maxGaps, iso_chain.step))
         break;
 
-      std::vector<int> which_combinations;
+      const int c_begin = combinations.step_begin(s);
+      const int c_end = combinations.step_end(s);
+      const bool has_combinations = c_begin < c_end;
 
-      for (int c = 0; c < combinations.length; ++c)
-        if (combinations.step[c] == s)
-          which_combinations.push_back(c);
+      float mass_distance_max = 0;
+      float mass_distance_min = 0;
 
-      const int number_combinations = which_combinations.size();
-
-      std::vector<float> mass_distances(number_combinations);
-
-      for (int c = 0; c < number_combinations; ++c)
+      if (has_combinations)
       {
-        mass_distances[c] = combinations.mass_distances[which_combinations[c]];
-        mass_distances[c] = mass_distances[c] / charge;
+        mass_distance_max = combinations.step_mass_distance_max[s] / charge;
+        mass_distance_min = combinations.step_mass_distance_min[s] / charge;
       }
 
-      const float mass_distance_max = *std::max_element(mass_distances.begin(), mass_distances.end());
-      const float mass_distance_min = *std::min_element(mass_distances.begin(), mass_distances.end());
-
       for (int candidate = 1; candidate < number_candidates; ++candidate)
       {
 
@@ -432,7 +862,7 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
         const float &mz = candidates_chain.mz[candidate];
         const float &rt = candidates_chain.rt[candidate];
         const float &intensity = candidates_chain.intensity[candidate];
-        const bool &was_annotated = af.iso_step[index] > 0;
+        const bool was_annotated = iso_step[index] > 0;
 
         float candidate_mass_distance = mz - mono_mz;
         float candidate_time_error = std::abs(rt - mono_rt);
@@ -452,23 +882,22 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
             // TODO this will also capture 2H loss and mark it as M+
             // the mass error might give an indication to check
 
-            af.index[mono_index] = mono_index;
-            af.feature[mono_index] = mono_feature;
-            af.component_feature[mono_index] = feature;
-            af.iso_step[mono_index] = -1;
-            af.iso_cat[mono_index] = "M+";
-            af.iso_isotope[mono_index] = "";
-            af.iso_charge[mono_index] = charge;
-            af.iso_mzr[mono_index] = mzr;
-            af.iso_mass_distance[mono_index] = candidate_mass_distance;
-            af.iso_theoretical_mass_distance[mono_index] = 0;
-            af.iso_mass_distance_error[mono_index] = std::abs(candidate_mass_distance - 1.007276);
-            af.iso_time_error[mono_index] = candidate_time_error;
-            af.iso_relative_intensity[mono_index] = mono_intensity / intensity;
-            af.iso_theoretical_min_relative_intensity[mono_index] = 0;
-            af.iso_theoretical_max_relative_intensity[mono_index] = 0;
-            af.iso_size[mono_index] = 0;
-            af.iso_number_carbons[mono_index] = 0;
+            const int r = rows.add_row(mono_index);
+            rows.component_index[r] = index;
+            rows.iso_step[r] = -1;
+            rows.iso_cat[r] = rows.iso_cat_levels.code("M+");
+            rows.iso_isotope[r] = 0;
+            rows.iso_charge[r] = charge;
+            rows.iso_mzr[r] = mzr;
+            rows.iso_mass_distance[r] = candidate_mass_distance;
+            rows.iso_theoretical_mass_distance[r] = 0;
+            rows.iso_mass_distance_error[r] = std::abs(candidate_mass_distance - 1.007276);
+            rows.iso_time_error[r] = candidate_time_error;
+            rows.iso_relative_intensity[r] = mono_intensity / intensity;
+            rows.iso_theoretical_min_relative_intensity[r] = 0;
+            rows.iso_theoretical_max_relative_intensity[r] = 0;
+            rows.iso_size[r] = 0;
+            rows.iso_number_carbons[r] = 0;
 
             is_Mplus = true;
             break;
@@ -479,33 +908,24 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
         double combination_mass_error = 10; // is updated on the first hit
 
         // when candidate is inside of the mass distance for isotopic step mass distances
-        if (mass_distance_min - mzr < candidate_mass_distance && mass_distance_max + mzr > candidate_mass_distance)
+        if (has_combinations && mass_distance_min - mzr < candidate_mass_distance && mass_distance_max + mzr > candidate_mass_distance)
         {
 
           // selects the combinations within the mass distance, when duplicated mass distances, the first hit is the one stored
-          for (int c = 0; c < number_combinations; c++)
+          for (int c = c_begin; c < c_end; c++)
           {
 
-            const float candidate_mass_distance_error = abs(mass_distances[c] - candidate_mass_distance);
-            const std::vector<std::string> &combination = combinations.tensor_combinations[which_combinations[c]];
+            const float theoretical_mass_distance = combinations.mass_distances[c] / charge;
+            const float candidate_mass_distance_error = abs(theoretical_mass_distance - candidate_mass_distance);
 
             float min_rel_int = 1;
             float max_rel_int = 1;
 
-            std::unordered_map<std::string, int> isotope_map;
-
-            for (size_t e = 0; e < combination.size(); ++e)
+            for (int e = combinations.isotopes_offsets[c]; e < combinations.isotopes_offsets[c + 1]; ++e)
             {
-              std::string e_el = combination[e];
-              isotope_map[e_el]++;
-            }
-
-            for (const auto &pair : isotope_map)
-            {
-              std::string iso = pair.first;
-              int iso_n = pair.second;
-
-              const int iso_idx = std::distance(combinations.isotopes_str.begin(), std::find(combinations.isotopes_str.begin(), combinations.isotopes_str.end(), iso));
+              const int iso_idx = combinations.isotopes_code[e];
+              const int iso_n = combinations.isotopes_count[e];
+              const bool is_13C = iso_idx == combinations.code_13C;
 
               const float iso_ab = combinations.abundances[iso_idx];
               const float mono_ab = combinations.abundances_monoisotopic[iso_idx];
@@ -513,14 +933,14 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
               float max_el_num = combinations.max[iso_idx];
 
               // narrows the range for n carbons based on estimation
-              if (iso_n == 1 && iso == "13C" && s == 1)
+              if (iso_n == 1 && is_13C && s == 1)
               {
                 iso_chain.number_carbons = intensity / (iso_ab * mono_intensity);
                 min_el_num = iso_chain.number_carbons * 0.8;
                 max_el_num = iso_chain.number_carbons * 1.2;
               }
 
-              if (iso == "13C" && s > 2)
+              if (is_13C && s > 2)
               {
                 min_el_num = iso_chain.number_carbons * 0.8;
                 max_el_num = iso_chain.number_carbons * 1.2;
@@ -575,8 +995,11 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
                 rel_int <= max_rel_int * 1.3)
             {
 
+              // the outcome depends on the annotation state of the candidate from here on
+              consulted.emplace_back(index, candidate_mass_distance_error);
+
               if (was_annotated)
-                if (af.iso_mass_distance_error[index] <= candidate_mass_distance_error)
+                if (iso_mass_distance_error[index] <= candidate_mass_distance_error)
                   continue;
 
               combination_mass_error = candidate_mass_distance_error;
@@ -590,18 +1013,15 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
               if (is_in_chain)
               {
                 const int i = std::distance(iso_chain.feature.begin(), std::find(iso_chain.feature.begin(), iso_chain.feature.end(), feature));
-                std::string concat_combination = combination[0];
-                for (size_t e = 1; e < combination.size(); ++e)
-                  concat_combination += "/" + combination[e];
                 iso_chain.feature[i] = feature;
                 iso_chain.index[i] = index;
                 iso_chain.step[i] = i;
                 iso_chain.mz[i] = mz;
                 iso_chain.mzr[i] = mzr;
                 iso_chain.rt[i] = rt;
-                iso_chain.isotope[i] = concat_combination;
+                iso_chain.isotope[i] = combinations.labels[c];
                 iso_chain.mass_distance[i] = candidate_mass_distance;
-                iso_chain.theoretical_mass_distance[i] = mass_distances[c];
+                iso_chain.theoretical_mass_distance[i] = theoretical_mass_distance;
                 iso_chain.mass_distance_error[i] = candidate_mass_distance_error;
                 iso_chain.time_error[i] = candidate_time_error;
                 iso_chain.abundance[i] = rel_int;
@@ -610,9 +1030,6 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
               }
               else
               {
-                std::string concat_combination = combination[0];
-                for (size_t e = 1; e < combination.size(); ++e)
-                  concat_combination += "/" + combination[e];
                 iso_chain.feature.push_back(feature);
                 iso_chain.index.push_back(index);
                 iso_chain.step.push_back(s);
@@ -620,9 +1037,9 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
                 iso_chain.mz.push_back(mz);
                 iso_chain.mzr.push_back(mzr);
                 iso_chain.rt.push_back(rt);
-                iso_chain.isotope.push_back(concat_combination);
+                iso_chain.isotope.push_back(combinations.labels[c]);
                 iso_chain.mass_distance.push_back(candidate_mass_distance);
-                iso_chain.theoretical_mass_distance.push_back(mass_distances[c]);
+                iso_chain.theoretical_mass_distance.push_back(theoretical_mass_distance);
                 iso_chain.mass_distance_error.push_back(candidate_mass_distance_error);
                 iso_chain.time_error.push_back(candidate_time_error);
                 iso_chain.abundance.push_back(rel_int);
@@ -656,57 +1073,77 @@ void nts::annotate_isotopes(MS_ANNOTATION &af,
 
     MS_ISOTOPE_CHAIN &iso_chain = isotopic_chains[best_chain];
 
-    af.index[mono_index] = mono_index;
-    af.feature[mono_index] = mono_feature;
-    af.component_feature[mono_index] = mono_feature;
-    af.iso_step[mono_index] = 0;
-    af.iso_cat[mono_index] = "M+0";
-    af.iso_isotope[mono_index] = "";
-    af.iso_charge[mono_index] = iso_chain.charge[0];
-    af.iso_mzr[mono_index] = std::round(iso_chain.mzr[0] * 100000.0) / 100000.0;
-    af.iso_mass_distance[mono_index] = 0;
-    af.iso_theoretical_mass_distance[mono_index] = 0;
-    af.iso_mass_distance_error[mono_index] = 0;
-    af.iso_time_error[mono_index] = 0;
-    af.iso_relative_intensity[mono_index] = 1;
-    af.iso_theoretical_min_relative_intensity[mono_index] = 0;
-    af.iso_theoretical_max_relative_intensity[mono_index] = 0;
-    af.iso_size[mono_index] = iso_chain.length;
+    const int r = rows.add_row(mono_index);
+    rows.component_index[r] = mono_index;
+    rows.iso_step[r] = 0;
+    rows.iso_cat[r] = rows.iso_cat_levels.code("M+0");
+    rows.iso_isotope[r] = 0;
+    rows.iso_charge[r] = iso_chain.charge[0];
+    rows.iso_mzr[r] = std::round(iso_chain.mzr[0] * 100000.0) / 100000.0;
+    rows.iso_mass_distance[r] = 0;
+    rows.iso_theoretical_mass_distance[r] = 0;
+    rows.iso_mass_distance_error[r] = 0;
+    rows.iso_time_error[r] = 0;
+    rows.iso_relative_intensity[r] = 1;
+    rows.iso_theoretical_min_relative_intensity[r] = 0;
+    rows.iso_theoretical_max_relative_intensity[r] = 0;
+    rows.iso_size[r] = iso_chain.length;
     iso_chain.number_carbons = std::round(iso_chain.number_carbons);
-    af.iso_number_carbons[mono_index] = iso_chain.number_carbons;
+    rows.iso_number_carbons[r] = iso_chain.number_carbons;
 
     if (iso_chain.length > 1)
     {
+      std::string mono_isotope;
+
       for (int i = 1; i < iso_chain.length; i++)
       {
-        const int iso_index = iso_chain.index[i];
-        af.index[iso_index] = iso_index;
-        af.feature[iso_index] = iso_chain.feature[i];
-        af.component_feature[iso_index] = mono_feature;
-        af.iso_step[iso_index] = iso_chain.step[i];
-        af.iso_cat[iso_index] = "M+" + std::to_string(iso_chain.step[i]);
-        af.iso_charge[iso_index] = iso_chain.charge[i];
-        af.iso_mzr[iso_index] = std::round(iso_chain.mzr[i] * 100000.0) / 100000.0;
-        af.iso_mass_distance[iso_index] = std::round(iso_chain.mass_distance[i] * 100000.0) / 100000.0;
-        af.iso_theoretical_mass_distance[iso_index] = std::round(iso_chain.theoretical_mass_distance[i] * 100000.0) / 100000.0;
-        af.iso_mass_distance_error[iso_index] = std::round(iso_chain.mass_distance_error[i] * 100000.0) / 100000.0;
-        af.iso_time_error[iso_index] = std::round(iso_chain.time_error[i] * 10.0) / 10.0;
-        af.iso_relative_intensity[iso_index] = std::round(iso_chain.abundance[i] * 100000.0) / 100000.0;
-        af.iso_theoretical_min_relative_intensity[iso_index] = std::round(iso_chain.theoretical_abundance_min[i] * 100000.0) / 100000.0;
-        af.iso_theoretical_max_relative_intensity[iso_index] = std::round(iso_chain.theoretical_abundance_max[i] * 100000.0) / 100000.0;
-        af.iso_size[iso_index] = iso_chain.length;
-        af.iso_number_carbons[iso_index] = iso_chain.number_carbons;
-        af.iso_isotope[iso_index] = iso_chain.isotope[i];
-
-        af.iso_isotope[mono_index] += " " + iso_chain.isotope[i];
+        const int r_iso = rows.add_row(iso_chain.index[i]);
+        rows.component_index[r_iso] = mono_index;
+        rows.iso_step[r_iso] = iso_chain.step[i];
+        rows.iso_cat[r_iso] = rows.iso_cat_levels.code("M+" + std::to_string(iso_chain.step[i]));
+        rows.iso_charge[r_iso] = iso_chain.charge[i];
+        rows.iso_mzr[r_iso] = std::round(iso_chain.mzr[i] * 100000.0) / 100000.0;
+        rows.iso_mass_distance[r_iso] = std::round(iso_chain.mass_distance[i] * 100000.0) / 100000.0;
+        rows.iso_theoretical_mass_distance[r_iso] = std::round(iso_chain.theoretical_mass_distance[i] * 100000.0) / 100000.0;
+        rows.iso_mass_distance_error[r_iso] = std::round(iso_chain.mass_distance_error[i] * 100000.0) / 100000.0;
+        rows.iso_time_error[r_iso] = std::round(iso_chain.time_error[i] * 10.0) / 10.0;
+        rows.iso_relative_intensity[r_iso] = std::round(iso_chain.abundance[i] * 100000.0) / 100000.0;
+        rows.iso_theoretical_min_relative_intensity[r_iso] = std::round(iso_chain.theoretical_abundance_min[i] * 100000.0) / 100000.0;
+        rows.iso_theoretical_max_relative_intensity[r_iso] = std::round(iso_chain.theoretical_abundance_max[i] * 100000.0) / 100000.0;
+        rows.iso_size[r_iso] = iso_chain.length;
+        rows.iso_number_carbons[r_iso] = iso_chain.number_carbons;
+        rows.iso_isotope[r_iso] = rows.iso_isotope_levels.code(iso_chain.isotope[i]);
+
+        mono_isotope += " " + iso_chain.isotope[i];
       }
+
+      rows.iso_isotope[r] = rows.iso_isotope_levels.code(mono_isotope);
     }
   }
 };
 
+// MARK: ANNOTATE_ISOTOPES
+void nts::annotate_isotopes(MS_ANNOTATION &af,
+                            const MS_ISOTOPE_COMBINATIONS &combinations,
+                            const MS_CANDIDATE_CHAIN &candidates_chain,
+                            const int &maxIsotopes,
+                            const int &maxCharge,
+                            const int &maxGaps)
+{
+  MS_ANNOTATION rows(0);
+  std::vector<std::pair<int, float>> consulted;
+
+  resolve_isotopes(rows, consulted, af.iso_step, af.iso_mass_distance_error, combinations, candidates_chain, maxIsotopes, maxCharge, maxGaps);
+
+  const int number_rows = rows.size();
+
+  for (int r = 0; r < number_rows; r++)
+    af.set_isotope_row(rows, r);
+};
+
 // MARK: FIND_ADDUCT_CANDIDATES
 std::vector<int> nts::find_adduct_candidates(
-    const int &number_features,
+    const MS_FEATURES_RT_INDEX &rt_index,
     const std::vector<float> &mzs,
     const std::vector<float> &rts,
     const std::vector<int> &pols,
@@ -732,7 +1169,10 @@ std::vector<int> nts::find_adduct_candidates(
   rtmin = rt - rtW;
   rtmax = rt + rtW;
 
-  for (int z = 0; z < number_features; ++z)
+  std::vector<int> window;
+  rt_index.find(rtmin, rtmax, mz, max_mz_adducts, window);
+
+  for (const int &z : window)
   {
     if (rts[z] >= rtmin && rts[z] <= rtmax && mzs[z] > mz && mzs[z] <= max_mz_adducts && pols[z] == pol && iso_step[z] == 0)
     {
@@ -755,7 +1195,7 @@ void nts::annotate_adducts(MS_ANNOTATION &af, const MS_CANDIDATE_CHAIN &candidat
 
   const int number_candidates = candidates_chain.length;
 
-  const std::string &mion_feature = candidates_chain.feature[0];
+  const int &mion_index = candidates_chain.index[0];
   const float &mion_mz = candidates_chain.mz[0];
   const float &mion_rt = candidates_chain.rt[0];
   const float &mion_mzr = candidates_chain.mzr[0];
@@ -774,10 +1214,9 @@ void nts::annotate_adducts(MS_ANNOTATION &af, const MS_CANDIDATE_CHAIN &candidat
 
       const int &index = candidates_chain.index[c];
 
-      if (af.adduct_cat[index] != "")
+      if (af.adduct_cat[index] != 0)
         continue;
 
-      const std::string &feature = candidates_chain.feature[c];
       const float &mz = candidates_chain.mz[c];
       const float &rt = candidates_chain.rt[c];
       const float exp_mass_distance = mz - (mion_mz + neutralizer);
@@ -787,10 +1226,9 @@ void nts::annotate_adducts(MS_ANNOTATION &af, const MS_CANDIDATE_CHAIN &candidat
       if (mass_error < mion_mzr)
       {
         af.index[index] = index;
-        af.feature[index] = feature;
-        af.component_feature[index] = mion_feature;
-        af.adduct_cat[index] = adduct_cat;
-        af.adduct_element[index] = adduct_element;
+        af.component_index[index] = mion_index;
+        af.adduct_cat[index] = af.adduct_cat_levels.code(adduct_cat);
+        af.adduct_element[index] = af.adduct_element_levels.code(adduct_element);
         af.adduct_time_error[index] = std::round(time_error * 10.0) / 10.0;
         af.adduct_mass_error[index] = std::round(mass_error * 100000.0) / 100000.0;
         break;
@@ -799,6 +1237,453 @@ void nts::annotate_adducts(MS_ANNOTATION &af, const MS_CANDIDATE_CHAIN &candidat
   }
 };
 
+// MARK: ANNOTATE_FEATURES
+void nts::annotate_features(MS_ANNOTATION &af,
+                            const MS_FEATURES_MZ_SORTED &fdf,
+                            const MS_ISOTOPE_COMBINATIONS &combinations,
+                            const float &rtWindowAlignment,
+                            const int &maxIsotopes,
+                            const int &maxCharge,
+                            const int &maxGaps)
+{
+
+  const int number_features = fdf.n;
+
+  if (number_features == 0)
+    return;
+
+  const MS_FEATURES_RT_INDEX rt_index(fdf);
+
+  // chains of a block are resolved in parallel against an empty annotation and committed in the serial order,
+  // a chain is resolved again on commit only when an earlier chain changed the decision on one of its candidates
+  const std::vector<int> empty_iso_step(number_features, 0);
+  const std::vector<float> empty_iso_mass_distance_error(number_features, 0);
+
+  // speculation resolves chains of features that become isotopes later in the block, so it only pays off with threads
+  const bool is_speculative = omp_get_max_threads() > 1;
+
+  const int block_size = std::min(number_features, 4096);
+
+  auto find_candidates = [&](const int &f, std::vector<int> &candidates)
+  {
+    float rtmin = fdf.rtmin[f];
+    float rtmax = fdf.rtmax[f];
+    const float max_mz_chain = (fdf.mz[f] + maxIsotopes) * 1.05;
+
+    candidates = nts::find_isotopic_candidates(
+        rt_index,
+        fdf.feature, fdf.mz, fdf.rt, fdf.polarity,
+        fdf.polarity[f], fdf.feature[f], fdf.mz[f], fdf.mzmin[f], fdf.mzmax[f], fdf.rt[f], rtmin, rtmax,
+        rtWindowAlignment, max_mz_chain);
+
+    if (candidates.size() > 0)
+      candidates.insert(candidates.begin(), f);
+  };
+
+  std::vector<std::vector<int>> block_candidates(block_size);
+  std::vector<std::vector<std::pair<int, float>>> block_consulted(block_size);
+  std::vector<MS_ANNOTATION> block_rows(block_size, MS_ANNOTATION(0));
+
+  for (int start = 0; start < number_features; start += block_size)
+  {
+
+    const int end = std::min(start + block_size, number_features);
+
+#pragma omp parallel for schedule(dynamic, 16) if (is_speculative)
+    for (int f = start; f < end; f++)
+    {
+
+      const int b = f - start;
+
+      std::vector<int> &candidates = block_candidates[b];
+      candidates.clear();
+      block_consulted[b].clear();
+      block_rows[b].resize_all(0);
+
+      if (!is_speculative)
+        continue;
+
+      if (af.iso_step[fdf.index[f]] > 0)
+        continue; // already isotope
+
+      find_candidates(f, candidates);
+
+      if (candidates.size() == 0)
+        continue;
+
+      const MS_CANDIDATE_CHAIN candidates_chain(candidates, fdf.feature, fdf.index, fdf.mz, fdf.mzmin, fdf.mzmax, fdf.rt, fdf.intensity);
+
+      resolve_isotopes(block_rows[b], block_consulted[b], empty_iso_step, empty_iso_mass_distance_error,
+                       combinations, candidates_chain, maxIsotopes, maxCharge, maxGaps);
+    }
+
+    for (int f = start; f < end; f++)
+    {
+
+      const int b = f - start;
+
+      const int &index = fdf.index[f];
+
+      if (af.iso_step[index] > 0)
+        continue; // already isotope
+
+      std::vector<int> &candidates = block_candidates[b];
+
+      if (!is_speculative)
+        find_candidates(f, candidates);
+
+      if (candidates.size() == 0)
+      {
+        af.index[index] = index;
+        af.component_index[index] = index;
+        af.iso_step[index] = 0;
+        af.iso_cat[index] = af.iso_cat_levels.code("M+0");
+        af.iso_isotope[index] = 0;
+        af.iso_charge[index] = 1;
+        af.iso_mzr[index] = 0;
+        af.iso_mass_distance[index] = 0;
+        af.iso_theoretical_mass_distance[index] = 0;
+        af.iso_mass_distance_error[index] = 0;
+        af.iso_time_error[index] = 0;
+        af.iso_relative_intensity[index] = 1;
+        af.iso_theoretical_min_relative_intensity[index] = 0;
+        af.iso_theoretical_max_relative_intensity[index] = 0;
+        af.iso_number_carbons[index] = 0;
+        af.iso_size[index] = 0;
+        continue;
+      }
+
+      MS_ANNOTATION &rows = block_rows[b];
+
+      bool is_valid = is_speculative;
+
+      // an earlier isotope only changes the chain when its mass error is not larger than the one found here
+      for (const std::pair<int, float> &c : block_consulted[b])
+      {
+        if (af.iso_step[c.first] > 0 && af.iso_mass_distance_error[c.first] <= c.second)
+        {
+          is_valid = false;
+          break;
+        }
+      }
+
+      if (!is_valid)
+      {
+        const MS_CANDIDATE_CHAIN candidates_chain(candidates, fdf.feature, fdf.index, fdf.mz, fdf.mzmin, fdf.mzmax, fdf.rt, fdf.intensity);
+        rows.resize_all(0);
+        block_consulted[b].clear();
+        resolve_isotopes(rows, block_consulted[b], af.iso_step, af.iso_mass_distance_error,
+                         combinations, candidates_chain, maxIsotopes, maxCharge, maxGaps);
+      }
+
+      const int number_rows = rows.size();
+
+      for (int r = 0; r < number_rows; r++)
+        af.set_isotope_row(rows, r);
+    }
+  }
+
+  // adduct candidates only depend on the isotope annotation, which is final at this point
+  for (int start = 0; start < number_features; start += block_size)
+  {
+
+    const int end = std::min(start + block_size, number_features);
+
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int f = start; f < end; f++)
+    {
+
+      std::vector<int> &candidates = block_candidates[f - start];
+      candidates.clear();
+
+      if (af.iso_step[fdf.index[f]] > 0)
+        continue; // already isotope
+
+      float rtmin = fdf.rtmin[f];
+      float rtmax = fdf.rtmax[f];
+      const float max_mz_adducts = (fdf.mz[f] + 100);
+
+      candidates = nts::find_adduct_candidates(
+          rt_index, fdf.mz, fdf.rt, fdf.polarity, af.iso_step,
+          fdf.polarity[f], fdf.mz[f], fdf.mzmin[f], fdf.mzmax[f], fdf.rt[f], rtmin, rtmax,
+          rtWindowAlignment, max_mz_adducts);
+    }
+
+    for (int f = start; f < end; f++)
+    {
+
+      const int &index = fdf.index[f];
+
+      if (af.iso_step[index] > 0)
+        continue; // already isotope
+
+      if (af.adduct_cat[index] != 0)
+        continue; // already adduct
+
+      std::vector<int> &candidates = block_candidates[f - start];
+
+      if (candidates.size() > 0)
+      {
+        candidates.insert(candidates.begin(), f);
+        const MS_CANDIDATE_CHAIN candidates_chain(candidates, fdf.feature, fdf.index, fdf.mz, fdf.mzmin, fdf.mzmax, fdf.rt, fdf.intensity);
+        nts::annotate_adducts(af, candidates_chain, fdf.polarity[f]);
+      }
+    }
+  }
+};
+
+// MARK: ANNOTATE_ANALYSES_FEATURES
+void nts::annotate_analyses_features(std::vector<MS_ANNOTATION> &af,
+                                     const std::vector<MS_FEATURES_MZ_SORTED> &fdf,
+                                     const MS_ISOTOPE_COMBINATIONS &combinations,
+                                     const float &rtWindowAlignment,
+                                     const int &maxIsotopes,
+                                     const int &maxCharge,
+                                     const int &maxGaps)
+{
+
+  const int number_analyses = fdf.size();
+
+  if (number_analyses == 0)
+    return;
+
+  // one analysis per thread, spare threads are handed to the nested regions of annotate_features
+  const int max_threads = omp_get_max_threads();
+  const int outer_threads = std::min(number_analyses, max_threads);
+  const int inner_threads = std::max(1, max_threads / outer_threads);
+  const int max_active_levels = omp_get_max_active_levels();
+
+  if (outer_threads > 1 && inner_threads > 1)
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel for num_threads(outer_threads) schedule(dynamic)
+  for (int a = 0; a < number_analyses; a++)
+  {
+    omp_set_num_threads(inner_threads);
+    annotate_features(af[a], fdf[a], combinations, rtWindowAlignment, maxIsotopes, maxCharge, maxGaps);
+  }
+
+  omp_set_max_active_levels(max_active_levels);
+};
+
+// MARK: CLUSTER_SPECTRUM
+template <typename T>
+nts::MS_CLUSTERED_SPECTRUM<T> nts::cluster_spectrum(const std::vector<T> &rt,
+                                                    const std::vector<T> &mz,
+                                                    const std::vector<T> &intensity,
+                                                    const std::vector<T> &pre_ce,
+                                                    const std::vector<T> &pre_mz,
+                                                    const T &mzClust,
+                                                    const T &presence)
+{
+
+  MS_CLUSTERED_SPECTRUM<T> res;
+
+  const int n = mz.size();
+
+  if (n == 0)
+    return res;
+
+  std::vector<int> idx(n);
+  std::iota(idx.begin(), idx.end(), 0);
+
+  std::stable_sort(idx.begin(), idx.end(), [&mz](int i, int j)
+                   { return mz[i] < mz[j]; });
+
+  // equal values share a code, NaN included, so that unique scans and collision energies are counted with a stamp array
+  auto codes = [&idx, &n](const std::vector<T> &x, std::vector<int> &code)
+  {
+    std::vector<T> values;
+    bool has_nan = false;
+
+    for (const T &v : x)
+    {
+      if (std::isnan(v))
+        has_nan = true;
+      else
+        values.push_back(v);
+    }
+
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    code.resize(n);
+
+    for (int k = 0; k < n; k++)
+    {
+      const T &v = x[idx[k]];
+      code[k] = std::isnan(v) ? values.size() : std::lower_bound(values.begin(), values.end(), v) - values.begin();
+    }
+
+    return static_cast<int>(values.size()) + (has_nan ? 1 : 0);
+  };
+
+  std::vector<T> s_mz(n);
+  std::vector<T> s_intensity(n);
+
+  for (int k = 0; k < n; k++)
+  {
+    s_mz[k] = mz[idx[k]];
+    s_intensity[k] = intensity[idx[k]];
+  }
+
+  std::vector<int> scan;
+  const size_t number_scans = codes(rt, scan);
+
+  bool pre_ce_has_nan = pre_ce.empty();
+
+  for (const T &v : pre_ce)
+    if (std::isnan(v))
+      pre_ce_has_nan = true;
+
+  std::vector<int> ce(n, 0);
+  const size_t number_ces = pre_ce.empty() ? 1 : codes(pre_ce, ce);
+
+  std::vector<int> scan_stamp(number_scans, -1);
+  std::vector<int> ce_stamp(number_ces, -1);
+
+  // mzClust is tightened while any m/z cluster has more than one trace from the same scan,
+  // every trial is a single sweep over the m/z sorted traces
+  T itMzClust = mzClust;
+
+  int counter = 0;
+
+  while (true)
+  {
+    counter = counter + 1;
+
+    if (counter > 10 || itMzClust < 0.0001)
+      break;
+
+    bool fromSameScan = false;
+    int cluster = 0;
+
+    std::fill(scan_stamp.begin(), scan_stamp.end(), -1);
+
+    for (int k = 0; k < n; k++)
+    {
+      if (k > 0 && s_mz[k] - s_mz[k - 1] > itMzClust)
+        cluster++;
+
+      if (scan_stamp[scan[k]] == cluster)
+      {
+        fromSameScan = true;
+        break;
+      }
+
+      scan_stamp[scan[k]] = cluster;
+    }
+
+    if (!fromSameScan)
+      break;
+
+    itMzClust = itMzClust - 0.0001;
+  }
+
+  res.mz_clust = itMzClust;
+  res.iterations = counter;
+
+  std::fill(scan_stamp.begin(), scan_stamp.end(), -1);
+
+  int begin = 0;
+  int cluster = 0;
+
+  while (begin < n)
+  {
+    int end = begin + 1;
+    while (end < n && !(s_mz[end] - s_mz[end - 1] > itMzClust))
+      end++;
+
+    size_t temp_scans = 0;
+    size_t temp_ces = 0;
+    T max_intensity = s_intensity[begin];
+    T mz_sum = 0, mz_numWeight = 0;
+
+    for (int k = begin; k < end; k++)
+    {
+      if (scan_stamp[scan[k]] != cluster)
+      {
+        scan_stamp[scan[k]] = cluster;
+        temp_scans++;
+      }
+
+      if (ce_stamp[ce[k]] != cluster)
+      {
+        ce_stamp[ce[k]] = cluster;
+        temp_ces++;
+      }
+
+      if (s_intensity[k] > max_intensity)
+        max_intensity = s_intensity[k];
+
+      mz_numWeight = mz_numWeight + s_mz[k] * s_intensity[k];
+      mz_sum = mz_sum + s_intensity[k];
+    }
+
+    bool enough_presence = false;
+
+    if (pre_ce_has_nan)
+    {
+      enough_presence = number_scans * presence <= temp_scans;
+    }
+    else if (temp_ces < number_ces)
+    {
+      // case when a trace is only present in a CE and not in others applied
+      enough_presence = number_scans * (temp_ces / number_ces) * presence <= temp_scans;
+    }
+    else
+    {
+      enough_presence = number_scans * presence <= temp_scans;
+    }
+
+    if (enough_presence)
+    {
+      res.intensity.push_back(max_intensity);
+      res.mz.push_back(mz_numWeight / mz_sum);
+    }
+
+    begin = end;
+    cluster++;
+  }
+
+  if (res.size() == 0)
+    return res;
+
+  T rt_mean = 0;
+
+  for (int k = 0; k < n; k++)
+    rt_mean += rt[idx[k]];
+
+  res.rt = rt_mean / n;
+
+  if (!pre_mz.empty())
+  {
+    T pre_mz_mean = 0;
+
+    for (int k = 0; k < n; k++)
+      pre_mz_mean += pre_mz[idx[k]];
+
+    res.pre_mz = pre_mz_mean / n;
+  }
+
+  res.is_pre.assign(res.size(), false);
+
+  if (!std::isnan(res.pre_mz))
+  {
+    for (size_t p = 0; p < res.size(); p++)
+    {
+      if ((res.mz[p] >= res.pre_mz - mzClust) && (res.mz[p] <= res.pre_mz + mzClust))
+        res.is_pre[p] = true;
+    }
+  }
+
+  return res;
+};
+
+template nts::MS_CLUSTERED_SPECTRUM<float> nts::cluster_spectrum<float>(const std::vector<float> &, const std::vector<float> &, const std::vector<float> &, const std::vector<float> &, const std::vector<float> &, const float &, const float &);
+
+template nts::MS_CLUSTERED_SPECTRUM<double> nts::cluster_spectrum<double>(const std::vector<double> &, const std::vector<double> &, const std::vector<double> &, const std::vector<double> &, const std::vector<double> &, const double &, const double &);
+
 // MARK: CLUSTER_SPECTRA
 Rcpp::List nts::cluster_spectra(const Rcpp::List &spectra, const float &mzClust = 0.005, const float &presence = 0.8)
 {
@@ -843,316 +1728,883 @@ Rcpp::List nts::cluster_spectra(const Rcpp::List &spectra, const float &mzClust
 
   const int n_traces = org_polarity.size();
 
-  std::vector<float> org_pre_ce(n_traces);
+  // without collision energies all traces are taken as from the same energy
+  std::vector<float> org_pre_ce(n_traces, 0);
 
   if (has_pre_ce)
   {
     const std::vector<float> &org_pre_ce_origin = spectra["pre_ce"];
-    for (int i = 0; i < n_traces; ++i)
-    {
-      org_pre_ce[i] = org_pre_ce_origin[i];
-    }
+    org_pre_ce = org_pre_ce_origin;
   }
 
-  std::vector<float> org_pre_mz(n_traces);
+  std::vector<float> org_pre_mz;
 
   if (has_pre_mz)
   {
     const std::vector<float> &org_pre_mz_origin = spectra["pre_mz"];
-    for (int i = 0; i < n_traces; ++i)
-    {
-      org_pre_mz[i] = org_pre_mz_origin[i];
-    }
+    org_pre_mz = org_pre_mz_origin;
   }
 
-  std::vector<int> idx(n_traces);
-  std::iota(idx.begin(), idx.end(), 0);
-
-  std::sort(idx.begin(), idx.end(), [&](int i, int j)
-            { return org_mz[i] < org_mz[j]; });
+  const MS_CLUSTERED_SPECTRUM<float> res = cluster_spectrum(org_rt, org_mz, org_intensity, org_pre_ce, org_pre_mz, mzClust, presence);
 
-  std::vector<float> rt(n_traces);
-  float *rt_ptr = rt.data();
-
-  std::vector<float> mz(n_traces);
-  float *mz_ptr = mz.data();
+  Rcpp::List out;
 
-  std::vector<float> intensity(n_traces);
-  float *intensity_ptr = intensity.data();
+  if (res.size() == 0)
+    return out;
 
-  std::vector<float> pre_ce(n_traces);
-  float *pre_ce_ptr = pre_ce.data();
+  const std::vector<int> polarity_out(res.size(), org_polarity[0]);
+  const std::vector<int> level_out(res.size(), org_level[0]);
+  const std::vector<float> rt_out(res.size(), res.rt);
 
-  std::vector<float> pre_mz(n_traces);
-  float *pre_mz_ptr = pre_mz.data();
+  out["polarity"] = polarity_out;
+  out["level"] = level_out;
 
-  for (const int &x : idx)
+  if (has_pre_mz)
   {
-    *(rt_ptr++) = org_rt[x];
-    *(mz_ptr++) = org_mz[x];
-    *(intensity_ptr++) = org_intensity[x];
-    *(pre_ce_ptr++) = org_pre_ce[x];
-    *(pre_mz_ptr++) = org_pre_mz[x];
+    const std::vector<float> pre_mz_out(res.size(), res.pre_mz);
+    out["pre_mz"] = pre_mz_out;
   }
 
-  std::set<float> unique_rt_set;
+  out["rt"] = rt_out;
+  out["mz"] = res.mz;
+  out["intensity"] = res.intensity;
 
-  for (const float &r : rt)
-  {
-    unique_rt_set.insert(r);
-  }
+  if (has_pre_mz)
+    out["is_pre"] = res.is_pre;
+
+  return out;
+};
 
-  std::vector<float> unique_rt(unique_rt_set.begin(), unique_rt_set.end());
+// MARK: GROUP_FEATURES
+std::vector<int> nts::group_features(const std::vector<int> &analysis,
+                                     const std::vector<float> &mass,
+                                     const std::vector<float> &rt,
+                                     const std::vector<float> &intensity,
+                                     const float &massDev,
+                                     const float &rtDev)
+{
 
-  std::set<float> unique_pre_ce_set;
+  const int n = mass.size();
 
-  for (const float &c : pre_ce)
-  {
-    unique_pre_ce_set.insert(c);
-  }
+  std::vector<int> group(n, 0);
 
-  std::vector<float> unique_pre_ce(unique_pre_ce_set.begin(), unique_pre_ce_set.end());
+  if (n == 0)
+    return group;
 
-  rt_ptr = rt.data();
-  pre_ce_ptr = pre_ce.data();
-  mz_ptr = mz.data();
-  intensity_ptr = intensity.data();
+  if (!(massDev > 0) || !(rtDev > 0))
+    throw std::runtime_error("Mass and time deviations must be positive!");
 
-  std::vector<float> mz_diff(n_traces - 1);
+  const MS_FEATURES_GRID grid(mass, rt, massDev, rtDev);
 
-  for (int j = 1; j < n_traces; ++j)
-  {
-    mz_diff[j - 1] = mz[j] - mz[j - 1];
-  }
+  std::vector<int> mass_order;
+  mass_order.reserve(n);
 
-  float itMzClust = mzClust;
+  for (int i = 0; i < n; i++)
+    if (std::isfinite(mass[i]) && std::isfinite(rt[i]))
+      mass_order.push_back(i);
 
-  int counter = 0;
+  std::sort(mass_order.begin(), mass_order.end(), [&](int i, int j)
+            { return mass[i] < mass[j] || (mass[i] == mass[j] && i < j); });
 
-  bool hasFromSameScan = true;
+  // blocks of the mass axis separated by more than massDev never share a group and are grouped independently
+  std::vector<int> block_offsets = {0};
 
-  Rcpp::List out;
+  for (size_t k = 1; k < mass_order.size(); k++)
+    if (mass[mass_order[k]] - mass[mass_order[k - 1]] > massDev)
+      block_offsets.push_back(k);
 
-  while (hasFromSameScan)
+  block_offsets.push_back(mass_order.size());
+
+  const int number_blocks = block_offsets.size() - 1;
+
+  std::vector<int> block_groups(number_blocks, 0);
+
+#pragma omp parallel
   {
+    std::vector<int> seeds;
+    std::vector<int> near;
+    std::vector<std::tuple<int, float, int>> candidates;
 
-    counter = counter + 1;
+#pragma omp for schedule(dynamic, 64)
+    for (int b = 0; b < number_blocks; b++)
+    {
+      seeds.assign(mass_order.begin() + block_offsets[b], mass_order.begin() + block_offsets[b + 1]);
+
+      std::sort(seeds.begin(), seeds.end(), [&](int i, int j)
+                { return intensity[i] > intensity[j] || (intensity[i] == intensity[j] && i < j); });
 
-    std::vector<float> new_mz;
+      int number_groups = 0;
 
-    std::vector<float> new_intensity;
+      for (const int &s : seeds)
+      {
+        if (group[s] != 0)
+          continue;
 
-    std::vector<int> all_clusters(mz_diff.size(), 0);
+        group[s] = ++number_groups;
 
-    for (size_t j = 0; j < mz_diff.size(); ++j)
-    {
-      if (mz_diff[j] > itMzClust)
-        all_clusters[j] = 1;
-    }
+        grid.find(mass[s], rt[s], near);
 
-    std::partial_sum(all_clusters.begin(), all_clusters.end(), all_clusters.begin());
+        candidates.clear();
 
-    all_clusters.insert(all_clusters.begin(), 0);
+        for (const int &j : near)
+        {
+          // the mass is checked first, features of other blocks are never closer than massDev
+          const float mass_error = std::abs(mass[j] - mass[s]);
+          if (mass_error > massDev)
+            continue;
 
-    for (int &val : all_clusters)
-    {
-      val += 1;
-    }
+          const float rt_error = std::abs(rt[j] - rt[s]);
+          if (rt_error > rtDev || group[j] != 0 || analysis[j] == analysis[s])
+            continue;
 
-    int n_all_clusters = all_clusters.size();
+          const float distance = (mass_error / massDev) * (mass_error / massDev) + (rt_error / rtDev) * (rt_error / rtDev);
+          candidates.emplace_back(analysis[j], distance, j);
+        }
 
-    std::vector<int> idx_clusters(all_clusters.size());
-    std::iota(idx_clusters.begin(), idx_clusters.end(), 0);
+        // the closest feature of each other analysis joins the group of the seed
+        std::sort(candidates.begin(), candidates.end());
 
-    std::set<int> clusters_set;
+        for (size_t k = 0; k < candidates.size(); k++)
+          if (k == 0 || std::get<0>(candidates[k]) != std::get<0>(candidates[k - 1]))
+            group[std::get<2>(candidates[k])] = number_groups;
+      }
 
-    for (const int &cl : all_clusters)
-    {
-      clusters_set.insert(cl);
+      block_groups[b] = number_groups;
     }
+  }
+
+  // block local ids are made global in mass order
+  std::vector<int> block_start(number_blocks, 0);
+
+  for (int b = 1; b < number_blocks; b++)
+    block_start[b] = block_start[b - 1] + block_groups[b - 1];
+
+  for (int b = 0; b < number_blocks; b++)
+    for (int k = block_offsets[b]; k < block_offsets[b + 1]; k++)
+      group[mass_order[k]] += block_start[b];
 
-    std::vector<int> clusters(clusters_set.begin(), clusters_set.end());
+  // features without mass or time are kept as single feature groups
+  int last_group = number_blocks > 0 ? block_start[number_blocks - 1] + block_groups[number_blocks - 1] : 0;
 
-    int n_clusters = clusters.size();
+  for (int i = 0; i < n; i++)
+    if (group[i] == 0)
+      group[i] = ++last_group;
 
-    std::vector<bool> fromSameScan(n_clusters, true);
+  return group;
+};
+
+// MARK: ALIGN_RT
+std::vector<nts::MS_RT_WARP> nts::align_rt(const std::vector<int> &analysis,
+                                           const std::vector<float> &rt,
+                                           const std::vector<int> &group,
+                                           const int &number_analyses,
+                                           const float &minPresence,
+                                           const float &span)
+{
+
+  const int n = rt.size();
+
+  std::vector<MS_RT_WARP> warps(number_analyses);
+
+  if (n == 0 || number_analyses < 2)
+    return warps;
+
+  // features of each group in CSR, ordered by group and analysis
+  std::vector<int> order;
+  order.reserve(n);
+
+  for (int i = 0; i < n; i++)
+    if (std::isfinite(rt[i]) && analysis[i] >= 0 && analysis[i] < number_analyses)
+      order.push_back(i);
+
+  std::sort(order.begin(), order.end(), [&](int i, int j)
+            { return group[i] < group[j] || (group[i] == group[j] && (analysis[i] < analysis[j] || (analysis[i] == analysis[j] && i < j))); });
+
+  const int min_analyses = std::max(2, static_cast<int>(std::ceil(minPresence * number_analyses)));
+
+  // landmarks are groups present in enough analyses with a single feature per analysis,
+  // the median of their retention times is the reference the analyses are aligned to
+  std::vector<std::vector<std::pair<float, float>>> landmarks(number_analyses);
+  std::vector<float> rts;
+
+  size_t begin = 0;
 
-    for (int z = 0; z < n_clusters; ++z)
+  while (begin < order.size())
+  {
+    size_t end = begin + 1;
+    while (end < order.size() && group[order[end]] == group[order[begin]])
+      end++;
+
+    bool unique = true;
+    for (size_t k = begin + 1; k < end; k++)
+      if (analysis[order[k]] == analysis[order[k - 1]])
+        unique = false;
+
+    if (unique && static_cast<int>(end - begin) >= min_analyses)
     {
+      rts.clear();
+      for (size_t k = begin; k < end; k++)
+        rts.push_back(rt[order[k]]);
 
-      std::vector<int> temp_idx;
+      std::sort(rts.begin(), rts.end());
+      const size_t m = rts.size();
+      const float reference = (m % 2 == 1) ? rts[m / 2] : (rts[m / 2 - 1] + rts[m / 2]) / 2;
 
-      for (int j = 0; j < n_all_clusters; ++j)
-      {
-        if (all_clusters[j] == clusters[z])
-          temp_idx.push_back(j);
-      }
+      for (size_t k = begin; k < end; k++)
+        landmarks[analysis[order[k]]].emplace_back(rt[order[k]], reference);
+    }
 
-      int n = temp_idx.size();
+    begin = end;
+  }
 
-      std::vector<float> temp_rt(n);
-      float *temp_rt_ptr = temp_rt.data();
+  // at most this number of knots is fitted per analysis, the warp is linear in between
+  const int max_knots = 100;
 
-      std::vector<float> temp_pre_ce(n);
-      float *temp_pre_ce_ptr = temp_pre_ce.data();
+#pragma omp parallel for schedule(dynamic)
+  for (int a = 0; a < number_analyses; a++)
+  {
+    std::vector<std::pair<float, float>> &lm = landmarks[a];
 
-      std::vector<float> temp_mz(n);
-      float *temp_mz_ptr = temp_mz.data();
+    const int k = lm.size();
 
-      std::vector<float> temp_intensity(n);
-      float *temp_intensity_ptr = temp_intensity.data();
+    if (k < 3)
+      continue;
 
-      for (const int &x : temp_idx)
-      {
-        *(temp_rt_ptr++) = *(rt_ptr + x);
-        *(temp_pre_ce_ptr++) = *(pre_ce_ptr + x);
-        *(temp_mz_ptr++) = *(mz_ptr + x);
-        *(temp_intensity_ptr++) = *(intensity_ptr + x);
-      }
+    std::sort(lm.begin(), lm.end());
+
+    const int q = std::min(k, std::max(3, static_cast<int>(std::ceil(span * k))));
+
+    const int number_knots = std::min(k, max_knots);
+
+    MS_RT_WARP &warp = warps[a];
 
-      std::set<float> unique_temp_rt_set;
+    for (int t = 0; t < number_knots; t++)
+    {
+      const int p = number_knots == 1 ? 0 : static_cast<int>(static_cast<int64_t>(t) * (k - 1) / (number_knots - 1));
+      const float x0 = lm[p].first;
+
+      if (!warp.rt_raw.empty() && x0 <= warp.rt_raw.back())
+        continue;
 
-      for (const float &r : temp_rt)
+      // the q nearest landmarks around x0
+      int lo = p;
+      int hi = p + 1;
+      while (hi - lo < q)
       {
-        unique_temp_rt_set.insert(r);
+        if (lo == 0)
+          hi++;
+        else if (hi == k)
+          lo--;
+        else if (x0 - lm[lo - 1].first <= lm[hi].first - x0)
+          lo--;
+        else
+          hi++;
       }
 
-      std::vector<float> unique_temp_rt(unique_temp_rt_set.begin(), unique_temp_rt_set.end());
+      const double max_distance = std::max(x0 - lm[lo].first, lm[hi - 1].first - x0) * 1.0001 + 1e-6;
 
-      std::set<float> unique_temp_pre_ce_set;
+      // local linear LOESS with tricube weights of the shift to the reference
+      double sw = 0, swx = 0, swy = 0, swxx = 0, swxy = 0;
 
-      for (const float &r : temp_pre_ce)
+      for (int j = lo; j < hi; j++)
       {
-        unique_temp_pre_ce_set.insert(r);
+        const double dx = lm[j].first - x0;
+        const double u = std::abs(dx) / max_distance;
+        const double c = 1 - u * u * u;
+        const double w = c * c * c;
+        const double dy = lm[j].second - lm[j].first;
+        sw += w;
+        swx += w * dx;
+        swy += w * dy;
+        swxx += w * dx * dx;
+        swxy += w * dx * dy;
       }
 
-      std::vector<float> unique_temp_pre_ce(unique_temp_pre_ce_set.begin(), unique_temp_pre_ce_set.end());
+      const double det = sw * swxx - swx * swx;
+      const double shift = (std::abs(det) > 1e-12 * sw * sw) ? (swxx * swy - swx * swxy) / det : swy / sw;
 
-      fromSameScan[z] = unique_temp_rt.size() < temp_rt.size();
+      warp.rt_raw.push_back(x0);
+      warp.rt_aligned.push_back(x0 + shift);
+    }
 
-      if (counter > 10)
-        fromSameScan[z] = false;
+    // pool adjacent violators so that the aligned retention time never decreases
+    std::vector<double> level;
+    std::vector<int> count;
 
-      if (itMzClust < 0.0001)
-        fromSameScan[z] = false;
+    for (const float &y : warp.rt_aligned)
+    {
+      level.push_back(y);
+      count.push_back(1);
 
-      // when traces are twice in a given scan for cluster breaks the for loop and decreases the itMzClust
-      if (fromSameScan[z])
+      while (level.size() > 1 && level[level.size() - 2] > level.back())
       {
-        itMzClust = itMzClust - 0.0001;
-        break;
+        const int c = count.back();
+        const double l = level.back();
+        level.pop_back();
+        count.pop_back();
+        level.back() = (level.back() * count.back() + l * c) / (count.back() + c);
+        count.back() += c;
       }
+    }
 
-      bool enough_presence = false;
+    int t = 0;
+    for (size_t b = 0; b < level.size(); b++)
+      for (int c = 0; c < count[b]; c++)
+        warp.rt_aligned[t++] = level[b];
+  }
 
-      if (unique_temp_pre_ce.size() < unique_pre_ce.size())
-      {
-        enough_presence = unique_rt.size() * (unique_temp_pre_ce.size() / unique_pre_ce.size()) * presence <= unique_temp_rt.size();
-      }
-      else
-      {
-        enough_presence = unique_rt.size() * presence <= unique_temp_rt.size();
-      }
+  return warps;
+};
 
-      // when is not enough present skips the m/z cluster
-      if (!enough_presence)
-        continue;
+// MARK: PEAK_AREA
+double nts::peak_area(const double *x, const double *intensity, const int &start, const int &end)
+{
+  const int m = end - start + 1;
 
-      auto max_intensity_ptr = std::max_element(temp_intensity.begin(), temp_intensity.end());
-      new_intensity.push_back(*max_intensity_ptr);
+  if (m < 2)
+    return 0;
 
-      int size_temp_mz = temp_mz.size();
+  // area above the straight line between the peak boundaries, x is shifted to the peak start to keep float precision
+  const double step = (intensity[end] - intensity[start]) / (m - 1);
 
-      float mz_sum = 0, mz_numWeight = 0;
+  std::vector<float> px(m);
+  std::vector<float> py(m);
 
-      for (int w = 0; w < size_temp_mz; w++)
+  for (int k = 0; k < m; k++)
+  {
+    px[k] = static_cast<float>(x[start + k] - x[start]);
+    py[k] = static_cast<float>(std::max(0.0, intensity[start + k] - (intensity[start] + step * k)));
+  }
+
+  return nts::trapezoidal_area(px, py);
+};
+
+// MARK: FIND_TRACE_MAXIMA
+void nts::find_trace_maxima(const double *x,
+                            const double *intensity,
+                            const int &n,
+                            const double &minWidth,
+                            const double &maxWidth,
+                            const double &minHeight,
+                            std::vector<MS_TRACE_PEAK> &peaks)
+{
+  const double *y = intensity;
+  const double half_width = maxWidth / 1.5;
+
+  // local maxima, the boundaries are walked down while lower than the maximum and within the half width
+  int i = 1;
+  while (i < n - 2)
+  {
+    if (y[i] > y[i - 1] && y[i] > y[i + 1])
+    {
+      int left = i;
+      while (left > 0 && y[left - 1] < y[i] && x[i] - x[left] <= half_width)
+        left--;
+
+      int right = i;
+      while (right < n - 1 && y[right + 1] < y[i] && x[right] - x[i] <= half_width)
+        right++;
+
+      MS_TRACE_PEAK pk;
+      pk.start = left;
+      pk.end = right;
+      pk.min = x[left];
+      pk.max = x[right];
+      pk.width = x[right] - x[left];
+      pk.height_left = y[i] - y[left];
+      pk.height_right = y[i] - y[right];
+
+      if (pk.height_right >= minHeight && pk.height_left >= minHeight && pk.width >= minWidth)
       {
-        mz_numWeight = mz_numWeight + temp_mz[w] * temp_intensity[w];
-        mz_sum = mz_sum + temp_intensity[w];
+        pk.apex = static_cast<int>(std::max_element(y + left, y + right + 1) - y);
+        pk.x = x[pk.apex];
+        pk.intensity = y[pk.apex];
+        pk.area = nts::peak_area(x, y, left, right);
+        pk.sn = y[pk.apex] / y[left];
+        peaks.push_back(pk);
+        i = right;
       }
+    }
+    i++;
+  }
+};
 
-      float mean_mz = mz_numWeight / mz_sum;
+// MARK: FIND_TRACE_PEAKS
+void nts::find_trace_peaks(const double *x,
+                           const double *intensity,
+                           const int &n,
+                           const bool &merge,
+                           const double &closeByThreshold,
+                           const double &minPeakHeight,
+                           const double &minPeakDistance,
+                           const double &minPeakWidth,
+                           const double &maxPeakWidth,
+                           const double &minSN,
+                           std::vector<MS_TRACE_PEAK> &peaks)
+{
+  const double *y = intensity;
 
-      new_mz.push_back(mean_mz);
+  // runs of up steps followed by runs of down steps, as pracma::findpeaks with nups = ndowns = 1,
+  // flat steps break the pattern
+  std::vector<MS_TRACE_PEAK> found;
+  int k = 0;
+  while (k < n - 1)
+  {
+    if (!(y[k + 1] > y[k]))
+    {
+      k++;
+      continue;
+    }
 
-    } // end of clusters for loop
+    const int start = k;
+    while (k < n - 1 && y[k + 1] > y[k])
+      k++;
 
-    if (new_mz.size() > 0)
+    if (k < n - 1 && y[k + 1] < y[k])
     {
+      while (k < n - 1 && y[k + 1] < y[k])
+        k++;
+
+      MS_TRACE_PEAK pk;
+      pk.start = start;
+      pk.end = k;
+      pk.apex = static_cast<int>(std::max_element(y + start, y + k + 1) - y);
+      pk.x = x[pk.apex];
+      pk.intensity = y[pk.apex];
+      if (pk.intensity >= minPeakHeight)
+        found.push_back(pk);
+    }
+  }
 
-      float rt_mean = 0;
+  // peaks closer than minPeakDistance points to a higher peak are removed, highest first
+  if (minPeakDistance > 1 && found.size() > 1)
+  {
+    const int number_found = found.size();
+    std::vector<int> order(number_found);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return found[a].intensity > found[b].intensity; });
+
+    std::vector<bool> bad(number_found, false);
+    for (const int &i : order)
+    {
+      if (bad[i])
+        continue;
+      for (int j = i - 1; j >= 0 && found[i].apex - found[j].apex < minPeakDistance; j--)
+        if (found[j].apex != found[i].apex)
+          bad[j] = true;
+      for (int j = i + 1; j < number_found && found[j].apex - found[i].apex < minPeakDistance; j++)
+        if (found[j].apex != found[i].apex)
+          bad[j] = true;
+    }
 
-      for (float val : rt)
-      {
-        rt_mean += val;
-      }
+    std::vector<MS_TRACE_PEAK> kept;
+    for (int i = 0; i < number_found; i++)
+      if (!bad[i])
+        kept.push_back(found[i]);
+    found.swap(kept);
+  }
 
-      rt_mean = rt_mean / rt.size();
+  // a close by peak is merged into the previous one when the points between the apex of the higher and the
+  // boundary of the lower peak are below the higher apex and mostly above the lower boundary
+  if (merge && found.size() > 1)
+  {
+    const int number_found = found.size();
+    std::vector<bool> merged(number_found, false);
+    bool next_pk = false;
+    int pk_pos = 0;
 
-      if (has_pre_mz)
-      {
+    for (int i = 0; i < number_found - 1; i++)
+    {
+      if (next_pk)
+        pk_pos = i;
 
-        float pre_mz_mean = 0;
+      const MS_TRACE_PEAK &a = found[i];
+      const MS_TRACE_PEAK &b = found[i + 1];
 
-        std::vector<bool> is_pre(new_mz.size(), false);
+      bool do_merge = false;
 
-        for (const float &val : pre_mz)
+      if (std::abs(b.x - a.x) <= closeByThreshold)
+      {
+        double apex_i = y[a.apex];
+        double apex_next = y[b.apex];
+        int from = 0;
+        int to = 0;
+        double top = 0;
+        double boundary = 0;
+
+        if (apex_i < apex_next)
         {
-          pre_mz_mean += val;
+          from = a.end + 1;
+          to = b.apex;
+          top = apex_next;
+          boundary = y[a.end];
+        }
+        else if (apex_i > apex_next)
+        {
+          from = a.apex + 1;
+          to = b.start;
+          top = apex_i;
+          boundary = y[b.start];
         }
 
-        pre_mz_mean = pre_mz_mean / pre_mz.size();
-
-        if (!std::isnan(pre_mz_mean))
+        if (apex_i == apex_next)
+        {
+          do_merge = true;
+        }
+        else if (apex_i < apex_next || apex_i > apex_next)
         {
-          for (size_t p = 0; p < new_mz.size(); p++)
+          int below_top = 0;
+          int above_boundary = 0;
+          int below_boundary = 0;
+          for (int j = from; j < to; j++)
           {
-            if ((new_mz[p] >= pre_mz_mean - mzClust) && (new_mz[p] <= pre_mz_mean + mzClust))
-            {
-              is_pre[p] = true;
-            }
+            if (y[j] < top)
+              below_top++;
+            if (y[j] > boundary)
+              above_boundary++;
+            if (y[j] < boundary)
+              below_boundary++;
           }
+
+          const int between = std::max(0, to - from);
+          if (below_top == between)
+            do_merge = above_boundary == between || static_cast<double>(below_boundary) / between < 0.5;
         }
+      }
 
-        const std::vector<int> polarity_out(new_mz.size(), org_polarity[0]);
-        const std::vector<int> level_out(new_mz.size(), org_level[0]);
-        const std::vector<float> pre_mz_out(new_mz.size(), pre_mz_mean);
-        const std::vector<float> rt_out(new_mz.size(), rt_mean);
-
-        out["polarity"] = polarity_out;
-        out["level"] = level_out;
-        out["pre_mz"] = pre_mz_out;
-        out["rt"] = rt_out;
-        out["mz"] = new_mz;
-        out["intensity"] = new_intensity;
-        out["is_pre"] = is_pre;
+      if (do_merge)
+      {
+        MS_TRACE_PEAK &pk = found[pk_pos];
+        pk.end = found[i + 1].end;
+        if (found[i + 1].intensity > pk.intensity)
+        {
+          pk.intensity = found[i + 1].intensity;
+          pk.apex = found[i + 1].apex;
+          pk.x = found[i + 1].x;
+        }
+        merged[i + 1] = true;
+        next_pk = false;
       }
       else
       {
+        next_pk = true;
+      }
+    }
 
-        const std::vector<int> polarity_out(new_mz.size(), org_polarity[0]);
-        const std::vector<int> level_out(new_mz.size(), org_level[0]);
-        const std::vector<float> rt_out(new_mz.size(), rt_mean);
+    std::vector<MS_TRACE_PEAK> kept;
+    for (int i = 0; i < number_found; i++)
+      if (!merged[i])
+        kept.push_back(found[i]);
+    found.swap(kept);
+  }
 
-        out["polarity"] = polarity_out;
-        out["level"] = level_out;
-        out["rt"] = rt_out;
-        out["mz"] = new_mz;
-        out["intensity"] = new_intensity;
-      }
+  for (MS_TRACE_PEAK &pk : found)
+  {
+    pk.min = x[pk.start];
+    pk.max = x[pk.end];
+    pk.width = pk.max - pk.min;
+
+    if (pk.width < minPeakWidth || pk.width > maxPeakWidth)
+      continue;
+
+    // apex refined as the highest point within a quarter of the width around it
+    const double quarter = pk.width / 4;
+    int lo = pk.apex;
+    int hi = pk.apex;
+    while (lo > 0 && x[lo - 1] > pk.x - quarter)
+      lo--;
+    while (hi < n - 1 && x[hi + 1] < pk.x + quarter)
+      hi++;
+    if (x[lo] > pk.x - quarter && x[hi] < pk.x + quarter)
+    {
+      pk.apex = static_cast<int>(std::max_element(y + lo, y + hi + 1) - y);
+      pk.intensity = y[pk.apex];
+      pk.x = x[pk.apex];
+    }
+
+    pk.height_left = pk.intensity - y[pk.start];
+    pk.height_right = pk.intensity - y[pk.end];
+    pk.area = nts::peak_area(x, y, pk.start, pk.end);
+
+    // noise as the highest point around the boundaries
+    double base = -std::numeric_limits<double>::infinity();
+    for (int j = std::max(0, pk.start - 2); j <= std::min(n - 1, pk.start + 1); j++)
+      base = std::max(base, y[j]);
+    for (int j = std::max(0, pk.end - 1); j <= std::min(n - 1, pk.end + 2); j++)
+      base = std::max(base, y[j]);
+
+    if (base == 0)
+      base = pk.intensity * 0.01;
+
+    if (base < 0)
+      pk.sn = std::round((pk.intensity + base) / -base * 10) / 10;
+    else
+      pk.sn = std::round(pk.intensity / base * 10) / 10;
+
+    if (pk.sn >= minSN && pk.intensity >= minPeakHeight)
+      peaks.push_back(pk);
+  }
+};
+
+// MARK: FIND_PEAKS
+std::vector<nts::MS_TRACE_PEAK> nts::find_peaks(const std::vector<int64_t> &offsets,
+                                                const std::vector<double> &x,
+                                                const std::vector<double> &intensity,
+                                                const std::function<void(const double *, const double *, const int &, std::vector<MS_TRACE_PEAK> &)> &find_in_trace)
+{
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+
+  std::vector<std::vector<MS_TRACE_PEAK>> trace_peaks(std::max(number_traces, 0));
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int n = static_cast<int>(offsets[t + 1] - offsets[t]);
+    find_in_trace(x.data() + offsets[t], intensity.data() + offsets[t], n, trace_peaks[t]);
+  }
+
+  std::vector<MS_TRACE_PEAK> peaks;
+
+  for (int t = 0; t < number_traces; t++)
+  {
+    for (MS_TRACE_PEAK &pk : trace_peaks[t])
+    {
+      pk.trace = t;
+      peaks.push_back(pk);
     }
+  }
+
+  return peaks;
+};
+
+// MARK: CALCULATE_SPECTRUM_CHARGES
+nts::MS_SPECTRUM_CHARGES nts::calculate_spectrum_charges(const std::vector<double> &mz,
+                                                         const std::vector<double> &intensity,
+                                                         const double &roundVal,
+                                                         const double &relLowCut,
+                                                         const double &absLowCut)
+{
+  MS_SPECTRUM_CHARGES out;
+
+  const int n = mz.size();
+
+  if (n == 0 || !(roundVal > 0))
+    return out;
+
+  // m/z is clustered by rounding to roundVal, the apex of each cluster is its most intense row (first on ties)
+  std::vector<int64_t> key(n);
+  std::unordered_map<int64_t, int> apex;
+
+  for (int i = 0; i < n; i++)
+  {
+    key[i] = static_cast<int64_t>(std::nearbyint(mz[i] / roundVal));
+    const auto it = apex.emplace(key[i], i);
+    if (!it.second && intensity[i] > intensity[it.first->second])
+      it.first->second = i;
+  }
 
-    hasFromSameScan = false;
+  std::vector<int> clusters;
+  clusters.reserve(apex.size());
+  for (const auto &a : apex)
+    clusters.push_back(a.second);
 
-    for (const bool &l : fromSameScan)
+  std::sort(clusters.begin(), clusters.end(), [&](int a, int b)
+            { return mz[a] > mz[b]; });
+
+  // from high to low m/z, neighbouring apexes closer than roundVal are merged into the most intense
+  std::vector<int> kept;
+  int current = clusters[0];
+  for (size_t i = 1; i < clusters.size(); i++)
+  {
+    const int next = clusters[i];
+    if (mz[current] - mz[next] < roundVal)
     {
-      if (l)
-      {
-        hasFromSameScan = true;
-        break;
-      }
+      if (!(intensity[current] >= intensity[next]))
+        current = next;
     }
-  } // end of while loop
+    else
+    {
+      kept.push_back(current);
+      current = next;
+    }
+  }
+  kept.push_back(current);
+
+  std::stable_sort(kept.begin(), kept.end(), [&](int a, int b)
+                   { return intensity[a] > intensity[b]; });
+
+  const double top = intensity[kept[0]];
+  std::vector<int> selected;
+  for (const int &k : kept)
+  {
+    if (std::isnan(absLowCut) ? intensity[k] / top > relLowCut : intensity[k] > absLowCut)
+      selected.push_back(k);
+  }
+
+  if (selected.empty())
+    return out;
+
+  // rows at the apex m/z of each selected cluster, by a single hashed pass over the spectrum
+  std::unordered_map<int64_t, int> selected_position;
+  for (size_t s = 0; s < selected.size(); s++)
+    selected_position[key[selected[s]]] = s;
+
+  std::vector<std::vector<int>> selected_rows(selected.size());
+  for (int i = 0; i < n; i++)
+  {
+    const auto it = selected_position.find(key[i]);
+    if (it != selected_position.end() && mz[i] == mz[selected[it->second]])
+      selected_rows[it->second].push_back(i);
+  }
+
+  std::vector<int> rows;
+  for (const std::vector<int> &r : selected_rows)
+    rows.insert(rows.end(), r.begin(), r.end());
+
+  std::stable_sort(rows.begin(), rows.end(), [&](int a, int b)
+                   { return mz[a] < mz[b]; });
+
+  // charge from consecutive peaks of the ladder, m/z_i * z = m/z_{i+1} * (z - 1), so z = -m/z_{i+1} / (m/z_i - m/z_{i+1}),
+  // the lowest m/z is left out as the mass estimation might be affected by an incomplete cluster
+  const int number_charges = static_cast<int>(rows.size()) - 2;
+
+  if (number_charges < 1)
+    return out;
+
+  std::vector<double> z(number_charges);
+  for (int i = 0; i < number_charges; i++)
+  {
+    const double mz_i = mz[rows[i + 1]];
+    const double mz_next = mz[rows[i + 2]];
+    z[i] = std::nearbyint(-mz_next / (mz_i - mz_next));
+  }
+
+  // a charge is consistent with the ladder when it is one above the next, the last is checked against the previous
+  std::vector<double> z_step(number_charges, 0);
+  std::vector<bool> outlier(number_charges, false);
+
+  for (int i = 0; i + 1 < number_charges; i++)
+    z_step[i] = z[i] - z[i + 1];
+
+  if (number_charges >= 3)
+    for (int i = 0; i < number_charges; i++)
+      outlier[i] = !(z_step[i] == 1);
+
+  if (number_charges >= 2)
+    outlier[number_charges - 1] = !(z[number_charges - 2] - z[number_charges - 1] == 1);
+  else
+    outlier[0] = true;
+
+  for (int i = 0; i < number_charges; i++)
+  {
+    if (outlier[i])
+      continue;
+
+    const int row = rows[i + 1];
+    out.idx.push_back(row);
+    out.cluster.push_back(key[row] * roundVal);
+    out.z.push_back(z[i]);
+    out.mass.push_back(z[i] * (mz[row] - 1.007276));
+    out.z_step.push_back(z_step[i]);
+  }
 
   return out;
 };
+
+// MARK: DECONVOLUTE_SPECTRUM
+nts::MS_CLUSTERED_SPECTRUM<double> nts::deconvolute_spectrum(const std::vector<double> &rt,
+                                                             const std::vector<double> &mz,
+                                                             const std::vector<double> &intensity,
+                                                             const std::vector<double> &pre_ce,
+                                                             const std::vector<double> &pre_mz,
+                                                             const std::vector<double> &charge_mz,
+                                                             const std::vector<double> &charge_z,
+                                                             const double &clustVal,
+                                                             const double &window,
+                                                             int &first)
+{
+  const int n = mz.size();
+  const int number_charges = charge_mz.size();
+
+  first = -1;
+
+  if (n == 0 || number_charges == 0)
+    return MS_CLUSTERED_SPECTRUM<double>();
+
+  // the spectrum is sorted by m/z once, so that each charge window is a range found by binary search
+  std::vector<int> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                   { return mz[a] < mz[b]; });
+
+  std::vector<double> s_mz(n);
+  for (int k = 0; k < n; k++)
+    s_mz[k] = mz[order[k]];
+
+  std::vector<int> begin(number_charges, 0);
+  std::vector<int> end(number_charges, 0);
+  std::vector<double> max_intensity(number_charges, 0);
+  std::vector<int> profiles;
+
+  for (int j = 0; j < number_charges; j++)
+  {
+    // without a window, half the distance to the next charge or to the previous when a charge is skipped
+    double w = window;
+    if (std::isnan(window))
+    {
+      if (j == number_charges - 1 || charge_z[j] - charge_z[j + 1] > 1)
+        w = j > 0 ? (charge_mz[j] - charge_mz[j - 1]) / 2 : std::nan("");
+      else
+        w = (charge_mz[j + 1] - charge_mz[j]) / 2;
+    }
+
+    if (std::isnan(w))
+      continue;
+
+    begin[j] = std::lower_bound(s_mz.begin(), s_mz.end(), charge_mz[j] - w) - s_mz.begin();
+    end[j] = std::upper_bound(s_mz.begin(), s_mz.end(), charge_mz[j] + w) - s_mz.begin();
+
+    if (end[j] <= begin[j])
+      continue;
+
+    max_intensity[j] = intensity[order[begin[j]]];
+    for (int k = begin[j]; k < end[j]; k++)
+      max_intensity[j] = std::max(max_intensity[j], intensity[order[k]]);
+
+    profiles.push_back(j);
+  }
+
+  if (profiles.empty())
+    return MS_CLUSTERED_SPECTRUM<double>();
+
+  // the five most intense charge profiles are merged in neutral mass
+  std::stable_sort(profiles.begin(), profiles.end(), [&](int a, int b)
+                   { return max_intensity[a] > max_intensity[b]; });
+
+  if (profiles.size() > 5)
+    profiles.resize(5);
+
+  std::vector<double> p_rt, p_mass, p_intensity, p_pre_ce, p_pre_mz;
+
+  for (const int &j : profiles)
+  {
+    std::vector<int> rows(order.begin() + begin[j], order.begin() + end[j]);
+    std::sort(rows.begin(), rows.end());
+
+    if (first < 0)
+      first = rows[0];
+
+    for (const int &r : rows)
+    {
+      p_rt.push_back(rt[r]);
+      p_mass.push_back(charge_z[j] * (mz[r] - 1.007276));
+      p_intensity.push_back(intensity[r]);
+      p_pre_ce.push_back(pre_ce.empty() ? 0 : pre_ce[r]);
+      if (!pre_mz.empty())
+        p_pre_mz.push_back(pre_mz[r]);
+    }
+  }
+
+  return nts::cluster_spectrum<double>(p_rt, p_mass, p_intensity, p_pre_ce, p_pre_mz, clustVal, 0.1);
+};
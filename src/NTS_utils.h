@@ -7,11 +7,17 @@
 #include <tuple>
 #include <algorithm>
 #include <unordered_set>
+#include <unordered_map>
 #include <numeric>
 #include <Rcpp.h>
 #include <omp.h>
 #include <cmath>
 #include <filesystem>
+#include <set>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <limits>
 #include "StreamCraft_lib.h"
 
 namespace nts
@@ -82,6 +88,299 @@ namespace nts
     };
   };
 
+  // MARK: MS_FEATURES_RT_INDEX
+  struct MS_FEATURES_RT_INDEX
+  {
+    // positions of MS_FEATURES_MZ_SORTED bucketed by rt (CSR in offsets), ascending and thus m/z ordered within each bucket
+    float rt_start = 0;
+    float bucket_width = 1;
+    int number_buckets = 0;
+    std::vector<int> offsets;
+    std::vector<int> position;
+    std::vector<float> mz;
+
+    MS_FEATURES_RT_INDEX(const MS_FEATURES_MZ_SORTED &fdf)
+    {
+      const int n = fdf.n;
+
+      std::vector<float> widths;
+      float rt_end = 0;
+      bool has_rt = false;
+
+      for (int i = 0; i < n; i++)
+      {
+        if (!std::isfinite(fdf.rt[i]))
+          continue;
+
+        if (!has_rt || fdf.rt[i] < rt_start)
+          rt_start = fdf.rt[i];
+        if (!has_rt || fdf.rt[i] > rt_end)
+          rt_end = fdf.rt[i];
+        has_rt = true;
+
+        const float width = fdf.rtmax[i] - fdf.rtmin[i];
+        if (width > 0)
+          widths.push_back(width);
+      }
+
+      // buckets of about one median peak width, which is the scale of the rt windows queried
+      if (!widths.empty())
+      {
+        std::nth_element(widths.begin(), widths.begin() + widths.size() / 2, widths.end());
+        bucket_width = widths[widths.size() / 2];
+      }
+
+      if (!(bucket_width > 0))
+        bucket_width = 1;
+
+      // a tiny median width over a long rt range would give more buckets than can be allocated, above the cap
+      // all features go in one bucket and the search falls back to the m/z sorted window only
+      const int64_t max_buckets = std::max<int64_t>(1024, 4 * static_cast<int64_t>(n));
+      const double buckets = has_rt ? std::floor(static_cast<double>(rt_end - rt_start) / bucket_width) + 1 : 0;
+
+      if (buckets > static_cast<double>(max_buckets))
+      {
+        number_buckets = 1;
+        bucket_width = std::max(rt_end - rt_start, 1.0f);
+      }
+      else
+      {
+        number_buckets = static_cast<int>(buckets);
+      }
+
+      offsets.assign(number_buckets + 1, 0);
+
+      for (int i = 0; i < n; i++)
+        if (std::isfinite(fdf.rt[i]))
+          offsets[bucket(fdf.rt[i]) + 1]++;
+
+      std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+      position.resize(offsets.back());
+      mz.resize(offsets.back());
+
+      std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+
+      for (int i = 0; i < n; i++)
+      {
+        if (!std::isfinite(fdf.rt[i]))
+          continue;
+
+        const int k = fill[bucket(fdf.rt[i])]++;
+        position[k] = i;
+        mz[k] = fdf.mz[i];
+      }
+    };
+
+    int bucket(const float &rt) const
+    {
+      const double b = std::floor(static_cast<double>(rt - rt_start) / bucket_width);
+      if (!(b > 0))
+        return 0;
+      if (b >= number_buckets)
+        return number_buckets - 1;
+      return static_cast<int>(b);
+    };
+
+    // positions with rt bucket overlapping [rtmin, rtmax] and mzlow < mz <= mzhigh, in ascending order
+    void find(const float &rtmin, const float &rtmax, const float &mzlow, const float &mzhigh, std::vector<int> &out) const
+    {
+      out.clear();
+
+      if (number_buckets == 0 || !(rtmin <= rtmax))
+        return;
+
+      const int first = bucket(rtmin);
+      const int last = bucket(rtmax);
+
+      for (int b = first; b <= last; b++)
+      {
+        const auto begin = mz.begin() + offsets[b];
+        const auto end = mz.begin() + offsets[b + 1];
+        const int lo = std::upper_bound(begin, end, mzlow) - mz.begin();
+        const int hi = std::upper_bound(begin, end, mzhigh) - mz.begin();
+        for (int k = lo; k < hi; k++)
+          out.push_back(position[k]);
+      }
+
+      std::sort(out.begin(), out.end());
+    };
+  };
+
+  // MARK: MS_FEATURES_GRID
+  struct MS_FEATURES_GRID
+  {
+    // features bucketed in cells of mass_dev x rt_dev (CSR in offsets over the sorted cell keys),
+    // so that all features within mass_dev and rt_dev of a point are in the 3 x 3 cells around it
+    float mass_dev = 0.005;
+    float rt_dev = 10;
+    float mass_start = 0;
+    float rt_start = 0;
+    int64_t number_rt_cells = 1;
+    std::vector<int64_t> keys;
+    std::vector<int> offsets;
+    std::vector<int> position;
+
+    MS_FEATURES_GRID(const std::vector<float> &mass, const std::vector<float> &rt, const float &massDev, const float &rtDev)
+    {
+      mass_dev = massDev;
+      rt_dev = rtDev;
+
+      const int n = mass.size();
+
+      float rt_end = 0;
+      bool has_values = false;
+
+      for (int i = 0; i < n; i++)
+      {
+        if (!std::isfinite(mass[i]) || !std::isfinite(rt[i]))
+          continue;
+
+        if (!has_values || mass[i] < mass_start)
+          mass_start = mass[i];
+        if (!has_values || rt[i] < rt_start)
+          rt_start = rt[i];
+        if (!has_values || rt[i] > rt_end)
+          rt_end = rt[i];
+        has_values = true;
+      }
+
+      number_rt_cells = has_values ? static_cast<int64_t>((rt_end - rt_start) / rt_dev) + 1 : 1;
+
+      std::vector<std::pair<int64_t, int>> cells;
+      cells.reserve(n);
+
+      for (int i = 0; i < n; i++)
+        if (std::isfinite(mass[i]) && std::isfinite(rt[i]))
+          cells.emplace_back(key(mass_cell(mass[i]), rt_cell(rt[i])), i);
+
+      std::sort(cells.begin(), cells.end());
+
+      position.resize(cells.size());
+
+      for (size_t k = 0; k < cells.size(); k++)
+      {
+        if (k == 0 || cells[k].first != cells[k - 1].first)
+        {
+          keys.push_back(cells[k].first);
+          offsets.push_back(k);
+        }
+        position[k] = cells[k].second;
+      }
+
+      offsets.push_back(cells.size());
+    };
+
+    int64_t mass_cell(const float &mass) const
+    {
+      return static_cast<int64_t>(std::floor((mass - mass_start) / mass_dev));
+    };
+
+    int64_t rt_cell(const float &rt) const
+    {
+      return static_cast<int64_t>(std::floor((rt - rt_start) / rt_dev));
+    };
+
+    int64_t key(const int64_t &mc, const int64_t &rc) const
+    {
+      return mc * number_rt_cells + rc;
+    };
+
+    // features in the 3 x 3 cells around (mass, rt), to be filtered by the caller on the actual deviations
+    void find(const float &mass, const float &rt, std::vector<int> &out) const
+    {
+      out.clear();
+
+      const int64_t mc = mass_cell(mass);
+      const int64_t rc = rt_cell(rt);
+
+      for (int64_t m = mc - 1; m <= mc + 1; m++)
+      {
+        for (int64_t r = rc - 1; r <= rc + 1; r++)
+        {
+          if (m < 0 || r < 0 || r >= number_rt_cells)
+            continue;
+
+          const auto it = std::lower_bound(keys.begin(), keys.end(), key(m, r));
+
+          if (it == keys.end() || *it != key(m, r))
+            continue;
+
+          const int c = it - keys.begin();
+          for (int k = offsets[c]; k < offsets[c + 1]; k++)
+            out.push_back(position[k]);
+        }
+      }
+    };
+  };
+
+  // MARK: MS_RT_WARP
+  struct MS_RT_WARP
+  {
+    // piecewise linear map from raw to aligned retention time over strictly increasing raw knots,
+    // beyond the first and last knots the shift of the nearest knot is kept
+    std::vector<float> rt_raw;
+    std::vector<float> rt_aligned;
+
+    float operator()(const float &rt) const
+    {
+      const int n = rt_raw.size();
+
+      if (n == 0 || !std::isfinite(rt))
+        return rt;
+
+      if (rt <= rt_raw[0])
+        return rt + rt_aligned[0] - rt_raw[0];
+
+      if (rt >= rt_raw[n - 1])
+        return rt + rt_aligned[n - 1] - rt_raw[n - 1];
+
+      const int k = std::upper_bound(rt_raw.begin(), rt_raw.end(), rt) - rt_raw.begin();
+      const float w = (rt - rt_raw[k - 1]) / (rt_raw[k] - rt_raw[k - 1]);
+      return rt_aligned[k - 1] + w * (rt_aligned[k] - rt_aligned[k - 1]);
+    };
+
+    void apply(std::vector<float> &rt) const
+    {
+      for (float &x : rt)
+        x = (*this)(x);
+    };
+
+    // knots given from outside, e.g. from R, are checked before use as unsorted knots break the interpolation
+    void validate() const
+    {
+      if (rt_raw.size() != rt_aligned.size())
+        throw std::runtime_error("Raw and aligned retention time knots must have the same length!");
+
+      for (size_t k = 0; k < rt_raw.size(); k++)
+      {
+        if (!std::isfinite(rt_raw[k]) || !std::isfinite(rt_aligned[k]))
+          throw std::runtime_error("Retention time knots must be finite!");
+
+        if (k > 0 && !(rt_raw[k] > rt_raw[k - 1]))
+          throw std::runtime_error("Raw retention time knots must be strictly increasing!");
+      }
+    };
+  };
+
+  // MARK: MS_CLUSTERED_SPECTRUM
+  template <typename T>
+  struct MS_CLUSTERED_SPECTRUM
+  {
+    std::vector<T> mz;
+    std::vector<T> intensity;
+    std::vector<bool> is_pre;
+    T rt = std::nan("");
+    T pre_mz = std::nan("");
+    T mz_clust = 0;
+    int iterations = 0;
+
+    size_t size() const
+    {
+      return mz.size();
+    }
+  };
+
   // MARK: MS_ISOTOPE
   struct MS_ISOTOPE
   {
@@ -218,65 +517,106 @@ namespace nts
   // MARK: MS_ISOTOPE_COMBINATIONS
   struct MS_ISOTOPE_COMBINATIONS
   {
-    std::vector<int> step;
+    // isotopes are integer coded by the order of the isotope names
     std::vector<std::string> isotopes_str;
     std::vector<float> abundances;
     std::vector<float> abundances_monoisotopic;
     std::vector<int> min;
     std::vector<int> max;
-    std::vector<std::vector<std::string>> tensor_combinations;
-    std::vector<std::vector<float>> tensor_mass_distances;
-    std::vector<std::vector<float>> tensor_abundances;
+    int code_13C;
+
+    // combinations ordered by mass distance
+    std::vector<int> step;
     std::vector<float> mass_distances;
+    std::vector<std::string> labels;
+
+    // unique isotopes of each combination as CSR with the number of atoms
+    std::vector<int> isotopes_offsets;
+    std::vector<int> isotopes_code;
+    std::vector<int> isotopes_count;
+
+    // combinations of each step as contiguous slices with the mass distance range
+    std::vector<int> step_offsets;
+    std::vector<float> step_mass_distance_min;
+    std::vector<float> step_mass_distance_max;
+    int max_step;
     int length;
 
     MS_ISOTOPE_COMBINATIONS(MS_ISOTOPE_SET isotopes, const int &max_number_elements)
     {
 
-      std::set<std::vector<std::string>> combinations_set;
+      const int number_isotopes = isotopes.data.size();
+
+      // codes follow the isotope names so that the combinations keep the string ordering
+      std::vector<int> name_order(number_isotopes);
+      std::iota(name_order.begin(), name_order.end(), 0);
+      std::stable_sort(name_order.begin(), name_order.end(), [&](int i, int j)
+                       { return isotopes.data[i].isotope < isotopes.data[j].isotope; });
+
+      isotopes_str.resize(number_isotopes);
+      abundances.resize(number_isotopes);
+      abundances_monoisotopic.resize(number_isotopes);
+      min.resize(number_isotopes);
+      max.resize(number_isotopes);
+      code_13C = -1;
 
-      isotopes_str = isotopes.isotopes();
-      abundances = isotopes.abundance();
-      abundances_monoisotopic = isotopes.abundance_monoisotopic();
-      min = isotopes.min();
-      max = isotopes.max();
+      std::vector<float> isotopes_mass_distances(number_isotopes);
+      std::vector<bool> excluded_m2(number_isotopes);
+      std::vector<bool> excluded_m3(number_isotopes);
 
-      for (const std::string &iso : isotopes_str)
+      for (int i = 0; i < number_isotopes; i++)
       {
-        std::vector<std::string> iso_vec(1);
-        iso_vec[0] = iso;
-        combinations_set.insert(iso_vec);
+        const MS_ISOTOPE &iso = isotopes.data[name_order[i]];
+        isotopes_str[i] = iso.isotope;
+        abundances[i] = iso.abundance;
+        abundances_monoisotopic[i] = iso.abundance_monoisotopic;
+        min[i] = iso.min;
+        max[i] = iso.max;
+        isotopes_mass_distances[i] = iso.mass_distance;
+
+        // excludes 2H and 17O from the M+2 on and 15N and 33S from the M+3 on due to the low contribution
+        excluded_m2[i] = iso.isotope == "2H" || iso.isotope == "17O";
+        excluded_m3[i] = iso.isotope == "15N" || iso.isotope == "33S";
+
+        if (iso.isotope == "13C")
+          code_13C = i;
       }
 
+      std::vector<int> set_order_codes(number_isotopes);
+
+      for (int i = 0; i < number_isotopes; i++)
+        set_order_codes[name_order[i]] = i;
+
+      std::set<std::vector<int>> combinations_set;
+
+      for (int i = 0; i < number_isotopes; i++)
+        combinations_set.insert(std::vector<int>(1, i));
+
       for (int n = 1; n <= max_number_elements; n++)
       {
-        std::set<std::vector<std::string>> new_combinations_set;
+        std::set<std::vector<int>> new_combinations_set;
 
-        for (std::vector<std::string> combination : std::vector<std::vector<std::string>>(combinations_set.begin(), combinations_set.end()))
+        for (std::vector<int> combination : combinations_set)
         {
 
-          // excludes 2H and 17O from the M+2 on due to the low contribution
-          if (combination[0] == "2H" || combination[0] == "17O")
+          if (excluded_m2[combination[0]])
             continue;
 
-          // excludes 15N and 33S from the M+3 on due to the low contribution
-          if (n > 1 && (combination[0] == "15N" || combination[0] == "33S"))
+          if (n > 1 && excluded_m3[combination[0]])
             continue;
 
-          // excludes 15N and 33S from the M+3 on due to the low contribution
           if (combination.size() >= 2)
-            if (combination[1] == "15N" || combination[1] == "33S")
+            if (excluded_m3[combination[1]])
               continue;
 
-          for (const std::string &iso : isotopes_str)
+          // appends in the order of the isotope set, as the combination grows with each isotope
+          for (const int &iso : set_order_codes)
           {
 
-            // excludes 2H and 17O from the M+2 on due to the low contribution
-            if (iso == "2H" || iso == "17O")
+            if (excluded_m2[iso])
               continue;
 
-            // excludes 15N and 33S from the M+3 on due to the low contribution
-            if (n > 1 && (iso == "15N" || iso == "33S"))
+            if (n > 1 && excluded_m3[iso])
               continue;
 
             combination.push_back(iso);
@@ -287,68 +627,142 @@ namespace nts
         combinations_set.insert(new_combinations_set.begin(), new_combinations_set.end());
       }
 
-      std::vector<std::vector<std::string>> tensor_combinations_unordered = std::vector<std::vector<std::string>>(combinations_set.begin(), combinations_set.end());
-
-      length = tensor_combinations_unordered.size();
+      const std::vector<std::vector<int>> combinations_unordered(combinations_set.begin(), combinations_set.end());
 
-      const std::vector<float> &isotopes_mass_distances = isotopes.mass_distance();
-      const std::vector<float> &isotopes_abundances = isotopes.abundance();
+      length = combinations_unordered.size();
 
-      std::vector<std::vector<float>> tensor_mass_distances_unordered(length);
-      std::vector<std::vector<float>> tensor_abundances_unordered(length);
       std::vector<float> mass_distances_unordered(length);
 
       for (int i = 0; i < length; ++i)
-      {
-        const std::vector<std::string> &combination = tensor_combinations_unordered[i];
-        const int combination_length = combination.size();
-        std::vector<float> md(combination_length);
-        std::vector<float> ab(combination_length);
-        for (int j = 0; j < combination_length; ++j)
-        {
-          std::string iso = combination[j];
-          int idx = std::distance(isotopes_str.begin(), std::find(isotopes_str.begin(), isotopes_str.end(), iso));
-          md[j] = isotopes_mass_distances[idx];
-          ab[j] = isotopes_abundances[idx];
-          mass_distances_unordered[i] = mass_distances_unordered[i] + isotopes_mass_distances[idx];
-        }
-        tensor_mass_distances_unordered[i] = md;
-        tensor_abundances_unordered[i] = ab;
-      }
+        for (const int &iso : combinations_unordered[i])
+          mass_distances_unordered[i] = mass_distances_unordered[i] + isotopes_mass_distances[iso];
 
       std::vector<int> order_idx(length);
       std::iota(order_idx.begin(), order_idx.end(), 0);
       std::stable_sort(order_idx.begin(), order_idx.end(), [&](int i, int j)
                        { return mass_distances_unordered[i] < mass_distances_unordered[j]; });
 
-      tensor_combinations.resize(length);
-      tensor_mass_distances.resize(length);
-      tensor_abundances.resize(length);
       mass_distances.resize(length);
       step.resize(length);
+      labels.resize(length);
+      isotopes_offsets.resize(length + 1);
+      isotopes_offsets[0] = 0;
 
       for (int i = 0; i < length; i++)
       {
-        tensor_combinations[i] = tensor_combinations_unordered[order_idx[i]];
-        tensor_mass_distances[i] = tensor_mass_distances_unordered[order_idx[i]];
-        tensor_abundances[i] = tensor_abundances_unordered[order_idx[i]];
+        const std::vector<int> &combination = combinations_unordered[order_idx[i]];
         mass_distances[i] = mass_distances_unordered[order_idx[i]];
         step[i] = std::round(mass_distances[i] * 1) / 1;
+
+        labels[i] = isotopes_str[combination[0]];
+        for (size_t e = 1; e < combination.size(); ++e)
+          labels[i] += "/" + isotopes_str[combination[e]];
+
+        // combinations are sorted, so equal isotopes are adjacent
+        for (size_t e = 0; e < combination.size(); ++e)
+        {
+          if (e > 0 && combination[e] == combination[e - 1])
+          {
+            isotopes_count.back()++;
+            continue;
+          }
+          isotopes_code.push_back(combination[e]);
+          isotopes_count.push_back(1);
+        }
+        isotopes_offsets[i + 1] = isotopes_code.size();
+      }
+
+      // steps are non-decreasing as the combinations are ordered by mass distance
+      max_step = length > 0 ? step[length - 1] : 0;
+      step_offsets.assign(max_step + 2, length);
+      step_mass_distance_min.assign(max_step + 1, 0);
+      step_mass_distance_max.assign(max_step + 1, 0);
+
+      for (int i = length - 1; i >= 0; i--)
+        if (step[i] >= 0)
+          step_offsets[step[i]] = i;
+
+      for (int s = max_step; s >= 0; s--)
+        if (step_offsets[s] > step_offsets[s + 1])
+          step_offsets[s] = step_offsets[s + 1];
+
+      for (int s = 0; s <= max_step; s++)
+      {
+        if (step_offsets[s] < step_offsets[s + 1])
+        {
+          step_mass_distance_min[s] = mass_distances[step_offsets[s]];
+          step_mass_distance_max[s] = mass_distances[step_offsets[s + 1] - 1];
+        }
       }
     };
+
+    int step_begin(const int &s) const
+    {
+      if (s < 0 || s > max_step)
+        return length;
+      return step_offsets[s];
+    };
+
+    int step_end(const int &s) const
+    {
+      if (s < 0 || s > max_step)
+        return length;
+      return step_offsets[s + 1];
+    };
+  };
+
+  // MARK: MS_CATEGORIES
+  struct MS_CATEGORIES
+  {
+    // dictionary of repeated strings, the code 0 is always the empty string
+    std::vector<std::string> levels = {""};
+    std::unordered_map<std::string, int> codes = {{"", 0}};
+
+    int code(const std::string &value)
+    {
+      auto it = codes.find(value);
+      if (it != codes.end())
+        return it->second;
+      const int c = levels.size();
+      levels.push_back(value);
+      codes.emplace(value, c);
+      return c;
+    }
+
+    const std::string &level(const int &c) const
+    {
+      return levels[c];
+    }
+
+    size_t size() const
+    {
+      return levels.size();
+    }
+
+    // R factor with the codes as 1-based integers and the dictionary as levels
+    Rcpp::IntegerVector factor(const std::vector<int> &values) const
+    {
+      const int n = values.size();
+      Rcpp::IntegerVector out(n);
+      for (int i = 0; i < n; i++)
+        out[i] = values[i] + 1;
+      out.attr("levels") = Rcpp::wrap(levels);
+      out.attr("class") = "factor";
+      return out;
+    }
   };
 
   // MARK: MS_ANNOTATION
   struct MS_ANNOTATION
   {
+    // entries are addressed by the original feature index, categories are codes in the dictionaries below
     std::vector<int> index;
-    std::vector<std::string> feature;
-    std::vector<std::string> component_feature;
+    std::vector<int> component_index;
     std::vector<int> iso_size;
     std::vector<int> iso_charge;
     std::vector<int> iso_step;
-    std::vector<std::string> iso_cat;
-    std::vector<std::string> iso_isotope;
+    std::vector<int> iso_cat;
+    std::vector<int> iso_isotope;
     std::vector<float> iso_mzr;
     std::vector<float> iso_relative_intensity;
     std::vector<float> iso_theoretical_min_relative_intensity;
@@ -358,16 +772,25 @@ namespace nts
     std::vector<float> iso_mass_distance_error;
     std::vector<float> iso_time_error;
     std::vector<float> iso_number_carbons;
-    std::vector<std::string> adduct_element;
-    std::vector<std::string> adduct_cat;
+    std::vector<int> adduct_element;
+    std::vector<int> adduct_cat;
     std::vector<float> adduct_time_error;
     std::vector<float> adduct_mass_error;
 
+    MS_CATEGORIES iso_cat_levels;
+    MS_CATEGORIES iso_isotope_levels;
+    MS_CATEGORIES adduct_element_levels;
+    MS_CATEGORIES adduct_cat_levels;
+
     MS_ANNOTATION(const int &n)
+    {
+      resize_all(n);
+    };
+
+    void resize_all(int n)
     {
       index.resize(n);
-      feature.resize(n);
-      component_feature.resize(n);
+      component_index.resize(n);
       iso_size.resize(n);
       iso_charge.resize(n);
       iso_step.resize(n);
@@ -386,7 +809,43 @@ namespace nts
       adduct_cat.resize(n);
       adduct_time_error.resize(n);
       adduct_mass_error.resize(n);
-    };
+    }
+
+    size_t size() const
+    {
+      return index.size();
+    }
+
+    // appends an entry for the feature with the given index, used when the annotation is collected as rows
+    int add_row(const int &target)
+    {
+      const int r = size();
+      resize_all(r + 1);
+      index[r] = target;
+      return r;
+    }
+
+    // copies the isotope entry r of rows to the feature it was resolved for
+    void set_isotope_row(const MS_ANNOTATION &rows, const int &r)
+    {
+      const int i = rows.index[r];
+      index[i] = rows.index[r];
+      component_index[i] = rows.component_index[r];
+      iso_size[i] = rows.iso_size[r];
+      iso_charge[i] = rows.iso_charge[r];
+      iso_step[i] = rows.iso_step[r];
+      iso_cat[i] = iso_cat_levels.code(rows.iso_cat_levels.level(rows.iso_cat[r]));
+      iso_isotope[i] = iso_isotope_levels.code(rows.iso_isotope_levels.level(rows.iso_isotope[r]));
+      iso_mzr[i] = rows.iso_mzr[r];
+      iso_relative_intensity[i] = rows.iso_relative_intensity[r];
+      iso_theoretical_min_relative_intensity[i] = rows.iso_theoretical_min_relative_intensity[r];
+      iso_theoretical_max_relative_intensity[i] = rows.iso_theoretical_max_relative_intensity[r];
+      iso_mass_distance[i] = rows.iso_mass_distance[r];
+      iso_theoretical_mass_distance[i] = rows.iso_theoretical_mass_distance[r];
+      iso_mass_distance_error[i] = rows.iso_mass_distance_error[r];
+      iso_time_error[i] = rows.iso_time_error[r];
+      iso_number_carbons[i] = rows.iso_number_carbons[r];
+    }
   };
 
   // MARK: MS_CANDIDATE_CHAIN
@@ -589,6 +1048,81 @@ namespace nts
     };
   };
 
+  // MARK: MS_ANALYSIS_TARGETS
+  struct MS_ANALYSIS_TARGETS
+  {
+    std::string file;
+    sc::MS_SPECTRA_HEADERS headers;
+    sc::MS_TARGETS targets;
+
+    // filled by extract_analyses_targets, one entry per target in targets order
+    std::vector<sc::MS_TARGETS_SPECTRA> spectra;
+    std::vector<int> number_traces;
+    std::string error;
+  };
+
+  // MARK: MS_GAUSSIAN_FIT
+  struct MS_GAUSSIAN_FIT
+  {
+    float noise = 0;
+    float sn = 0;
+    float gauss_a = 0;
+    float gauss_u = 0;
+    float gauss_s = 0;
+    float gauss_f = 0;
+  };
+
+  // MARK: MS_FEATURES_QUALITY
+  struct MS_FEATURES_QUALITY
+  {
+    std::vector<float> noise;
+    std::vector<float> sn;
+    std::vector<float> gauss_a;
+    std::vector<float> gauss_u;
+    std::vector<float> gauss_s;
+    std::vector<float> gauss_f;
+
+    void resize_all(int n)
+    {
+      noise.resize(n);
+      sn.resize(n);
+      gauss_a.resize(n);
+      gauss_u.resize(n);
+      gauss_s.resize(n);
+      gauss_f.resize(n);
+    }
+  };
+
+  // MARK: MS_TRACE_PEAK
+  struct MS_TRACE_PEAK
+  {
+    // peak of a trace in CSR packed traces, apex, start and end are 0-based positions within the trace
+    int trace = 0;
+    int apex = 0;
+    int start = 0;
+    int end = 0;
+    double x = 0;
+    double min = 0;
+    double max = 0;
+    double intensity = 0;
+    double width = 0;
+    double height_left = 0;
+    double height_right = 0;
+    double area = 0;
+    double sn = 0;
+  };
+
+  // MARK: MS_SPECTRUM_CHARGES
+  struct MS_SPECTRUM_CHARGES
+  {
+    // rows of a spectrum at the apex of the clusters of a charge ladder, ordered by m/z
+    std::vector<int> idx;
+    std::vector<double> cluster;
+    std::vector<double> z;
+    std::vector<double> mass;
+    std::vector<double> z_step;
+  };
+
   // MARK: FUNCTIONS
 
   sc::MS_SPECTRA_HEADERS get_ms_analysis_list_headers(const Rcpp::List& analysis);
@@ -601,24 +1135,38 @@ namespace nts
 
   size_t find_min_index(const std::vector<float> &v);
 
+  std::vector<int> find_max_traces_within_rt(const std::vector<float> &rt, const std::vector<float> &intensity);
+
   void merge_traces_within_rt(std::vector<float> &rt, std::vector<float> &mz, std::vector<float> &intensity);
 
+  void merge_traces_within_rt(std::vector<sc::MS_TARGETS_SPECTRA> &spectra);
+
   void trim_to_equal_length_around_max_position(std::vector<float> &x, const size_t max_position);
 
+  void extract_analyses_targets(std::vector<MS_ANALYSIS_TARGETS> &analyses, const float &minIntLv1, const float &minIntLv2, const bool &mergeWithinRt);
+
   float trapezoidal_area(const std::vector<float> &x, const std::vector<float> &intensity);
 
   float gaussian(const float &A, const float &mu, const float &sigma, const float &x);
 
   float fit_gaussian_cost_function(const std::vector<float> &x, const std::vector<float> &y, float A, float mu, float sigma);
 
+  bool solve_linear_system_3x3(const double (&M)[3][3], const double (&v)[3], double (&out)[3]);
+
+  bool fit_gaussian_log_parabola(const std::vector<float> &x, const std::vector<float> &y, float &A_fitted, float &mu_fitted, float &sigma_fitted);
+
   void fit_gaussian(const std::vector<float> &x, const std::vector<float> &y, float &A_fitted, float &mu_fitted, float &sigma_fitted);
 
   float calculate_gaussian_rsquared(const std::vector<float> &x, const std::vector<float> &y, float A, float mu, float sigma);
 
+  MS_GAUSSIAN_FIT calculate_gaussian_fit(const float *rt, const float *intensity, const int &n, const float &baseCut, std::vector<float> &rt_trimmed, std::vector<float> &int_trimmed);
+
   Rcpp::List calculate_gaussian_fit(const std::string &ft, const std::vector<float> &rt, const std::vector<float> &intensity, const float &baseCut);
 
+  MS_FEATURES_QUALITY calculate_gaussian_fit(const std::vector<int64_t> &offsets, const std::vector<float> &rt, const std::vector<float> &intensity, const float &baseCut);
+
   std::vector<int> find_isotopic_candidates(
-      const int &number_features,
+      const MS_FEATURES_RT_INDEX &rt_index,
       const std::vector<std::string> &features,
       const std::vector<float> &mzs,
       const std::vector<float> &rts,
@@ -636,6 +1184,19 @@ namespace nts
 
   bool is_max_gap_reached(const int &s, const int &maxGaps, const std::vector<int> &steps);
 
+  const MS_ISOTOPE_COMBINATIONS &get_isotope_combinations(const std::vector<std::string> &elements,
+                                                          const int &max_number_elements);
+
+  void resolve_isotopes(MS_ANNOTATION &rows,
+                        std::vector<std::pair<int, float>> &consulted,
+                        const std::vector<int> &iso_step,
+                        const std::vector<float> &iso_mass_distance_error,
+                        const MS_ISOTOPE_COMBINATIONS &combinations,
+                        const MS_CANDIDATE_CHAIN &candidates_chain,
+                        const int &maxIsotopes,
+                        const int &maxCharge,
+                        const int &maxGaps);
+
   void annotate_isotopes(MS_ANNOTATION &af,
                          const MS_ISOTOPE_COMBINATIONS &combinations,
                          const MS_CANDIDATE_CHAIN &candidates_chain,
@@ -644,7 +1205,7 @@ namespace nts
                          const int &maxGaps);
 
   std::vector<int> find_adduct_candidates(
-      const int &number_features,
+      const MS_FEATURES_RT_INDEX &rt_index,
       const std::vector<float> &mzs,
       const std::vector<float> &rts,
       const std::vector<int> &pols,
@@ -661,8 +1222,91 @@ namespace nts
 
   void annotate_adducts(MS_ANNOTATION &af, const MS_CANDIDATE_CHAIN &candidates_chain, const int &pol);
 
+  void annotate_features(MS_ANNOTATION &af,
+                         const MS_FEATURES_MZ_SORTED &fdf,
+                         const MS_ISOTOPE_COMBINATIONS &combinations,
+                         const float &rtWindowAlignment,
+                         const int &maxIsotopes,
+                         const int &maxCharge,
+                         const int &maxGaps);
+
+  void annotate_analyses_features(std::vector<MS_ANNOTATION> &af,
+                                  const std::vector<MS_FEATURES_MZ_SORTED> &fdf,
+                                  const MS_ISOTOPE_COMBINATIONS &combinations,
+                                  const float &rtWindowAlignment,
+                                  const int &maxIsotopes,
+                                  const int &maxCharge,
+                                  const int &maxGaps);
+
+  template <typename T>
+  MS_CLUSTERED_SPECTRUM<T> cluster_spectrum(const std::vector<T> &rt,
+                                            const std::vector<T> &mz,
+                                            const std::vector<T> &intensity,
+                                            const std::vector<T> &pre_ce,
+                                            const std::vector<T> &pre_mz,
+                                            const T &mzClust,
+                                            const T &presence);
+
   Rcpp::List cluster_spectra(const Rcpp::List &spectra, const float &mzClust, const float &presence);
 
+  std::vector<int> group_features(const std::vector<int> &analysis,
+                                  const std::vector<float> &mass,
+                                  const std::vector<float> &rt,
+                                  const std::vector<float> &intensity,
+                                  const float &massDev,
+                                  const float &rtDev);
+
+  std::vector<MS_RT_WARP> align_rt(const std::vector<int> &analysis,
+                                   const std::vector<float> &rt,
+                                   const std::vector<int> &group,
+                                   const int &number_analyses,
+                                   const float &minPresence,
+                                   const float &span);
+
+  double peak_area(const double *x, const double *intensity, const int &start, const int &end);
+
+  void find_trace_maxima(const double *x,
+                         const double *intensity,
+                         const int &n,
+                         const double &minWidth,
+                         const double &maxWidth,
+                         const double &minHeight,
+                         std::vector<MS_TRACE_PEAK> &peaks);
+
+  void find_trace_peaks(const double *x,
+                        const double *intensity,
+                        const int &n,
+                        const bool &merge,
+                        const double &closeByThreshold,
+                        const double &minPeakHeight,
+                        const double &minPeakDistance,
+                        const double &minPeakWidth,
+                        const double &maxPeakWidth,
+                        const double &minSN,
+                        std::vector<MS_TRACE_PEAK> &peaks);
+
+  std::vector<MS_TRACE_PEAK> find_peaks(const std::vector<int64_t> &offsets,
+                                        const std::vector<double> &x,
+                                        const std::vector<double> &intensity,
+                                        const std::function<void(const double *, const double *, const int &, std::vector<MS_TRACE_PEAK> &)> &find_in_trace);
+
+  MS_SPECTRUM_CHARGES calculate_spectrum_charges(const std::vector<double> &mz,
+                                                 const std::vector<double> &intensity,
+                                                 const double &roundVal,
+                                                 const double &relLowCut,
+                                                 const double &absLowCut);
+
+  MS_CLUSTERED_SPECTRUM<double> deconvolute_spectrum(const std::vector<double> &rt,
+                                                     const std::vector<double> &mz,
+                                                     const std::vector<double> &intensity,
+                                                     const std::vector<double> &pre_ce,
+                                                     const std::vector<double> &pre_mz,
+                                                     const std::vector<double> &charge_mz,
+                                                     const std::vector<double> &charge_z,
+                                                     const double &clustVal,
+                                                     const double &window,
+                                                     int &first);
+
 }; // namespace nts
 
 #endif
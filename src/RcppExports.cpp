@@ -87,6 +87,19 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// rcpp_ms_build_spectra_index
+Rcpp::List rcpp_ms_build_spectra_index(Rcpp::List analysis, float binWidth, bool overwrite);
+RcppExport SEXP _StreamFind_rcpp_ms_build_spectra_index(SEXP analysisSEXP, SEXP binWidthSEXP, SEXP overwriteSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type analysis(analysisSEXP);
+    Rcpp::traits::input_parameter< float >::type binWidth(binWidthSEXP);
+    Rcpp::traits::input_parameter< bool >::type overwrite(overwriteSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_build_spectra_index(analysis, binWidth, overwrite));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rcpp_parse_ms_chromatograms
 Rcpp::List rcpp_parse_ms_chromatograms(Rcpp::List analysis, std::vector<int> idx);
 RcppExport SEXP _StreamFind_rcpp_parse_ms_chromatograms(SEXP analysisSEXP, SEXP idxSEXP) {
@@ -203,16 +216,72 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// rcpp_ms_calculate_spectra_charges
+Rcpp::List rcpp_ms_calculate_spectra_charges(Rcpp::List spectra, double roundVal, double relLowCut, double absLowCut);
+RcppExport SEXP _StreamFind_rcpp_ms_calculate_spectra_charges(SEXP spectraSEXP, SEXP roundValSEXP, SEXP relLowCutSEXP, SEXP absLowCutSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type spectra(spectraSEXP);
+    Rcpp::traits::input_parameter< double >::type roundVal(roundValSEXP);
+    Rcpp::traits::input_parameter< double >::type relLowCut(relLowCutSEXP);
+    Rcpp::traits::input_parameter< double >::type absLowCut(absLowCutSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_calculate_spectra_charges(spectra, roundVal, relLowCut, absLowCut));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_ms_deconvolute_spectra
+Rcpp::List rcpp_ms_deconvolute_spectra(Rcpp::List spectra, Rcpp::List charges, double clustVal, double window);
+RcppExport SEXP _StreamFind_rcpp_ms_deconvolute_spectra(SEXP spectraSEXP, SEXP chargesSEXP, SEXP clustValSEXP, SEXP windowSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type spectra(spectraSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type charges(chargesSEXP);
+    Rcpp::traits::input_parameter< double >::type clustVal(clustValSEXP);
+    Rcpp::traits::input_parameter< double >::type window(windowSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_deconvolute_spectra(spectra, charges, clustVal, window));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rcpp_ms_group_features
-Rcpp::DataFrame rcpp_ms_group_features(Rcpp::DataFrame features, float rt_dev, bool verbose);
-RcppExport SEXP _StreamFind_rcpp_ms_group_features(SEXP featuresSEXP, SEXP rt_devSEXP, SEXP verboseSEXP) {
+Rcpp::List rcpp_ms_group_features(Rcpp::DataFrame features, float rt_dev, float mass_dev, bool verbose);
+RcppExport SEXP _StreamFind_rcpp_ms_group_features(SEXP featuresSEXP, SEXP rt_devSEXP, SEXP mass_devSEXP, SEXP verboseSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame >::type features(featuresSEXP);
     Rcpp::traits::input_parameter< float >::type rt_dev(rt_devSEXP);
+    Rcpp::traits::input_parameter< float >::type mass_dev(mass_devSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_ms_group_features(features, rt_dev, verbose));
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_group_features(features, rt_dev, mass_dev, verbose));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_ms_align_features_rt
+Rcpp::List rcpp_ms_align_features_rt(Rcpp::DataFrame features, float min_presence, float span, bool verbose);
+RcppExport SEXP _StreamFind_rcpp_ms_align_features_rt(SEXP featuresSEXP, SEXP min_presenceSEXP, SEXP spanSEXP, SEXP verboseSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type features(featuresSEXP);
+    Rcpp::traits::input_parameter< float >::type min_presence(min_presenceSEXP);
+    Rcpp::traits::input_parameter< float >::type span(spanSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_align_features_rt(features, min_presence, span, verbose));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_ms_warp_rt
+std::vector<float> rcpp_ms_warp_rt(std::vector<float> rt, std::vector<float> rt_raw, std::vector<float> rt_aligned);
+RcppExport SEXP _StreamFind_rcpp_ms_warp_rt(SEXP rtSEXP, SEXP rt_rawSEXP, SEXP rt_alignedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<float> >::type rt(rtSEXP);
+    Rcpp::traits::input_parameter< std::vector<float> >::type rt_raw(rt_rawSEXP);
+    Rcpp::traits::input_parameter< std::vector<float> >::type rt_aligned(rt_alignedSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_ms_warp_rt(rt, rt_raw, rt_aligned));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -240,6 +309,17 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// rcpp_parse_asc_files
+Rcpp::List rcpp_parse_asc_files(std::vector<std::string> file_paths);
+RcppExport SEXP _StreamFind_rcpp_parse_asc_files(SEXP file_pathsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type file_paths(file_pathsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_parse_asc_files(file_paths));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rcpp_write_asc_file
 void rcpp_write_asc_file(const std::string& file, Rcpp::List metadata_list, Rcpp::NumericMatrix spectra);
 RcppExport SEXP _StreamFind_rcpp_write_asc_file(SEXP fileSEXP, SEXP metadata_listSEXP, SEXP spectraSEXP) {
@@ -252,6 +332,142 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// rcpp_merge_raman_analyses
+Rcpp::List rcpp_merge_raman_analyses(Rcpp::List analyses, std::string name, std::string new_file, int preCut);
+RcppExport SEXP _StreamFind_rcpp_merge_raman_analyses(SEXP analysesSEXP, SEXP nameSEXP, SEXP new_fileSEXP, SEXP preCutSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type analyses(analysesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type name(nameSEXP);
+    Rcpp::traits::input_parameter< std::string >::type new_file(new_fileSEXP);
+    Rcpp::traits::input_parameter< int >::type preCut(preCutSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_merge_raman_analyses(analyses, name, new_file, preCut));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_smooth_savgol
+std::vector<double> rcpp_smooth_savgol(std::vector<double> offsets, std::vector<double> intensity, int fl, int forder, int dorder);
+RcppExport SEXP _StreamFind_rcpp_smooth_savgol(SEXP offsetsSEXP, SEXP intensitySEXP, SEXP flSEXP, SEXP forderSEXP, SEXP dorderSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< int >::type fl(flSEXP);
+    Rcpp::traits::input_parameter< int >::type forder(forderSEXP);
+    Rcpp::traits::input_parameter< int >::type dorder(dorderSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_smooth_savgol(offsets, intensity, fl, forder, dorder));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_smooth_moving_average
+std::vector<double> rcpp_smooth_moving_average(std::vector<double> offsets, std::vector<double> intensity, int windowSize);
+RcppExport SEXP _StreamFind_rcpp_smooth_moving_average(SEXP offsetsSEXP, SEXP intensitySEXP, SEXP windowSizeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< int >::type windowSize(windowSizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_smooth_moving_average(offsets, intensity, windowSize));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_baseline_als
+std::vector<double> rcpp_baseline_als(std::vector<double> offsets, std::vector<double> intensity, double lambda, double p, int maxit);
+RcppExport SEXP _StreamFind_rcpp_baseline_als(SEXP offsetsSEXP, SEXP intensitySEXP, SEXP lambdaSEXP, SEXP pSEXP, SEXP maxitSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< double >::type lambda(lambdaSEXP);
+    Rcpp::traits::input_parameter< double >::type p(pSEXP);
+    Rcpp::traits::input_parameter< int >::type maxit(maxitSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_baseline_als(offsets, intensity, lambda, p, maxit));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_baseline_airpls
+std::vector<double> rcpp_baseline_airpls(std::vector<double> offsets, std::vector<double> intensity, double lambda, int differences, int itermax);
+RcppExport SEXP _StreamFind_rcpp_baseline_airpls(SEXP offsetsSEXP, SEXP intensitySEXP, SEXP lambdaSEXP, SEXP differencesSEXP, SEXP itermaxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< double >::type lambda(lambdaSEXP);
+    Rcpp::traits::input_parameter< int >::type differences(differencesSEXP);
+    Rcpp::traits::input_parameter< int >::type itermax(itermaxSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_baseline_airpls(offsets, intensity, lambda, differences, itermax));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_find_maxima
+Rcpp::List rcpp_find_maxima(std::vector<double> offsets, std::vector<double> x, std::vector<double> intensity, double minWidth, double maxWidth, double minHeight);
+RcppExport SEXP _StreamFind_rcpp_find_maxima(SEXP offsetsSEXP, SEXP xSEXP, SEXP intensitySEXP, SEXP minWidthSEXP, SEXP maxWidthSEXP, SEXP minHeightSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type x(xSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< double >::type minWidth(minWidthSEXP);
+    Rcpp::traits::input_parameter< double >::type maxWidth(maxWidthSEXP);
+    Rcpp::traits::input_parameter< double >::type minHeight(minHeightSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_find_maxima(offsets, x, intensity, minWidth, maxWidth, minHeight));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_find_peaks
+Rcpp::List rcpp_find_peaks(std::vector<double> offsets, std::vector<double> x, std::vector<double> intensity, bool merge, double closeByThreshold, double minPeakHeight, double minPeakDistance, double minPeakWidth, double maxPeakWidth, double minSN);
+RcppExport SEXP _StreamFind_rcpp_find_peaks(SEXP offsetsSEXP, SEXP xSEXP, SEXP intensitySEXP, SEXP mergeSEXP, SEXP closeByThresholdSEXP, SEXP minPeakHeightSEXP, SEXP minPeakDistanceSEXP, SEXP minPeakWidthSEXP, SEXP maxPeakWidthSEXP, SEXP minSNSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type x(xSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< bool >::type merge(mergeSEXP);
+    Rcpp::traits::input_parameter< double >::type closeByThreshold(closeByThresholdSEXP);
+    Rcpp::traits::input_parameter< double >::type minPeakHeight(minPeakHeightSEXP);
+    Rcpp::traits::input_parameter< double >::type minPeakDistance(minPeakDistanceSEXP);
+    Rcpp::traits::input_parameter< double >::type minPeakWidth(minPeakWidthSEXP);
+    Rcpp::traits::input_parameter< double >::type maxPeakWidth(maxPeakWidthSEXP);
+    Rcpp::traits::input_parameter< double >::type minSN(minSNSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_find_peaks(offsets, x, intensity, merge, closeByThreshold, minPeakHeight, minPeakDistance, minPeakWidth, maxPeakWidth, minSN));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_normalize_spectra
+std::vector<double> rcpp_normalize_spectra(std::vector<double> offsets, std::vector<double> intensity, std::string method, bool liftToZero);
+RcppExport SEXP _StreamFind_rcpp_normalize_spectra(SEXP offsetsSEXP, SEXP intensitySEXP, SEXP methodSEXP, SEXP liftToZeroSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<double> >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type intensity(intensitySEXP);
+    Rcpp::traits::input_parameter< std::string >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< bool >::type liftToZero(liftToZeroSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_normalize_spectra(offsets, intensity, method, liftToZero));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_average_spectra
+Rcpp::List rcpp_average_spectra(Rcpp::List spectra, std::vector<int> replicate, int numberReplicates, bool collapseTime);
+RcppExport SEXP _StreamFind_rcpp_average_spectra(SEXP spectraSEXP, SEXP replicateSEXP, SEXP numberReplicatesSEXP, SEXP collapseTimeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type spectra(spectraSEXP);
+    Rcpp::traits::input_parameter< std::vector<int> >::type replicate(replicateSEXP);
+    Rcpp::traits::input_parameter< int >::type numberReplicates(numberReplicatesSEXP);
+    Rcpp::traits::input_parameter< bool >::type collapseTime(collapseTimeSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_average_spectra(spectra, replicate, numberReplicates, collapseTime));
+    return rcpp_result_gen;
+END_RCPP
+}
 // test_read_hdf5
 Rcpp::List test_read_hdf5(const std::string& file_name);
 RcppExport SEXP _StreamFind_test_read_hdf5(SEXP file_nameSEXP) {
@@ -281,6 +497,7 @@ static const R_CallMethodDef CallEntries[] = {
     {"_StreamFind_rcpp_parse_ms_spectra_headers", (DL_FUNC) &_StreamFind_rcpp_parse_ms_spectra_headers, 1},
     {"_StreamFind_rcpp_parse_ms_chromatograms_headers", (DL_FUNC) &_StreamFind_rcpp_parse_ms_chromatograms_headers, 1},
     {"_StreamFind_rcpp_parse_ms_spectra", (DL_FUNC) &_StreamFind_rcpp_parse_ms_spectra, 5},
+    {"_StreamFind_rcpp_ms_build_spectra_index", (DL_FUNC) &_StreamFind_rcpp_ms_build_spectra_index, 3},
     {"_StreamFind_rcpp_parse_ms_chromatograms", (DL_FUNC) &_StreamFind_rcpp_parse_ms_chromatograms, 2},
     {"_StreamFind_rcpp_ms_annotate_features", (DL_FUNC) &_StreamFind_rcpp_ms_annotate_features, 5},
     {"_StreamFind_rcpp_ms_load_features_eic", (DL_FUNC) &_StreamFind_rcpp_ms_load_features_eic, 6},
@@ -288,10 +505,24 @@ static const R_CallMethodDef CallEntries[] = {
     {"_StreamFind_rcpp_ms_load_features_ms2", (DL_FUNC) &_StreamFind_rcpp_ms_load_features_ms2, 7},
     {"_StreamFind_rcpp_ms_fill_features", (DL_FUNC) &_StreamFind_rcpp_ms_fill_features, 10},
     {"_StreamFind_rcpp_ms_calculate_features_quality", (DL_FUNC) &_StreamFind_rcpp_ms_calculate_features_quality, 8},
-    {"_StreamFind_rcpp_ms_group_features", (DL_FUNC) &_StreamFind_rcpp_ms_group_features, 3},
+    {"_StreamFind_rcpp_ms_calculate_spectra_charges", (DL_FUNC) &_StreamFind_rcpp_ms_calculate_spectra_charges, 4},
+    {"_StreamFind_rcpp_ms_deconvolute_spectra", (DL_FUNC) &_StreamFind_rcpp_ms_deconvolute_spectra, 4},
+    {"_StreamFind_rcpp_ms_group_features", (DL_FUNC) &_StreamFind_rcpp_ms_group_features, 4},
+    {"_StreamFind_rcpp_ms_align_features_rt", (DL_FUNC) &_StreamFind_rcpp_ms_align_features_rt, 4},
+    {"_StreamFind_rcpp_ms_warp_rt", (DL_FUNC) &_StreamFind_rcpp_ms_warp_rt, 3},
     {"_StreamFind_rcpp_ms_groups_correspondence", (DL_FUNC) &_StreamFind_rcpp_ms_groups_correspondence, 3},
     {"_StreamFind_rcpp_parse_asc_file", (DL_FUNC) &_StreamFind_rcpp_parse_asc_file, 1},
+    {"_StreamFind_rcpp_parse_asc_files", (DL_FUNC) &_StreamFind_rcpp_parse_asc_files, 1},
     {"_StreamFind_rcpp_write_asc_file", (DL_FUNC) &_StreamFind_rcpp_write_asc_file, 3},
+    {"_StreamFind_rcpp_merge_raman_analyses", (DL_FUNC) &_StreamFind_rcpp_merge_raman_analyses, 4},
+    {"_StreamFind_rcpp_smooth_savgol", (DL_FUNC) &_StreamFind_rcpp_smooth_savgol, 5},
+    {"_StreamFind_rcpp_smooth_moving_average", (DL_FUNC) &_StreamFind_rcpp_smooth_moving_average, 3},
+    {"_StreamFind_rcpp_baseline_als", (DL_FUNC) &_StreamFind_rcpp_baseline_als, 5},
+    {"_StreamFind_rcpp_baseline_airpls", (DL_FUNC) &_StreamFind_rcpp_baseline_airpls, 5},
+    {"_StreamFind_rcpp_find_maxima", (DL_FUNC) &_StreamFind_rcpp_find_maxima, 6},
+    {"_StreamFind_rcpp_find_peaks", (DL_FUNC) &_StreamFind_rcpp_find_peaks, 10},
+    {"_StreamFind_rcpp_normalize_spectra", (DL_FUNC) &_StreamFind_rcpp_normalize_spectra, 4},
+    {"_StreamFind_rcpp_average_spectra", (DL_FUNC) &_StreamFind_rcpp_average_spectra, 4},
     {"_StreamFind_test_read_hdf5", (DL_FUNC) &_StreamFind_test_read_hdf5, 1},
     {"_StreamFind_test_create_hdf5", (DL_FUNC) &_StreamFind_test_create_hdf5, 0},
     {NULL, NULL, 0}
@@ -6,7 +6,11 @@
 #include <cstdint>
 #include <stdexcept>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
 #include <cmath>
+#include <limits>
 #include <zlib.h>
 #include <omp.h>
 
@@ -501,6 +505,740 @@ std::string sc::decode_base64(const std::string &encoded_string)
   return decoded_string;
 };
 
+uint32_t sc::float_to_sortable_key(const float &value)
+{
+  // adding zero folds -0 into +0 so both map to the same key
+  const float v = value + 0.0f;
+  uint32_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  // negatives have all bits flipped, positives only the sign bit, so unsigned order equals float order
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+};
+
+void sc::radix_sort_by_key(std::vector<uint32_t> &keys, std::vector<int> &values)
+{
+  // stable LSD radix sort of (key, value) pairs with 8 bit digits and per thread histograms
+  const int n = keys.size();
+
+  if (n < 2)
+    return;
+
+  const int number_buckets = 256;
+
+  std::vector<uint32_t> keys_tmp(n);
+  std::vector<int> values_tmp(n);
+
+  const int number_threads = omp_get_max_threads();
+
+  std::vector<int> histograms(number_threads * number_buckets);
+
+  for (int shift = 0; shift < 32; shift += 8)
+  {
+
+    std::fill(histograms.begin(), histograms.end(), 0);
+
+    // when all keys share the digit the pass is an identity and the scatter is skipped
+    bool skip_pass = false;
+
+#pragma omp parallel num_threads(number_threads)
+    {
+      const int t = omp_get_thread_num();
+      const int t_size = omp_get_num_threads();
+      const int begin = static_cast<int>((static_cast<long long>(n) * t) / t_size);
+      const int end = static_cast<int>((static_cast<long long>(n) * (t + 1)) / t_size);
+
+      int *hist = &histograms[t * number_buckets];
+
+      for (int i = begin; i < end; i++)
+        hist[(keys[i] >> shift) & 0xFF]++;
+
+#pragma omp barrier
+#pragma omp single
+      {
+        // bucket offsets are laid out digit major and thread minor to keep the sort stable
+        int offset = 0;
+        for (int d = 0; d < number_buckets; d++)
+        {
+          int digit_count = 0;
+          for (int z = 0; z < t_size; z++)
+          {
+            const int count = histograms[z * number_buckets + d];
+            histograms[z * number_buckets + d] = offset;
+            offset += count;
+            digit_count += count;
+          }
+          if (digit_count == n)
+            skip_pass = true;
+        }
+      }
+
+      if (!skip_pass)
+      {
+        for (int i = begin; i < end; i++)
+        {
+          const int pos = hist[(keys[i] >> shift) & 0xFF]++;
+          keys_tmp[pos] = keys[i];
+          values_tmp[pos] = values[i];
+        }
+      }
+    }
+
+    if (!skip_pass)
+    {
+      keys.swap(keys_tmp);
+      values.swap(values_tmp);
+    }
+  }
+};
+
+std::vector<int> sc::radix_order_traces(const std::vector<float> &rt,
+                                        const std::vector<float> &mobility,
+                                        const std::vector<float> &mz,
+                                        const std::vector<int> &rank)
+{
+  // ordering by rt, mobility, mz and rank, obtained by stable passes from the least to the most significant key
+  const int n = rt.size();
+
+  std::vector<int> idx(n);
+  std::iota(idx.begin(), idx.end(), 0);
+
+  if (n < 2)
+    return idx;
+
+  std::vector<uint32_t> keys(n);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    keys[i] = static_cast<uint32_t>(rank[i]);
+
+  sc::radix_sort_by_key(keys, idx);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    keys[i] = sc::float_to_sortable_key(mz[idx[i]]);
+
+  sc::radix_sort_by_key(keys, idx);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    keys[i] = sc::float_to_sortable_key(mobility[idx[i]]);
+
+  sc::radix_sort_by_key(keys, idx);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    keys[i] = sc::float_to_sortable_key(rt[idx[i]]);
+
+  sc::radix_sort_by_key(keys, idx);
+
+  return idx;
+};
+
+bool sc::get_file_stamp(const std::string &file, uint64_t &size, int64_t &time)
+{
+  std::error_code ec;
+  size = std::filesystem::file_size(file, ec);
+  if (ec)
+    return false;
+  const auto write_time = std::filesystem::last_write_time(file, ec);
+  if (ec)
+    return false;
+  time = static_cast<int64_t>(write_time.time_since_epoch().count());
+  return true;
+};
+
+std::string sc::get_mz_rt_index_path(const std::string &file)
+{
+  return file + ".scindex";
+};
+
+namespace
+{
+  // loaded indices are kept for the process lifetime so that repeated queries do not touch the disk,
+  // an entry is valid while both the source file and the index file keep their size and write time
+  struct CACHED_MZ_RT_INDEX
+  {
+    std::shared_ptr<const sc::MS_MZ_RT_INDEX> index;
+    uint64_t index_size = 0;
+    int64_t index_time = 0;
+  };
+
+  std::mutex mz_rt_index_cache_mutex;
+  std::unordered_map<std::string, CACHED_MZ_RT_INDEX> mz_rt_index_cache;
+}
+
+std::shared_ptr<const sc::MS_MZ_RT_INDEX> sc::load_mz_rt_index(const std::string &file)
+{
+  const std::string index_path = sc::get_mz_rt_index_path(file);
+
+  uint64_t size = 0;
+  int64_t time = 0;
+  uint64_t index_size = 0;
+  int64_t index_time = 0;
+
+  std::lock_guard<std::mutex> lock(mz_rt_index_cache_mutex);
+
+  if (!sc::get_file_stamp(file, size, time) || !sc::get_file_stamp(index_path, index_size, index_time))
+  {
+    mz_rt_index_cache.erase(file);
+    return nullptr;
+  }
+
+  auto it = mz_rt_index_cache.find(file);
+
+  if (it != mz_rt_index_cache.end())
+  {
+    const CACHED_MZ_RT_INDEX &cached = it->second;
+    if (cached.index->source_size == size && cached.index->source_time == time && cached.index_size == index_size && cached.index_time == index_time)
+      return cached.index;
+    mz_rt_index_cache.erase(it);
+  }
+
+  auto index = std::make_shared<sc::MS_MZ_RT_INDEX>();
+
+  if (!index->read(index_path))
+    return nullptr;
+
+  // the index is stale when the source file changed after it was written
+  if (index->source_size != size || index->source_time != time)
+    return nullptr;
+
+  mz_rt_index_cache[file] = CACHED_MZ_RT_INDEX{index, index_size, index_time};
+
+  return index;
+};
+
+std::shared_ptr<const sc::MS_MZ_RT_INDEX> sc::save_mz_rt_index(const std::string &file, const sc::MS_MZ_RT_INDEX &index)
+{
+  const std::string index_path = sc::get_mz_rt_index_path(file);
+
+  std::lock_guard<std::mutex> lock(mz_rt_index_cache_mutex);
+
+  index.write(index_path);
+
+  // the written index replaces the cached one directly, write times can be too coarse to tell rewrites apart
+  uint64_t index_size = 0;
+  int64_t index_time = 0;
+
+  if (!sc::get_file_stamp(index_path, index_size, index_time))
+    throw std::runtime_error("The index " + index_path + " could not be found after writing!");
+
+  auto saved = std::make_shared<const sc::MS_MZ_RT_INDEX>(index);
+
+  mz_rt_index_cache[file] = CACHED_MZ_RT_INDEX{saved, index_size, index_time};
+
+  return saved;
+};
+
+// MARK: SAVGOL_COEFFICIENTS
+std::vector<double> sc::savgol_coefficients(const int &fl, const int &forder, const int &dorder)
+{
+  if (fl <= 1 || fl % 2 == 0)
+    throw std::runtime_error("The filter length must be an odd integer greater than 1!");
+
+  if (forder < 0 || forder >= fl)
+    throw std::runtime_error("The filter order must be between 0 and the filter length minus 1!");
+
+  if (dorder < 0 || dorder > forder)
+    throw std::runtime_error("The derivative order must be between 0 and the filter order!");
+
+  const int fc = (fl - 1) / 2;
+  const int m = forder + 1;
+
+  // row dorder of the pseudoinverse of the Vandermonde matrix of -fc:fc, via QR (modified Gram-Schmidt)
+  // on positions scaled to [-1, 1] for conditioning
+  std::vector<std::vector<double>> Q(m, std::vector<double>(fl));
+  std::vector<std::vector<double>> R(m, std::vector<double>(m, 0));
+
+  for (int p = 0; p < m; p++)
+    for (int i = 0; i < fl; i++)
+      Q[p][i] = std::pow(static_cast<double>(i - fc) / fc, p);
+
+  for (int p = 0; p < m; p++)
+  {
+    for (int q = 0; q < p; q++)
+    {
+      double dot = 0;
+      for (int i = 0; i < fl; i++)
+        dot += Q[q][i] * Q[p][i];
+      R[q][p] = dot;
+      for (int i = 0; i < fl; i++)
+        Q[p][i] -= dot * Q[q][i];
+    }
+
+    double norm = 0;
+    for (int i = 0; i < fl; i++)
+      norm += Q[p][i] * Q[p][i];
+    norm = std::sqrt(norm);
+    R[p][p] = norm;
+    for (int i = 0; i < fl; i++)
+      Q[p][i] /= norm;
+  }
+
+  // row dorder of R^-1 by back substitution
+  std::vector<double> r_inv(m, 0);
+  r_inv[dorder] = 1 / R[dorder][dorder];
+  for (int q = dorder + 1; q < m; q++)
+  {
+    double sum = 0;
+    for (int p = dorder; p < q; p++)
+      sum += r_inv[p] * R[p][q];
+    r_inv[q] = -sum / R[q][q];
+  }
+
+  const double scale = std::pow(static_cast<double>(fc), dorder);
+
+  std::vector<double> coefficients(fl, 0);
+  for (int i = 0; i < fl; i++)
+  {
+    for (int p = dorder; p < m; p++)
+      coefficients[i] += r_inv[p] * Q[p][i];
+    coefficients[i] /= scale;
+  }
+
+  return coefficients;
+};
+
+// MARK: SMOOTH_SAVGOL
+std::vector<double> sc::smooth_savgol(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const std::vector<double> &coefficients)
+{
+  std::vector<double> out(intensity.size(), 0);
+
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+  const int64_t fl = coefficients.size();
+  const int64_t fc = (fl - 1) / 2;
+  const double *h = coefficients.data();
+
+  // values beyond the ends of a trace are taken as zero, as in pracma::savgol
+#pragma omp parallel for schedule(dynamic, 64)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int64_t n = offsets[t + 1] - offsets[t];
+    const double *y = intensity.data() + offsets[t];
+    double *o = out.data() + offsets[t];
+
+    for (int64_t i = 0; i < n; i++)
+    {
+      const int64_t first = std::max<int64_t>(0, fc - i);
+      const int64_t last = std::min<int64_t>(fl, n - i + fc);
+      const double *yi = y + i - fc;
+      double acc = 0;
+
+#pragma omp simd reduction(+ : acc)
+      for (int64_t k = first; k < last; k++)
+        acc += h[k] * yi[k];
+
+      o[i] = acc;
+    }
+  }
+
+  return out;
+};
+
+// MARK: SMOOTH_MOVING_AVERAGE
+std::vector<double> sc::smooth_moving_average(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const int &windowSize)
+{
+  std::vector<double> out(intensity);
+
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+
+  if (windowSize < 1)
+    return out;
+
+  // left and right windows of up to windowSize points, the shorter one is padded with its own mean
+  // and points without a left or right neighbour are kept
+#pragma omp parallel for schedule(dynamic, 64)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int64_t n = offsets[t + 1] - offsets[t];
+    const double *y = intensity.data() + offsets[t];
+    double *o = out.data() + offsets[t];
+
+    std::vector<double> cumulative(n + 1, 0);
+    for (int64_t i = 0; i < n; i++)
+      cumulative[i + 1] = cumulative[i] + y[i];
+
+    for (int64_t i = 1; i < n - 1; i++)
+    {
+      const int64_t left = std::min<int64_t>(windowSize, i);
+      const int64_t right = std::min<int64_t>(windowSize, n - 1 - i);
+      const int64_t size = std::max(left, right);
+      const double left_sum = cumulative[i] - cumulative[i - left];
+      const double right_sum = cumulative[i + 1 + right] - cumulative[i + 1];
+      o[i] = (left_sum * size / left + y[i] + right_sum * size / right) / (2 * size + 1);
+    }
+  }
+
+  return out;
+};
+
+// MARK: NORMALIZE_TRACES
+std::vector<double> sc::normalize_traces(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const std::string &method, const bool &liftToZero)
+{
+  const std::vector<std::string> methods = {"minmax", "snv", "scale", "blockweight", "meancenter", "minmax_abs", "meanscale"};
+
+  const int m = std::find(methods.begin(), methods.end(), method) - methods.begin();
+
+  if (m == static_cast<int>(methods.size()))
+    throw std::runtime_error("The normalization method must be minmax, snv, scale, blockweight, meancenter, minmax_abs or meanscale!");
+
+  std::vector<double> out(intensity);
+
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+
+  // minmax: (x - min) / (max - min), snv: (x - mean) / sd optionally lifted to a zero minimum, scale: x / sd,
+  // blockweight: x / sqrt(n), meancenter: x - mean, minmax_abs: (x - min) / (max - min + |min|) and
+  // meanscale: x / mean, sd with the n - 1 denominator as in R
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int64_t n = offsets[t + 1] - offsets[t];
+    if (n == 0)
+      continue;
+
+    const double *y = intensity.data() + offsets[t];
+    double *o = out.data() + offsets[t];
+
+    double min = y[0];
+    double max = y[0];
+    double sum = 0;
+
+#pragma omp simd reduction(min : min) reduction(max : max) reduction(+ : sum)
+    for (int64_t i = 0; i < n; i++)
+    {
+      min = std::min(min, y[i]);
+      max = std::max(max, y[i]);
+      sum += y[i];
+    }
+
+    const double mean = sum / n;
+
+    double sd = std::nan("");
+    if ((m == 1 || m == 2) && n > 1)
+    {
+      double squares = 0;
+#pragma omp simd reduction(+ : squares)
+      for (int64_t i = 0; i < n; i++)
+        squares += (y[i] - mean) * (y[i] - mean);
+      sd = std::sqrt(squares / (n - 1));
+    }
+
+    double shift = 0;
+    double scale = 1;
+
+    switch (m)
+    {
+    case 0:
+      shift = min;
+      scale = max - min;
+      break;
+    case 1:
+      shift = mean;
+      scale = sd;
+      break;
+    case 2:
+      scale = sd;
+      break;
+    case 3:
+      scale = std::sqrt(static_cast<double>(n));
+      break;
+    case 4:
+      shift = mean;
+      break;
+    case 5:
+      shift = min;
+      scale = max - min + std::abs(min);
+      break;
+    case 6:
+      scale = mean;
+      break;
+    }
+
+#pragma omp simd
+    for (int64_t i = 0; i < n; i++)
+      o[i] = (y[i] - shift) / scale;
+
+    if (m == 1 && liftToZero)
+    {
+      const double lift = std::abs((min - shift) / scale);
+#pragma omp simd
+      for (int64_t i = 0; i < n; i++)
+        o[i] += lift;
+    }
+  }
+
+  return out;
+};
+
+// MARK: AVERAGE_SPECTRA
+sc::SPECTRA_AVERAGE sc::average_spectra(const std::vector<std::vector<std::vector<uint64_t>>> &keys, const std::vector<std::vector<std::vector<double>>> &values)
+{
+  SPECTRA_AVERAGE out;
+
+  if (keys.size() != values.size())
+    throw std::runtime_error("The keys and values must have the same number of analyses!");
+
+  const int number_analyses = keys.size();
+
+  if (number_analyses == 0)
+    return out;
+
+  const size_t number_keys = keys[0].size();
+  const size_t number_values = values[0].size();
+
+  if (number_values == 0)
+    throw std::runtime_error("At least one value column is needed for averaging!");
+
+  // groups are kept in the order of their first row, with equal hashes chained by next
+  std::unordered_map<uint64_t, int64_t> heads;
+  std::vector<int64_t> next;
+  std::vector<uint64_t> group_keys;
+  std::vector<std::vector<long double>> sums(number_values);
+  std::vector<int64_t> counts;
+
+  for (int a = 0; a < number_analyses; a++)
+  {
+    if (keys[a].size() != number_keys || values[a].size() != number_values)
+      throw std::runtime_error("All analyses must have the same key and value columns!");
+
+    const int64_t number_rows = values[a][0].size();
+
+    for (size_t k = 0; k < number_keys; k++)
+      if (static_cast<int64_t>(keys[a][k].size()) != number_rows)
+        throw std::runtime_error("The key and value columns must have the same length!");
+
+    for (size_t v = 0; v < number_values; v++)
+      if (static_cast<int64_t>(values[a][v].size()) != number_rows)
+        throw std::runtime_error("The key and value columns must have the same length!");
+
+    for (int64_t r = 0; r < number_rows; r++)
+    {
+      uint64_t hash = 0x9E3779B97F4A7C15ULL;
+      for (size_t k = 0; k < number_keys; k++)
+      {
+        uint64_t h = keys[a][k][r] + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        hash ^= h ^ (h >> 31);
+      }
+
+      auto head = heads.find(hash);
+
+      int64_t g = head == heads.end() ? -1 : head->second;
+
+      while (g >= 0)
+      {
+        size_t k = 0;
+        while (k < number_keys && group_keys[g * number_keys + k] == keys[a][k][r])
+          k++;
+        if (k == number_keys)
+          break;
+        g = next[g];
+      }
+
+      if (g < 0)
+      {
+        g = counts.size();
+        next.push_back(head == heads.end() ? -1 : head->second);
+        heads[hash] = g;
+        for (size_t k = 0; k < number_keys; k++)
+          group_keys.push_back(keys[a][k][r]);
+        for (size_t v = 0; v < number_values; v++)
+          sums[v].push_back(0);
+        counts.push_back(0);
+        out.analysis.push_back(a);
+        out.row.push_back(r);
+      }
+
+      for (size_t v = 0; v < number_values; v++)
+        sums[v][g] += values[a][v][r];
+      counts[g]++;
+    }
+  }
+
+  out.values.resize(number_values);
+
+  for (size_t v = 0; v < number_values; v++)
+  {
+    out.values[v].resize(counts.size());
+    for (size_t g = 0; g < counts.size(); g++)
+      out.values[v][g] = static_cast<double>(sums[v][g] / counts[g]);
+  }
+
+  return out;
+};
+
+// MARK: PLS_BAND_SOLVER
+sc::PLS_BAND_SOLVER::PLS_BAND_SOLVER(const int64_t &n, const double &lambda, const int &differences)
+    : n(n), bandwidth(differences)
+{
+  if (differences < 1)
+    throw std::runtime_error("The order of the differences must be at least 1!");
+
+  // coefficients of a row of D, the binomial coefficients with alternating sign
+  std::vector<double> c(differences + 1, 1);
+  for (int k = 1; k <= differences; k++)
+    c[k] = c[k - 1] * (differences - k + 1) / k;
+  for (int k = differences - 1; k >= 0; k -= 2)
+    c[k] = -c[k];
+
+  // upper band of lambda D'D, penalty[k][i] is the element (i, i + k)
+  penalty.assign(differences + 1, std::vector<double>(n, 0));
+  for (int64_t r = 0; r + differences < n; r++)
+    for (int a = 0; a <= differences; a++)
+      for (int b = a; b <= differences; b++)
+        penalty[b - a][r + a] += lambda * c[a] * c[b];
+
+  lower.assign(differences + 1, std::vector<double>(n, 0));
+  diagonal.assign(n, 0);
+};
+
+void sc::PLS_BAND_SOLVER::solve(const double *w, const double *y, double *z)
+{
+  const int d = bandwidth;
+
+  // factorization, lower[m][i] is the element (i, i - m) of L
+  for (int64_t j = 0; j < n; j++)
+  {
+    double dj = penalty[0][j] + w[j];
+    for (int m = 1; m <= d && m <= j; m++)
+      dj -= lower[m][j] * lower[m][j] * diagonal[j - m];
+    diagonal[j] = dj;
+
+    for (int m = 1; m <= d && j + m < n; m++)
+    {
+      const int64_t i = j + m;
+      double a = penalty[m][j];
+      for (int64_t k = std::max<int64_t>(0, i - d); k < j; k++)
+        a -= lower[i - k][i] * lower[j - k][j] * diagonal[k];
+      lower[m][i] = a / dj;
+    }
+  }
+
+  for (int64_t i = 0; i < n; i++)
+  {
+    double u = w[i] * y[i];
+    for (int m = 1; m <= d && m <= i; m++)
+      u -= lower[m][i] * z[i - m];
+    z[i] = u;
+  }
+
+  for (int64_t i = 0; i < n; i++)
+    z[i] /= diagonal[i];
+
+  for (int64_t i = n - 1; i >= 0; i--)
+  {
+    double u = z[i];
+    for (int m = 1; m <= d && i + m < n; m++)
+      u -= lower[m][i + m] * z[i + m];
+    z[i] = u;
+  }
+};
+
+// MARK: BASELINE_ALS
+std::vector<double> sc::baseline_als(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const double &lambda, const double &p, const int &maxit)
+{
+  std::vector<double> out(intensity);
+
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+
+  // second differences penalty, residuals above the baseline are weighted by p and below by 1 - p,
+  // the weights carry over between iterations until they no longer change
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int64_t n = offsets[t + 1] - offsets[t];
+    if (n <= 2)
+      continue;
+
+    const double *y = intensity.data() + offsets[t];
+    double *z = out.data() + offsets[t];
+
+    sc::PLS_BAND_SOLVER solver(n, lambda, 2);
+    std::vector<double> w(n, 1);
+
+    for (int it = 0; it < std::max(maxit, 1); it++)
+    {
+      solver.solve(w.data(), y, z);
+
+      bool changed = false;
+      for (int64_t i = 0; i < n; i++)
+      {
+        const double wi = y[i] > z[i] ? p : (y[i] < z[i] ? 1 - p : 0);
+        changed = changed || wi != w[i];
+        w[i] = wi;
+      }
+
+      if (!changed)
+        break;
+    }
+  }
+
+  return out;
+};
+
+// MARK: BASELINE_AIRPLS
+std::vector<double> sc::baseline_airpls(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const double &lambda, const int &differences, const int &itermax)
+{
+  if (differences < 1)
+    throw std::runtime_error("The order of the differences must be at least 1!");
+
+  std::vector<double> out(intensity);
+
+  const int number_traces = static_cast<int>(offsets.size()) - 1;
+
+  // adaptive reweighting of Zhang et al. (2010), points below the baseline are weighted exponentially by their
+  // share of the total negative residual and points above get zero weight, except the trace ends
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int t = 0; t < number_traces; t++)
+  {
+    const int64_t n = offsets[t + 1] - offsets[t];
+    if (n <= differences)
+      continue;
+
+    const double *y = intensity.data() + offsets[t];
+    double *z = out.data() + offsets[t];
+
+    sc::PLS_BAND_SOLVER solver(n, lambda, differences);
+    std::vector<double> w(n, 1);
+
+    double sum_abs = 0;
+    for (int64_t i = 0; i < n; i++)
+      sum_abs += std::abs(y[i]);
+
+    for (int it = 1;; it++)
+    {
+      solver.solve(w.data(), y, z);
+
+      double sum_smaller = 0;
+      double max_negative = -std::numeric_limits<double>::infinity();
+      for (int64_t i = 0; i < n; i++)
+      {
+        const double d = y[i] - z[i];
+        if (d < 0)
+        {
+          sum_smaller -= d;
+          max_negative = std::max(max_negative, d);
+        }
+      }
+
+      if (sum_smaller == 0 || sum_smaller < 0.001 * sum_abs || it >= itermax)
+        break;
+
+      for (int64_t i = 0; i < n; i++)
+      {
+        const double d = y[i] - z[i];
+        w[i] = d >= 0 ? 0 : std::exp(-it * d / sum_smaller);
+      }
+
+      w[0] = std::exp(it * max_negative / sum_smaller);
+      w[n - 1] = w[0];
+    }
+  }
+
+  return out;
+};
+
 // MARK: MZXML
 
 int sc::mzxml::MZXML_SPECTRUM::extract_spec_index() const
@@ -3794,6 +4532,319 @@ sc::MS_SPECTRUM sc::mzxml::MZXML::get_spectrum(const int &idx)
   return spectrum;
 };
 
+// MARK: MS_MZ_RT_INDEX
+
+void sc::MS_MZ_RT_INDEX::write(const std::string &path) const
+{
+  // written to a temporary file and renamed so that readers never see a partial index
+  const std::string tmp_path = path + ".tmp";
+
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+  if (!out)
+    throw std::runtime_error("Could not open " + tmp_path + " for writing!");
+
+  const char magic[8] = {'S', 'C', 'I', 'N', 'D', 'E', 'X', '1'};
+  const uint64_t number_postings = size();
+
+  out.write(magic, sizeof(magic));
+  out.write(reinterpret_cast<const char *>(&source_size), sizeof(source_size));
+  out.write(reinterpret_cast<const char *>(&source_time), sizeof(source_time));
+  out.write(reinterpret_cast<const char *>(&bin_width), sizeof(bin_width));
+  out.write(reinterpret_cast<const char *>(&min_mz), sizeof(min_mz));
+  out.write(reinterpret_cast<const char *>(&number_bins), sizeof(number_bins));
+  out.write(reinterpret_cast<const char *>(&number_postings), sizeof(number_postings));
+  out.write(reinterpret_cast<const char *>(bin_offsets.data()), bin_offsets.size() * sizeof(int64_t));
+  out.write(reinterpret_cast<const char *>(spectrum.data()), number_postings * sizeof(int));
+  out.write(reinterpret_cast<const char *>(offset.data()), number_postings * sizeof(int));
+  out.write(reinterpret_cast<const char *>(rt.data()), number_postings * sizeof(float));
+  out.write(reinterpret_cast<const char *>(mz.data()), number_postings * sizeof(float));
+  out.write(reinterpret_cast<const char *>(intensity.data()), number_postings * sizeof(float));
+  out.close();
+
+  if (!out)
+    throw std::runtime_error("Failed to write the index " + tmp_path + "!");
+
+  std::filesystem::rename(tmp_path, path);
+};
+
+bool sc::MS_MZ_RT_INDEX::read(const std::string &path)
+{
+  std::ifstream in(path, std::ios::binary);
+
+  if (!in)
+    return false;
+
+  char magic[8];
+  in.read(magic, sizeof(magic));
+
+  if (!in || std::string(magic, sizeof(magic)) != "SCINDEX1")
+    return false;
+
+  uint64_t number_postings = 0;
+
+  in.read(reinterpret_cast<char *>(&source_size), sizeof(source_size));
+  in.read(reinterpret_cast<char *>(&source_time), sizeof(source_time));
+  in.read(reinterpret_cast<char *>(&bin_width), sizeof(bin_width));
+  in.read(reinterpret_cast<char *>(&min_mz), sizeof(min_mz));
+  in.read(reinterpret_cast<char *>(&number_bins), sizeof(number_bins));
+  in.read(reinterpret_cast<char *>(&number_postings), sizeof(number_postings));
+
+  if (!in || number_bins < 1 || bin_width <= 0)
+    return false;
+
+  bin_offsets.resize(number_bins + 1);
+  spectrum.resize(number_postings);
+  offset.resize(number_postings);
+  rt.resize(number_postings);
+  mz.resize(number_postings);
+  intensity.resize(number_postings);
+
+  in.read(reinterpret_cast<char *>(bin_offsets.data()), bin_offsets.size() * sizeof(int64_t));
+  in.read(reinterpret_cast<char *>(spectrum.data()), number_postings * sizeof(int));
+  in.read(reinterpret_cast<char *>(offset.data()), number_postings * sizeof(int));
+  in.read(reinterpret_cast<char *>(rt.data()), number_postings * sizeof(float));
+  in.read(reinterpret_cast<char *>(mz.data()), number_postings * sizeof(float));
+  in.read(reinterpret_cast<char *>(intensity.data()), number_postings * sizeof(float));
+
+  if (!in || bin_offsets.back() != static_cast<int64_t>(number_postings))
+    return false;
+
+  return true;
+};
+
+sc::MS_TARGETS_SPECTRA sc::MS_MZ_RT_INDEX::get_spectra_targets(const sc::MS_TARGETS &targets, const sc::MS_SPECTRA_HEADERS &headers, const float &minIntLv1) const
+{
+
+  MS_TARGETS_SPECTRA res;
+
+  const int number_targets = targets.index.size();
+
+  if (number_targets == 0 || size() == 0)
+    return res;
+
+  const int number_spectra = headers.size();
+
+  std::vector<int> target_out;
+  std::vector<int64_t> posting_out;
+
+#pragma omp parallel
+  {
+    std::vector<int> target_priv;
+    std::vector<int64_t> posting_priv;
+
+#pragma omp for schedule(dynamic, 16)
+    for (int j = 0; j < number_targets; j++)
+    {
+
+      const float &mzmin = targets.mzmin[j];
+      const float &mzmax = targets.mzmax[j];
+      const float &rtmin = targets.rtmin[j];
+      const float &rtmax = targets.rtmax[j];
+      const bool all_rt = rtmax == 0;
+      const bool all_mobility = targets.mobilitymax[j] == 0;
+
+      const int bin_low = bin(mzmin);
+      const int bin_high = bin(mzmax);
+
+      for (int b = bin_low; b <= bin_high; b++)
+      {
+
+        auto first = rt.begin() + bin_offsets[b];
+        auto last = rt.begin() + bin_offsets[b + 1];
+
+        if (!all_rt)
+          first = std::lower_bound(first, last, rtmin);
+
+        for (auto it = first; it != last; ++it)
+        {
+
+          if (!all_rt && *it > rtmax)
+            break;
+
+          const int64_t p = it - rt.begin();
+
+          if (mz[p] < mzmin || mz[p] > mzmax)
+            continue;
+
+          if (intensity[p] < minIntLv1)
+            continue;
+
+          const int &s = spectrum[p];
+
+          if (s >= number_spectra)
+            continue;
+
+          if (headers.polarity[s] != targets.polarity[j])
+            continue;
+
+          if (!all_mobility && (headers.mobility[s] < targets.mobilitymin[j] || headers.mobility[s] > targets.mobilitymax[j]))
+            continue;
+
+          target_priv.push_back(j);
+          posting_priv.push_back(p);
+        }
+      }
+    }
+
+#pragma omp critical
+    {
+      target_out.insert(target_out.end(), target_priv.begin(), target_priv.end());
+      posting_out.insert(posting_out.end(), posting_priv.begin(), posting_priv.end());
+    }
+  }
+
+  const int number_traces = target_out.size();
+
+  if (number_traces == 0)
+    return res;
+
+  std::vector<int> target_order(number_targets);
+  std::iota(target_order.begin(), target_order.end(), 0);
+  std::stable_sort(target_order.begin(), target_order.end(), [&](int i, int j)
+                   { return targets.id[i] < targets.id[j]; });
+
+  std::vector<int> target_rank(number_targets, 0);
+  for (int i = 1; i < number_targets; i++)
+  {
+    const bool same_id = targets.id[target_order[i]] == targets.id[target_order[i - 1]];
+    target_rank[target_order[i]] = same_id ? target_rank[target_order[i - 1]] : i;
+  }
+
+  std::vector<float> rt_out(number_traces);
+  std::vector<float> mobility_out(number_traces);
+  std::vector<float> mz_out(number_traces);
+  std::vector<int> rank_out(number_traces);
+
+#pragma omp parallel for
+  for (int i = 0; i < number_traces; i++)
+  {
+    const int64_t &p = posting_out[i];
+    rt_out[i] = rt[p];
+    mobility_out[i] = headers.mobility[spectrum[p]];
+    mz_out[i] = mz[p];
+    rank_out[i] = target_rank[target_out[i]];
+  }
+
+  const std::vector<int> idx_sort = sc::radix_order_traces(rt_out, mobility_out, mz_out, rank_out);
+
+  res.resize_all(number_traces);
+
+#pragma omp parallel for
+  for (int i = 0; i < number_traces; i++)
+  {
+    const int &k = idx_sort[i];
+    const int64_t &p = posting_out[k];
+    const int &s = spectrum[p];
+    res.id[i] = targets.id[target_out[k]];
+    res.polarity[i] = headers.polarity[s];
+    res.level[i] = 1;
+    res.pre_mz[i] = headers.precursor_mz[s];
+    res.pre_mzlow[i] = headers.window_mzlow[s];
+    res.pre_mzhigh[i] = headers.window_mzhigh[s];
+    res.pre_ce[i] = headers.activation_ce[s];
+    res.rt[i] = rt[p];
+    res.mobility[i] = headers.mobility[s];
+    res.mz[i] = mz[p];
+    res.intensity[i] = intensity[p];
+  }
+
+  return res;
+};
+
+// MARK: MS_PRECURSOR_INDEX
+sc::MS_PRECURSOR_INDEX::MS_PRECURSOR_INDEX(const sc::MS_SPECTRA_HEADERS &headers)
+{
+  const int number_spectra = headers.rt.size();
+
+  // NaN values never fall within a window and are left out of the orders
+  for (int j = 0; j < number_spectra; j++)
+  {
+    if (headers.configuration[j] >= 3)
+      continue;
+
+    if (!std::isnan(headers.precursor_mz[j]))
+      precursor_order.push_back(j);
+
+    if (!std::isnan(headers.rt[j]))
+      rt_order.push_back(j);
+  }
+
+  std::stable_sort(precursor_order.begin(), precursor_order.end(), [&](int a, int b)
+                   { return headers.precursor_mz[a] < headers.precursor_mz[b]; });
+
+  std::stable_sort(rt_order.begin(), rt_order.end(), [&](int a, int b)
+                   { return headers.rt[a] < headers.rt[b]; });
+
+  precursor_mz.resize(precursor_order.size());
+  for (size_t k = 0; k < precursor_order.size(); k++)
+    precursor_mz[k] = headers.precursor_mz[precursor_order[k]];
+
+  rt.resize(rt_order.size());
+  for (size_t k = 0; k < rt_order.size(); k++)
+    rt[k] = headers.rt[rt_order[k]];
+};
+
+void sc::MS_PRECURSOR_INDEX::find(const sc::MS_SPECTRA_HEADERS &headers, const sc::MS_TARGETS &targets, const int &i, const bool &match_level, std::vector<int> &out) const
+{
+  out.clear();
+
+  auto matches = [&](const int &j)
+  {
+    if (headers.configuration[j] >= 3)
+      return false;
+
+    if (match_level && !(headers.level[j] == targets.level[i] || targets.level[i] == 0))
+      return false;
+
+    if (!((headers.rt[j] >= targets.rtmin[i] && headers.rt[j] <= targets.rtmax[i]) || targets.rtmax[i] == 0))
+      return false;
+
+    if (headers.polarity[j] != targets.polarity[i])
+      return false;
+
+    if (!((headers.mobility[j] >= targets.mobilitymin[i] && headers.mobility[j] <= targets.mobilitymax[i]) || targets.mobilitymax[i] == 0))
+      return false;
+
+    if (targets.precursor[i])
+      if (!((headers.precursor_mz[j] >= targets.mzmin[i] && headers.precursor_mz[j] <= targets.mzmax[i]) || targets.mzmax[i] == 0))
+        return false;
+
+    return true;
+  };
+
+  if (targets.precursor[i] && targets.mzmax[i] != 0)
+  {
+    const size_t lo = std::lower_bound(precursor_mz.begin(), precursor_mz.end(), targets.mzmin[i]) - precursor_mz.begin();
+    const size_t hi = std::upper_bound(precursor_mz.begin(), precursor_mz.end(), targets.mzmax[i]) - precursor_mz.begin();
+
+    for (size_t k = lo; k < hi; k++)
+      if (matches(precursor_order[k]))
+        out.push_back(precursor_order[k]);
+
+    std::sort(out.begin(), out.end());
+  }
+  else if (targets.rtmax[i] != 0)
+  {
+    const size_t lo = std::lower_bound(rt.begin(), rt.end(), targets.rtmin[i]) - rt.begin();
+    const size_t hi = std::upper_bound(rt.begin(), rt.end(), targets.rtmax[i]) - rt.begin();
+
+    for (size_t k = lo; k < hi; k++)
+      if (matches(rt_order[k]))
+        out.push_back(rt_order[k]);
+
+    std::sort(out.begin(), out.end());
+  }
+  else
+  {
+    const int number_spectra = headers.rt.size();
+
+    for (int j = 0; j < number_spectra; j++)
+      if (matches(j))
+        out.push_back(j);
+  }
+};
+
 // MARK: MS_FILE
 
 sc::MS_FILE::MS_FILE(const std::string &file)
@@ -3862,61 +4913,94 @@ sc::MS_TARGETS_SPECTRA sc::MS_FILE::get_spectra_targets(const sc::MS_TARGETS &ta
   if (headers_size != number_spectra)
     return res;
 
-  std::set<int> idx;
+  const sc::MS_PRECURSOR_INDEX precursor_index(headers);
 
-  for (int i = 0; i < number_targets; i++)
+  // spectra selected by at least one target of matching level
+  std::vector<int> idx_vector;
+
+#pragma omp parallel
   {
+    std::vector<int> found;
+    std::vector<int> idx_priv;
 
-#pragma omp parallel for shared(idx)
-    for (int j = 0; j < number_spectra; j++)
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < number_targets; i++)
     {
+      precursor_index.find(headers, targets, i, true, found);
+      idx_priv.insert(idx_priv.end(), found.begin(), found.end());
+    }
 
-      // excludes higher configuration function scans
-      if (headers.configuration[j] >= 3)
-        continue;
-
-      if (headers.level[j] == targets.level[i] || targets.level[i] == 0)
-      {
-        if ((headers.rt[j] >= targets.rtmin[i] && headers.rt[j] <= targets.rtmax[i]) || targets.rtmax[i] == 0)
-        {
-          if (headers.polarity[j] == targets.polarity[i])
-          {
-            if ((headers.mobility[j] >= targets.mobilitymin[i] && headers.mobility[j] <= targets.mobilitymax[i]) || targets.mobilitymax[i] == 0)
-            {
-              if (targets.precursor[i])
-              {
-                if ((headers.precursor_mz[j] >= targets.mzmin[i] && headers.precursor_mz[j] <= targets.mzmax[i]) || targets.mzmax[i] == 0)
-                {
-#pragma omp critical
-                  {
-                    idx.insert(j);
-                  }
-                }
-              }
-              else
-              {
 #pragma omp critical
-                {
-                  idx.insert(j);
-                }
-              }
-            }
-          }
-        }
-      }
+    {
+      idx_vector.insert(idx_vector.end(), idx_priv.begin(), idx_priv.end());
     }
   }
 
-  std::vector<int> idx_vector(idx.begin(), idx.end());
-
   std::sort(idx_vector.begin(), idx_vector.end());
+  idx_vector.erase(std::unique(idx_vector.begin(), idx_vector.end()), idx_vector.end());
 
   const int number_spectra_targets = idx_vector.size();
 
   if (number_spectra_targets == 0)
     return res;
 
-  std::vector<std::string> id_out;
+  std::vector<int> spectrum_position(number_spectra, -1);
+  for (int i = 0; i < number_spectra_targets; i++)
+    spectrum_position[idx_vector[i]] = i;
+
+  // targets served by each selected spectrum (CSR), the level is not checked here as a spectrum selected by
+  // one target also contributes traces to any other target whose windows it matches
+  std::vector<int> pair_spectrum;
+  std::vector<int> pair_target;
+
+#pragma omp parallel
+  {
+    std::vector<int> found;
+    std::vector<int> pair_spectrum_priv;
+    std::vector<int> pair_target_priv;
+
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < number_targets; i++)
+    {
+      precursor_index.find(headers, targets, i, false, found);
+
+      for (const int &j : found)
+      {
+        if (spectrum_position[j] < 0)
+          continue;
+
+        pair_spectrum_priv.push_back(spectrum_position[j]);
+        pair_target_priv.push_back(i);
+      }
+    }
+
+#pragma omp critical
+    {
+      pair_spectrum.insert(pair_spectrum.end(), pair_spectrum_priv.begin(), pair_spectrum_priv.end());
+      pair_target.insert(pair_target.end(), pair_target_priv.begin(), pair_target_priv.end());
+    }
+  }
+
+  const int number_pairs = pair_spectrum.size();
+
+  std::vector<int> spectrum_targets_offsets(number_spectra_targets + 1, 0);
+  for (int p = 0; p < number_pairs; p++)
+    spectrum_targets_offsets[pair_spectrum[p] + 1]++;
+
+  std::partial_sum(spectrum_targets_offsets.begin(), spectrum_targets_offsets.end(), spectrum_targets_offsets.begin());
+
+  std::vector<int> spectrum_targets(number_pairs);
+  {
+    std::vector<int> fill = spectrum_targets_offsets;
+    for (int p = 0; p < number_pairs; p++)
+      spectrum_targets[fill[pair_spectrum[p]]++] = pair_target[p];
+  }
+
+#pragma omp parallel for
+  for (int i = 0; i < number_spectra_targets; i++)
+    std::sort(spectrum_targets.begin() + spectrum_targets_offsets[i], spectrum_targets.begin() + spectrum_targets_offsets[i + 1]);
+
+  std::vector<int> target_out;
   std::vector<int> polarity_out;
   std::vector<int> level_out;
   std::vector<float> pre_mz_out;
@@ -3930,7 +5014,7 @@ sc::MS_TARGETS_SPECTRA sc::MS_FILE::get_spectra_targets(const sc::MS_TARGETS &ta
 
 #pragma omp parallel
   {
-    std::vector<std::string> id_priv;
+    std::vector<int> target_priv;
     std::vector<int> polarity_priv;
     std::vector<int> level_priv;
     std::vector<float> pre_mz_priv;
@@ -3963,79 +5047,47 @@ sc::MS_TARGETS_SPECTRA sc::MS_FILE::get_spectra_targets(const sc::MS_TARGETS &ta
       const float &i_rt = headers.rt[i_idx[0]];
       const float &i_mobility = headers.mobility[i_idx[0]];
 
-      for (int j = 0; j < number_targets; j++)
+      // the polarity, rt, mobility and precursor windows were already matched when building the pairs
+      for (int p = spectrum_targets_offsets[i]; p < spectrum_targets_offsets[i + 1]; p++)
       {
 
-        if (targets.polarity[j] == i_polarity)
+        const int &j = spectrum_targets[p];
+
+        for (int k = 0; k < n_traces; k++)
         {
 
-          if (targets.rtmax[j] == 0 || (i_rt >= targets.rtmin[j] && i_rt <= targets.rtmax[j]))
+          if (targets.precursor[j])
+          {
+            if (!(spectra[0][1][k] >= minIntLv2 && i_level == 2))
+              continue;
+          }
+          else
           {
+            if (!((spectra[0][0][k] >= targets.mzmin[j] && spectra[0][0][k] <= targets.mzmax[j]) || targets.mzmax[j] == 0))
+              continue;
 
-            if (targets.mobilitymax[j] == 0 || (i_mobility >= targets.mobilitymin[j] && i_mobility <= targets.mobilitymax[j]))
-            {
-
-              if (targets.precursor[j])
-              {
-
-                if ((i_pre_mz >= targets.mzmin[j] && i_pre_mz <= targets.mzmax[j]) || targets.mzmax[j] == 0)
-                {
-
-                  for (int k = 0; k < n_traces; k++)
-                  {
-
-                    if (spectra[0][1][k] >= minIntLv2 && i_level == 2)
-                    {
-                      id_priv.push_back(targets.id[j]);
-                      polarity_priv.push_back(i_polarity);
-                      level_priv.push_back(i_level);
-                      pre_mz_priv.push_back(i_pre_mz);
-                      pre_mzlow_priv.push_back(i_pre_mzlow);
-                      pre_mzhigh_priv.push_back(i_pre_mzhigh);
-                      pre_ce_priv.push_back(headers.activation_ce[i_idx[0]]);
-                      rt_priv.push_back(i_rt);
-                      mobility_priv.push_back(i_mobility);
-                      mz_priv.push_back(spectra[0][0][k]);
-                      intensity_priv.push_back(spectra[0][1][k]);
-                    }
-                  }
-                }
-              }
-              else
-              {
-
-                for (int k = 0; k < n_traces; k++)
-                {
-
-                  if ((spectra[0][0][k] >= targets.mzmin[j] && spectra[0][0][k] <= targets.mzmax[j]) || targets.mzmax[j] == 0)
-                  {
-
-                    if ((spectra[0][1][k] >= minIntLv2 && i_level == 2) || (spectra[0][1][k] >= minIntLv1 && i_level == 1))
-                    {
-                      id_priv.push_back(targets.id[j]);
-                      polarity_priv.push_back(i_polarity);
-                      level_priv.push_back(i_level);
-                      pre_mz_priv.push_back(i_pre_mz);
-                      pre_mzlow_priv.push_back(i_pre_mzlow);
-                      pre_mzhigh_priv.push_back(i_pre_mzhigh);
-                      pre_ce_priv.push_back(headers.activation_ce[i_idx[0]]);
-                      rt_priv.push_back(i_rt);
-                      mobility_priv.push_back(i_mobility);
-                      mz_priv.push_back(spectra[0][0][k]);
-                      intensity_priv.push_back(spectra[0][1][k]);
-                    }
-                  }
-                }
-              }
-            }
+            if (!((spectra[0][1][k] >= minIntLv2 && i_level == 2) || (spectra[0][1][k] >= minIntLv1 && i_level == 1)))
+              continue;
           }
+
+          target_priv.push_back(j);
+          polarity_priv.push_back(i_polarity);
+          level_priv.push_back(i_level);
+          pre_mz_priv.push_back(i_pre_mz);
+          pre_mzlow_priv.push_back(i_pre_mzlow);
+          pre_mzhigh_priv.push_back(i_pre_mzhigh);
+          pre_ce_priv.push_back(headers.activation_ce[i_idx[0]]);
+          rt_priv.push_back(i_rt);
+          mobility_priv.push_back(i_mobility);
+          mz_priv.push_back(spectra[0][0][k]);
+          intensity_priv.push_back(spectra[0][1][k]);
         }
       }
     }
 
 #pragma omp critical
     {
-      id_out.insert(id_out.end(), id_priv.begin(), id_priv.end());
+      target_out.insert(target_out.end(), target_priv.begin(), target_priv.end());
       polarity_out.insert(polarity_out.end(), polarity_priv.begin(), polarity_priv.end());
       level_out.insert(level_out.end(), level_priv.begin(), level_priv.end());
       pre_mz_out.insert(pre_mz_out.end(), pre_mz_priv.begin(), pre_mz_priv.end());
@@ -4049,36 +5101,188 @@ sc::MS_TARGETS_SPECTRA sc::MS_FILE::get_spectra_targets(const sc::MS_TARGETS &ta
     }
   }
 
-  int number_spectra_targets_out = id_out.size();
+  const int number_spectra_targets_out = target_out.size();
+
+  // ranks targets by id so that the id tie breaker is an integer key of the radix sort
+  std::vector<int> target_order(number_targets);
+  std::iota(target_order.begin(), target_order.end(), 0);
+  std::stable_sort(target_order.begin(), target_order.end(), [&](int i, int j)
+                   { return targets.id[i] < targets.id[j]; });
+
+  std::vector<int> target_rank(number_targets, 0);
+  for (int i = 1; i < number_targets; i++)
+  {
+    const bool same_id = targets.id[target_order[i]] == targets.id[target_order[i - 1]];
+    target_rank[target_order[i]] = same_id ? target_rank[target_order[i - 1]] : i;
+  }
 
-  std::vector<int> idx_sort(number_spectra_targets_out);
+  std::vector<int> rank_out(number_spectra_targets_out);
 
-  std::iota(idx_sort.begin(), idx_sort.end(), 0);
+#pragma omp parallel for
+  for (int i = 0; i < number_spectra_targets_out; i++)
+    rank_out[i] = target_rank[target_out[i]];
 
-  std::sort(idx_sort.begin(), idx_sort.end(), [&](int i, int j)
-            {
-    if (rt_out[i] != rt_out[j]) return rt_out[i] < rt_out[j];
-    if (mobility_out[i] != mobility_out[j]) return mobility_out[i] < mobility_out[j];
-    if (mz_out[i] != mz_out[j]) return mz_out[i] < mz_out[j];
-    return id_out[i] < id_out[j]; });
+  const std::vector<int> idx_sort = sc::radix_order_traces(rt_out, mobility_out, mz_out, rank_out);
 
-  res.resize_all(id_out.size());
+  res.resize_all(number_spectra_targets_out);
 
-#pragma omp for
+#pragma omp parallel for
   for (int i = 0; i < number_spectra_targets_out; i++)
   {
-    res.id[i] = id_out[idx_sort[i]];
-    res.polarity[i] = polarity_out[idx_sort[i]];
-    res.level[i] = level_out[idx_sort[i]];
-    res.pre_mz[i] = pre_mz_out[idx_sort[i]];
-    res.pre_mzlow[i] = pre_mzlow_out[idx_sort[i]];
-    res.pre_mzhigh[i] = pre_mzhigh_out[idx_sort[i]];
-    res.pre_ce[i] = pre_ce_out[idx_sort[i]];
-    res.rt[i] = rt_out[idx_sort[i]];
-    res.mobility[i] = mobility_out[idx_sort[i]];
-    res.mz[i] = mz_out[idx_sort[i]];
-    res.intensity[i] = intensity_out[idx_sort[i]];
+    const int &k = idx_sort[i];
+    res.id[i] = targets.id[target_out[k]];
+    res.polarity[i] = polarity_out[k];
+    res.level[i] = level_out[k];
+    res.pre_mz[i] = pre_mz_out[k];
+    res.pre_mzlow[i] = pre_mzlow_out[k];
+    res.pre_mzhigh[i] = pre_mzhigh_out[k];
+    res.pre_ce[i] = pre_ce_out[k];
+    res.rt[i] = rt_out[k];
+    res.mobility[i] = mobility_out[k];
+    res.mz[i] = mz_out[k];
+    res.intensity[i] = intensity_out[k];
   }
 
   return res;
 };
+
+sc::MS_MZ_RT_INDEX sc::MS_FILE::build_mz_rt_index(const sc::MS_SPECTRA_HEADERS &headers, const float &bin_width)
+{
+
+  MS_MZ_RT_INDEX index;
+
+  if (bin_width <= 0)
+    throw std::invalid_argument("The m/z bin width of the index must be positive!");
+
+  index.bin_width = bin_width;
+
+  if (!sc::get_file_stamp(file_path, index.source_size, index.source_time))
+    throw std::runtime_error("File " + file_path + " not found!");
+
+  const int number_spectra = get_number_spectra();
+
+  if (number_spectra == 0 || static_cast<int>(headers.size()) != number_spectra)
+    return index;
+
+  // level 1 spectra in rt order, so that a stable bin sort leaves postings rt ordered within each bin
+  std::vector<int> spectra_idx;
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    if (headers.configuration[i] >= 3)
+      continue;
+
+    if (headers.level[i] == 1)
+      spectra_idx.push_back(i);
+  }
+
+  std::stable_sort(spectra_idx.begin(), spectra_idx.end(), [&](int i, int j)
+                   { return headers.rt[i] < headers.rt[j]; });
+
+  const int number_spectra_idx = spectra_idx.size();
+
+  std::vector<int> spectrum_all;
+  std::vector<int> offset_all;
+  std::vector<float> rt_all;
+  std::vector<float> mz_all;
+  std::vector<float> intensity_all;
+
+  // spectra are decoded in chunks to bound the memory of the decoded binary arrays
+  const int chunk_size = 512;
+
+  for (int c = 0; c < number_spectra_idx; c += chunk_size)
+  {
+    const int c_end = std::min(c + chunk_size, number_spectra_idx);
+
+    const std::vector<int> chunk(spectra_idx.begin() + c, spectra_idx.begin() + c_end);
+
+    const std::vector<std::vector<std::vector<float>>> spectra = get_spectra(chunk);
+
+    for (size_t i = 0; i < chunk.size(); i++)
+    {
+      if (spectra[i].size() < 2)
+        continue;
+
+      const std::vector<float> &mz_i = spectra[i][0];
+      const std::vector<float> &intensity_i = spectra[i][1];
+      const int n = mz_i.size();
+
+      for (int k = 0; k < n; k++)
+      {
+        spectrum_all.push_back(chunk[i]);
+        offset_all.push_back(k);
+        rt_all.push_back(headers.rt[chunk[i]]);
+        mz_all.push_back(mz_i[k]);
+        intensity_all.push_back(intensity_i[k]);
+      }
+    }
+  }
+
+  const int64_t number_postings = mz_all.size();
+
+  if (number_postings == 0)
+  {
+    index.number_bins = 1;
+    index.bin_offsets = {0, 0};
+    return index;
+  }
+
+  const auto mz_range = std::minmax_element(mz_all.begin(), mz_all.end());
+
+  index.min_mz = *mz_range.first;
+  index.number_bins = static_cast<int>(std::floor((*mz_range.second - index.min_mz) / bin_width)) + 1;
+
+  std::vector<int> bin_all(number_postings);
+  std::vector<int64_t> counts(index.number_bins + 1, 0);
+
+  for (int64_t i = 0; i < number_postings; i++)
+  {
+    bin_all[i] = index.bin(mz_all[i]);
+    counts[bin_all[i] + 1]++;
+  }
+
+  std::partial_sum(counts.begin(), counts.end(), counts.begin());
+
+  index.bin_offsets = counts;
+
+  index.spectrum.resize(number_postings);
+  index.offset.resize(number_postings);
+  index.rt.resize(number_postings);
+  index.mz.resize(number_postings);
+  index.intensity.resize(number_postings);
+
+  for (int64_t i = 0; i < number_postings; i++)
+  {
+    const int64_t pos = counts[bin_all[i]]++;
+    index.spectrum[pos] = spectrum_all[i];
+    index.offset[pos] = offset_all[i];
+    index.rt[pos] = rt_all[i];
+    index.mz[pos] = mz_all[i];
+    index.intensity[pos] = intensity_all[i];
+  }
+
+  return index;
+};
+
+// MARK: extract_spectra_targets
+sc::MS_TARGETS_SPECTRA sc::extract_spectra_targets(const std::string &file, const sc::MS_TARGETS &targets, const sc::MS_SPECTRA_HEADERS &hd, const float &minIntLv1, const float &minIntLv2)
+{
+  // level 1 targets with an m/z window are answered by the m/z-rt index when a current one exists on disk
+  std::shared_ptr<const sc::MS_MZ_RT_INDEX> index = sc::load_mz_rt_index(file);
+
+  bool use_index = index != nullptr;
+
+  const int n_tg = targets.id.size();
+
+  for (int i = 0; i < n_tg && use_index; i++)
+  {
+    if (targets.level[i] != 1 || targets.precursor[i] || targets.mzmax[i] == 0)
+      use_index = false;
+  }
+
+  if (use_index)
+    return index->get_spectra_targets(targets, hd, minIntLv1);
+
+  sc::MS_FILE ana(file);
+  return ana.get_spectra_targets(targets, hd, minIntLv1, minIntLv2);
+};
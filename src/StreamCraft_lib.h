@@ -10,6 +10,7 @@
 #include <cmath>
 #include <numeric>
 #include <memory>
+#include <cstdint>
 #define PUGIXML_HEADER_ONLY
 #include "pugixml-1.14/src/pugixml.hpp"
 
@@ -279,6 +280,56 @@ namespace sc
     }
   };
 
+  struct MS_MZ_RT_INDEX
+  {
+    // inverted index of level 1 traces, postings are grouped by m/z bin (CSR in bin_offsets) and ordered by rt within each bin
+    uint64_t source_size = 0;
+    int64_t source_time = 0;
+    float bin_width = 0;
+    float min_mz = 0;
+    int number_bins = 0;
+    std::vector<int64_t> bin_offsets;
+    std::vector<int> spectrum;
+    std::vector<int> offset;
+    std::vector<float> rt;
+    std::vector<float> mz;
+    std::vector<float> intensity;
+
+    size_t size() const
+    {
+      return spectrum.size();
+    }
+
+    int bin(const float &value) const
+    {
+      const int b = static_cast<int>(std::floor((value - min_mz) / bin_width));
+      if (b < 0)
+        return 0;
+      if (b >= number_bins)
+        return number_bins - 1;
+      return b;
+    }
+
+    void write(const std::string &path) const;
+
+    bool read(const std::string &path);
+
+    MS_TARGETS_SPECTRA get_spectra_targets(const MS_TARGETS &targets, const MS_SPECTRA_HEADERS &headers, const float &minIntLv1) const;
+  };
+
+  struct MS_PRECURSOR_INDEX
+  {
+    // spectra headers ordered by precursor m/z and by rt, so that targets resolve to spectra by range queries
+    std::vector<int> precursor_order;
+    std::vector<float> precursor_mz;
+    std::vector<int> rt_order;
+    std::vector<float> rt;
+
+    MS_PRECURSOR_INDEX(const MS_SPECTRA_HEADERS &headers);
+
+    void find(const MS_SPECTRA_HEADERS &headers, const MS_TARGETS &targets, const int &i, const bool &match_level, std::vector<int> &out) const;
+  };
+
   class MS_READER
   {
   public:
@@ -360,6 +411,60 @@ namespace sc
 
   std::unique_ptr<MS_READER> create_ms_reader(const std::string &file);
 
+  uint32_t float_to_sortable_key(const float &value);
+
+  void radix_sort_by_key(std::vector<uint32_t> &keys, std::vector<int> &values);
+
+  std::vector<int> radix_order_traces(const std::vector<float> &rt, const std::vector<float> &mobility, const std::vector<float> &mz, const std::vector<int> &rank);
+
+  bool get_file_stamp(const std::string &file, uint64_t &size, int64_t &time);
+
+  std::string get_mz_rt_index_path(const std::string &file);
+
+  std::shared_ptr<const MS_MZ_RT_INDEX> load_mz_rt_index(const std::string &file);
+
+  std::shared_ptr<const MS_MZ_RT_INDEX> save_mz_rt_index(const std::string &file, const MS_MZ_RT_INDEX &index);
+
+  // MARK: SIGNAL PROCESSING
+  // traces are CSR packed, trace i has the values [offsets[i], offsets[i + 1])
+
+  std::vector<double> savgol_coefficients(const int &fl, const int &forder, const int &dorder);
+
+  std::vector<double> smooth_savgol(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const std::vector<double> &coefficients);
+
+  std::vector<double> smooth_moving_average(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const int &windowSize);
+
+  std::vector<double> normalize_traces(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const std::string &method, const bool &liftToZero);
+
+  // rows of all analyses with equal key columns are averaged, keys are the bit patterns of the key values
+  struct SPECTRA_AVERAGE
+  {
+    std::vector<int> analysis;
+    std::vector<int64_t> row;
+    std::vector<std::vector<double>> values;
+  };
+
+  SPECTRA_AVERAGE average_spectra(const std::vector<std::vector<std::vector<uint64_t>>> &keys, const std::vector<std::vector<std::vector<double>>> &values);
+
+  struct PLS_BAND_SOLVER
+  {
+    // solves (W + lambda D'D) z = W y for a trace of n points, D being the difference matrix of the given order,
+    // by a banded Cholesky (LDL') factorization, the system is pentadiagonal for second differences
+    int64_t n = 0;
+    int bandwidth = 0;
+    std::vector<std::vector<double>> penalty;
+    std::vector<std::vector<double>> lower;
+    std::vector<double> diagonal;
+
+    PLS_BAND_SOLVER(const int64_t &n, const double &lambda, const int &differences);
+
+    void solve(const double *w, const double *y, double *z);
+  };
+
+  std::vector<double> baseline_als(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const double &lambda, const double &p, const int &maxit);
+
+  std::vector<double> baseline_airpls(const std::vector<int64_t> &offsets, const std::vector<double> &intensity, const double &lambda, const int &differences, const int &itermax);
+
   // MARK: MZML
   inline namespace mzml
   {
@@ -736,6 +841,10 @@ namespace sc
     std::vector<std::vector<std::string>> get_hardware() { return ms->get_hardware(); }
     MS_SPECTRUM get_spectrum(const int &index) { return ms->get_spectrum(index); }
     MS_TARGETS_SPECTRA get_spectra_targets(const MS_TARGETS &targets, const sc::MS_SPECTRA_HEADERS &hd, const float &minIntLv1, const float &minIntLv2);
+    MS_MZ_RT_INDEX build_mz_rt_index(const sc::MS_SPECTRA_HEADERS &hd, const float &bin_width = 0.01);
+    std::shared_ptr<const MS_MZ_RT_INDEX> get_mz_rt_index() { return load_mz_rt_index(file_path); }
   };
+
+  MS_TARGETS_SPECTRA extract_spectra_targets(const std::string &file, const MS_TARGETS &targets, const MS_SPECTRA_HEADERS &hd, const float &minIntLv1, const float &minIntLv2);
 }; // namespace sc
 #endif // STREAMCRAFT_LIB_H
@@ -4,7 +4,9 @@
 #include <tuple>
 #include <algorithm>
 #include <unordered_set>
+#include <unordered_map>
 #include <numeric>
+#include <cmath>
 #include <Rcpp.h>
 #include <omp.h>
 
@@ -18,17 +20,13 @@ std::vector<double> rcpp_fill_bin_spectra(Rcpp::DataFrame spectra,
   
   std::vector<std::string> bin_names = bins.names();
   
-  std::vector<std::string> spectra_names = spectra.names();
-
   int number_bin_names = bin_names.size();
 
   int number_bins = bin_mat.nrow();
   
   int number_ints = spectra.nrow();
   
-  std::vector<int> bin_name_index;
-  
-  std::vector<double> bin_sizes(number_bins);
+  std::vector<double> bin_sizes(number_bin_names);
   
   std::vector<std::vector<double>> bin_vals(number_bin_names);
   
@@ -50,90 +48,146 @@ std::vector<double> rcpp_fill_bin_spectra(Rcpp::DataFrame spectra,
   
   std::vector<double> output(number_bins, 0.0);
   
+  if (number_bins == 0 || number_ints == 0 || number_bin_names == 0) return output;
+  
   std::vector<double> ints = spectra["intensity"];
   
-  #pragma omp parallel for
-  for(int i = 0; i < number_bins; i++) {
+  // bin centers of each dimension are integer coded, a bin is then a mixed radix key of its center codes
+  std::vector<std::vector<double>> centers(number_bin_names);
+  std::vector<std::vector<int64_t>> bin_codes(number_bin_names, std::vector<int64_t>(number_bins));
+  
+  for (int k = 0; k < number_bin_names; k++) {
+    for (const double& c : bin_vals[k]) if (!std::isnan(c)) centers[k].push_back(c);
+    std::sort(centers[k].begin(), centers[k].end());
+    centers[k].erase(std::unique(centers[k].begin(), centers[k].end()), centers[k].end());
     
-    // int num_threads = 0;
-    // 
-    // num_threads = omp_get_num_threads();
-    // 
-    // int thread_num = omp_get_thread_num();
-
-    // #pragma omp critical
-    // {
-    //   Rprintf("T %d out of %d and ", thread_num, num_threads);
-    //   
-    //   Rprintf("Bin %d ", i);
-    // }
+    for (int i = 0; i < number_bins; i++) {
+      const double& c = bin_vals[k][i];
+      bin_codes[k][i] = std::isnan(c) ? -1 : std::lower_bound(centers[k].begin(), centers[k].end(), c) - centers[k].begin();
+    }
+  }
+  
+  std::unordered_map<int64_t, int> key_bin;
+  std::vector<int> next_bin(number_bins, -1);
+  
+  for (int i = number_bins - 1; i >= 0; i--) {
+    int64_t key = 0;
+    bool valid = true;
+    for (int k = 0; k < number_bin_names; k++) {
+      if (bin_codes[k][i] < 0) valid = false;
+      key = key * static_cast<int64_t>(centers[k].size()) + bin_codes[k][i];
+    }
+    if (!valid) continue;
+    const auto it = key_bin.find(key);
+    if (it != key_bin.end()) {
+      next_bin[i] = it->second;
+      it->second = i;
+    } else {
+      key_bin.emplace(key, i);
+    }
+  }
+  
+  // a value s is in the bin of center c when c - size / 2 - size * overlap <= s <= c + size / 2 + size * overlap,
+  // the candidate centers are found by binary search and then tested exactly as above
+  auto matching_centers = [&](const int& k, const double& s, int& lo, int& hi) {
+    const double& k_size = bin_sizes[k];
+    const double width = k_size / 2 + k_size * overlap;
+    const double margin = 1e-9 * (std::abs(s) + std::abs(width)) + 1e-12;
+    lo = std::lower_bound(centers[k].begin(), centers[k].end(), s - width - margin) - centers[k].begin();
+    hi = std::upper_bound(centers[k].begin(), centers[k].end(), s + width + margin) - centers[k].begin();
+    while (lo < hi) {
+      const double& c = centers[k][lo];
+      double k_low = c - (k_size / 2);
+      k_low = k_low - (k_size * overlap);
+      double k_high = c + (k_size / 2);
+      k_high = k_high + (k_size * overlap);
+      if (s >= k_low && s <= k_high) break;
+      lo++;
+    }
+    while (hi > lo) {
+      const double& c = centers[k][hi - 1];
+      double k_low = c - (k_size / 2);
+      k_low = k_low - (k_size * overlap);
+      double k_high = c + (k_size / 2);
+      k_high = k_high + (k_size * overlap);
+      if (s >= k_low && s <= k_high) break;
+      hi--;
+    }
+  };
+  
+  // rows are mapped to their bins in parallel over contiguous chunks, so that the concatenation is in row order
+  const int number_threads = omp_get_max_threads();
+  
+  std::vector<std::vector<std::pair<int, int>>> thread_hits(number_threads);
+  
+  #pragma omp parallel num_threads(number_threads)
+  {
+    std::vector<std::pair<int, int>>& hits = thread_hits[omp_get_thread_num()];
+    std::vector<int> lo(number_bin_names), hi(number_bin_names), pos(number_bin_names);
     
-    std::vector<int> which_ints;
-
+    #pragma omp for schedule(static)
     for (int j = 0; j < number_ints; j++) {
-
-      std::vector<bool> is_in_bin(number_bin_names, false);
-
-      for (int k = 0; k < number_bin_names; k++) {
+      
+      bool any = true;
+      
+      for (int k = 0; k < number_bin_names && any; k++) {
+        matching_centers(k, spectra_mat[k][j], lo[k], hi[k]);
+        any = lo[k] < hi[k];
+      }
+      
+      if (!any) continue;
+      
+      pos = lo;
+      
+      while (true) {
+        int64_t key = 0;
+        for (int k = 0; k < number_bin_names; k++) key = key * static_cast<int64_t>(centers[k].size()) + pos[k];
         
-        const double& k_size = bin_sizes[k];
-
-        const std::vector<double>& k_vals = bin_vals[k];
-
-        const double& k_val = k_vals[i];
+        const auto it = key_bin.find(key);
+        if (it != key_bin.end()) {
+          for (int b = it->second; b >= 0; b = next_bin[b]) hits.emplace_back(b, j);
+        }
         
-        double k_low = k_val - (k_size / 2);
-
-        double k_high = k_val + (k_size / 2);
-
-        k_low = k_low - (k_size * overlap);
-
-        k_high = k_high + (k_size * overlap);
-
-        const std::vector<double>& s_vals = spectra_mat[k];
-
-        const double& s_val = s_vals[j];
-
-        if (s_val >= k_low && s_val <= k_high) {
-          is_in_bin[k] = true;
+        int k = number_bin_names - 1;
+        while (k >= 0 && ++pos[k] == hi[k]) {
+          pos[k] = lo[k];
+          k--;
         }
-      }
-
-      if (std::all_of(is_in_bin.begin(), is_in_bin.end(), [](bool x) { return x; })) {
-        which_ints.push_back(j);
+        if (k < 0) break;
       }
     }
-
-    int n_sel_ints = which_ints.size();
+  }
+  
+  // rows of each bin in CSR, ascending as the original scan over the rows
+  std::vector<int> offsets(number_bins + 1, 0);
+  
+  for (const auto& hits : thread_hits) for (const auto& h : hits) offsets[h.first + 1]++;
+  
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  
+  std::vector<int> rows(offsets.back());
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  
+  for (const auto& hits : thread_hits) for (const auto& h : hits) rows[fill[h.first]++] = h.second;
+  
+  const bool is_max = summaryFunction == "max";
+  
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < number_bins; i++) {
     
-    // #pragma omp critical
-    // {
-    //   Rprintf("Ints %d; ", n_sel_ints);
-    // }
-
-    if (n_sel_ints > 0) {
-      std::vector<double> ints_temp(n_sel_ints);
-      double* ints_temp_ptr = ints_temp.data();
-
-      for (const int& x : which_ints) {
-        *(ints_temp_ptr++) = ints[x];
-      }
-
-      double summary_int = 0.0;
-
-      if (summaryFunction == "max") {
-        auto maxElementIterator = std::max_element(ints_temp.begin(), ints_temp.end());
-        summary_int = *maxElementIterator;
-
-      } else {
-        double sum = std::accumulate(ints_temp.begin(), ints_temp.end(), 0.0);
-        summary_int = sum / static_cast<double>(ints_temp.size());
-      }
-
-      #pragma omp critical
-      {
-        output[i] = summary_int;
-      }
+    const int n_sel_ints = offsets[i + 1] - offsets[i];
+    
+    if (n_sel_ints == 0) continue;
+    
+    if (is_max) {
+      double summary_int = ints[rows[offsets[i]]];
+      for (int r = offsets[i] + 1; r < offsets[i + 1]; r++) if (ints[rows[r]] > summary_int) summary_int = ints[rows[r]];
+      output[i] = summary_int;
+      
+    } else {
+      double sum = 0.0;
+      for (int r = offsets[i]; r < offsets[i + 1]; r++) sum += ints[rows[r]];
+      output[i] = sum / static_cast<double>(n_sel_ints);
     }
   }
   
@@ -3,7 +3,10 @@
 #include <vector>
 #include <numeric>
 #include <math.h>
+#include <unordered_map>
 #include <Rcpp.h>
+#include <omp.h>
+#include "NTS_utils.h"
 
 
 
@@ -41,580 +44,128 @@ Rcpp::List rcpp_ms_cluster_spectra(Rcpp::DataFrame spectra,
   }
   
   const std::vector<std::string>& all_unique_id = spectra["unique_id"];
-  
   const std::vector<std::string>& all_analysis = spectra["analysis"];
-  const std::string* all_analysis_ptr = all_analysis.data();
-  
   const std::vector<int>& all_polarity = spectra["polarity"];
-  const int* all_polarity_ptr = all_polarity.data();
-  
   const std::vector<std::string>& all_id = spectra["id"];
-  const std::string* all_id_ptr = all_id.data();
-  
   const std::vector<double>& all_rt = spectra["rt"];
-  const double* all_rt_ptr = all_rt.data();
-  
   const std::vector<double>& all_mz = spectra["mz"];
-  const double* all_mz_ptr = all_mz.data();
-  
   const std::vector<double>& all_intensity = spectra["intensity"];
-  const double* all_intensity_ptr = all_intensity.data();
   
-  std::set<std::string> unique_ids_set;
+  const int n_all_unique_ids = all_unique_id.size();
+  
+  // without collision energies all traces are taken as from the same energy
+  std::vector<double> all_pre_ce(n_all_unique_ids, 0);
   
-  for (const std::string& id : all_unique_id) {
-    unique_ids_set.insert(id);
+  if (has_pre_ce) {
+    const std::vector<double>& all_pre_ce_origin = spectra["pre_ce"];
+    all_pre_ce = all_pre_ce_origin;
+  } else if (verbose) {
+    Rcpp::Rcout << "Collision energy values not included!" << std::endl;
+  }
+  
+  std::vector<double> all_pre_mz;
+  
+  if (has_pre_mz) {
+    const std::vector<double>& all_pre_mz_origin = spectra["pre_mz"];
+    all_pre_mz = all_pre_mz_origin;
+  } else if (verbose) {
+    Rcpp::Rcout << "Precursor m/z values not included!" << std::endl;
   }
   
-  std::vector<std::string> unique_ids(unique_ids_set.begin(), unique_ids_set.end());
+  // rows are grouped by unique_id once, ids are kept in sorted order and rows in their original order
+  std::unordered_map<std::string, int> id_codes;
+  std::vector<std::string> unique_ids;
+  std::vector<int> row_code(n_all_unique_ids);
+  
+  for (int z = 0; z < n_all_unique_ids; ++z) {
+    const auto it = id_codes.emplace(all_unique_id[z], unique_ids.size());
+    if (it.second) unique_ids.push_back(all_unique_id[z]);
+    row_code[z] = it.first->second;
+  }
   
   const int n_unique_ids = unique_ids.size();
   
-  const int n_all_unique_ids = all_unique_id.size();
+  std::vector<int> id_order(n_unique_ids);
+  std::iota(id_order.begin(), id_order.end(), 0);
+  std::sort(id_order.begin(), id_order.end(), [&](int i, int j) { return unique_ids[i] < unique_ids[j]; });
+  
+  std::vector<int> id_rank(n_unique_ids);
+  for (int i = 0; i < n_unique_ids; ++i) id_rank[id_order[i]] = i;
+  
+  std::vector<int> offsets(n_unique_ids + 1, 0);
+  for (int z = 0; z < n_all_unique_ids; ++z) offsets[id_rank[row_code[z]] + 1]++;
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  
+  std::vector<int> rows(n_all_unique_ids);
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  for (int z = 0; z < n_all_unique_ids; ++z) rows[fill[id_rank[row_code[z]]]++] = z;
   
   if (verbose) {
     Rcpp::Rcout << "Clustering " << n_unique_ids << " ids from " << n_all_unique_ids << " spectra" << std::endl;
     Rcpp::Rcout <<  std::endl;
   }
   
-  std::vector<double> all_pre_ce(n_all_unique_ids);
+  std::vector<nts::MS_CLUSTERED_SPECTRUM<double>> clustered(n_unique_ids);
   
-  if (has_pre_ce) {
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n_unique_ids; ++i) {
     
-    const std::vector<double>& all_pre_ce_origin = spectra["pre_ce"];
+    const int n_idx = offsets[i + 1] - offsets[i];
     
-    std::set<double> unique_all_pre_ce_set;
+    std::vector<double> rt(n_idx), mz(n_idx), intensity(n_idx), pre_ce(n_idx);
+    std::vector<double> pre_mz(has_pre_mz ? n_idx : 0);
     
-    for (const double& ce : all_pre_ce) {
-      unique_all_pre_ce_set.insert(ce);
+    for (int k = 0; k < n_idx; ++k) {
+      const int x = rows[offsets[i] + k];
+      rt[k] = all_rt[x];
+      mz[k] = all_mz[x];
+      intensity[k] = all_intensity[x];
+      pre_ce[k] = all_pre_ce[x];
+      if (has_pre_mz) pre_mz[k] = all_pre_mz[x];
     }
     
-    std::vector<double> unique_all_pre_ce(unique_all_pre_ce_set.begin(), unique_all_pre_ce_set.end());
-    
-    if (verbose) {
-      Rcpp::Rcout << "Unique all pre_ce vals:  "; 
-      for (const double& x : unique_all_pre_ce) {
-        Rcpp::Rcout << x << " ";
-      }
-      Rcpp::Rcout << std::endl;
-    }
-    
-    const int n_unique_all_pre_ce = unique_all_pre_ce.size();
-    
-    if (n_unique_all_pre_ce == 1) {
-      if (std::isnan(unique_all_pre_ce[0])) {
-        has_pre_ce = false;
-      }
-    }
-    
-    if (has_pre_ce) {
-      for (int i=0; i<n_all_unique_ids; ++i) {
-        all_pre_ce[i] = all_pre_ce_origin[i];
-      }
-    }
+    clustered[i] = nts::cluster_spectrum(rt, mz, intensity, pre_ce, pre_mz, mzClust, presence);
   }
   
-  if (!has_pre_ce) {
-    if (verbose) Rcpp::Rcout << "Collision energy values not included!" << std::endl;
-    
-    double nan_val = std::nan("");
-    std::vector<double> all_pre_mz;
-    all_pre_ce.push_back(nan_val);
-  }
-  
-  std::vector<double> all_pre_mz(n_all_unique_ids);
+  Rcpp::List spectra_out(n_unique_ids);
   
-  if (has_pre_mz) {
-    const std::vector<double>& all_pre_mz_origin = spectra["pre_mz"];
+  for (int i = 0; i < n_unique_ids; ++i) {
     
-    std::set<double> unique_all_pre_mz_set;
-    
-    for (const double& m : all_pre_mz) {
-      unique_all_pre_mz_set.insert(m);
-    }
+    const nts::MS_CLUSTERED_SPECTRUM<double>& res = clustered[i];
     
-    std::vector<double> unique_all_pre_mz(unique_all_pre_mz_set.begin(), unique_all_pre_mz_set.end());
+    const int first = rows[offsets[i]];
     
     if (verbose) {
-      Rcpp::Rcout << "Unique all pre_mz vals:  "; 
-      for (const double& x : unique_all_pre_mz) {
-        Rcpp::Rcout << x << " ";
-      }
-      Rcpp::Rcout << std::endl;
-    }
-    
-    const int n_unique_all_pre_mz = unique_all_pre_mz.size();
-    
-    if (n_unique_all_pre_mz == 1) {
-      if (std::isnan(unique_all_pre_mz[0])) {
-        has_pre_mz = false;
-      }
+      Rcpp::Rcout << "Clustering " << unique_ids[id_order[i]] << " using an mzClust of " << res.mz_clust << " Da"
+                  << " after " << res.iterations << " iterations: " << res.size() << " traces" << std::endl;
     }
     
-    if (has_pre_mz) {
-      for (int i=0; i<n_all_unique_ids; ++i) {
-        all_pre_mz[i] = all_pre_mz_origin[i];
-      }
+    if (res.size() == 0) {
+      spectra_out[i] = Rcpp::DataFrame::create();
+      
+    } else if (has_pre_mz && !std::isnan(res.pre_mz)) {
+      spectra_out[i] = Rcpp::DataFrame::create(
+        Rcpp::Named("analysis") = all_analysis[first],
+        Rcpp::Named("id") = all_id[first],
+        Rcpp::Named("polarity") = all_polarity[first],
+        Rcpp::Named("pre_mz") = res.pre_mz,
+        Rcpp::Named("rt") = res.rt,
+        Rcpp::Named("mz") = res.mz,
+        Rcpp::Named("intensity") = res.intensity,
+        Rcpp::Named("is_pre") = res.is_pre
+      );
+      
+    } else {
+      spectra_out[i] = Rcpp::DataFrame::create(
+        Rcpp::Named("analysis") = all_analysis[first],
+        Rcpp::Named("id") = all_id[first],
+        Rcpp::Named("polarity") = all_polarity[first],
+        Rcpp::Named("rt") = res.rt,
+        Rcpp::Named("mz") = res.mz,
+        Rcpp::Named("intensity") = res.intensity
+      );
     }
   }
   
-  if (!has_pre_mz) {
-    if (verbose) Rcpp::Rcout << "Precursor m/z values not included!" << std::endl;
-    
-    double nan_val = std::nan("");
-    std::vector<double> all_pre_mz;
-    all_pre_mz.push_back(nan_val);
-  }
-
-  Rcpp::List spectra_out(n_unique_ids);
-  
-  std::string* target_id;
-  
-  
-  for (int i=0; i<n_unique_ids; ++i) {
-    
-    target_id = &unique_ids[i];
-    
-    if (verbose) Rcpp::Rcout << "Clustering " << *target_id << std::endl;
-    
-    std::vector<int> which_idx;
-    
-    for (int z=0; z<n_all_unique_ids; z++) {
-      if (all_unique_id[z] == *target_id) which_idx.push_back(z);
-    }
-    
-    const int n_idx = which_idx.size();
-    
-    if (n_idx > 0) {
-    
-      std::vector<std::string> analysis(n_idx);
-      std::string* analysis_ptr = analysis.data();
-      
-      std::vector<int> polarity(n_idx);
-      int* polarity_ptr = polarity.data();
-      
-      std::vector<std::string> id(n_idx);
-      std::string* id_ptr = id.data();
-      
-      std::vector<double> u_rt(n_idx);
-      double* u_rt_ptr = u_rt.data();
-      
-      std::vector<double> u_pre_mz(n_idx);
-      double* u_pre_mz_ptr = u_pre_mz.data();
-      
-      std::vector<double> u_pre_ce(n_idx);
-      double* u_pre_ce_ptr = u_pre_ce.data();
-      
-      std::vector<double> u_mz(n_idx);
-      double* u_mz_ptr = u_mz.data();
-      
-      std::vector<double> u_intensity(n_idx);
-      double* u_intensity_ptr = u_intensity.data();
-  
-      for (const int& x : which_idx) {
-        *(analysis_ptr++) = *(all_analysis_ptr + x);
-        *(polarity_ptr++) = *(all_polarity_ptr + x);
-        *(id_ptr++) = *(all_id_ptr + x);
-        *(u_rt_ptr++) = *(all_rt_ptr + x);
-        *(u_mz_ptr++) = *(all_mz_ptr + x);
-        *(u_intensity_ptr++) = *(all_intensity_ptr + x);
-        
-        if (has_pre_ce) {
-          *(u_pre_ce_ptr++) = all_pre_ce[x];
-        } else {
-          *(u_pre_ce_ptr++) = all_pre_ce[0];
-        }
-        
-        if (has_pre_mz) {
-          *(u_pre_mz_ptr++) = all_pre_mz[x];
-        } else {
-          *(u_pre_mz_ptr++) = all_pre_mz[0];
-        }
-      }
-      
-      // list_out["u_mz"] = u_mz;
-      
-      std::vector<int> idx(u_mz.size());
-      std::iota(idx.begin(), idx.end(), 0);
-      
-      // list_out["idx"] = idx;
-      
-      std::sort(idx.begin(), idx.end(), [&](int i, int j){return u_mz[i] < u_mz[j];});
-      
-      // list_out["o_idx"] = idx;
-      
-      u_rt_ptr = u_rt.data();
-      u_pre_ce_ptr = u_pre_ce.data();
-      u_mz_ptr = u_mz.data();
-      u_intensity_ptr = u_intensity.data();
-      
-      std::vector<double> rt(n_idx);
-      double* rt_ptr = rt.data();
-      
-      std::vector<double> pre_ce(n_idx);
-      double* pre_ce_ptr = pre_ce.data();
-      
-      std::vector<double> mz(n_idx);
-      double* mz_ptr = mz.data();
-      
-      std::vector<double> intensity(n_idx);
-      double* intensity_ptr = intensity.data();
-
-      for (const int& x : idx) {
-        *(rt_ptr++) = *(u_rt_ptr + x);
-        *(mz_ptr++) = *(u_mz_ptr + x);
-        *(intensity_ptr++) = *(u_intensity_ptr + x);
-        *(pre_ce_ptr++) = *(u_pre_ce_ptr + x);
-      }
-      
-      // list_out["mz"] = mz;
-      
-      // list_out["ce"] = pre_ce;
-      
-      std::set<double> unique_rt_set;
-      
-      for (const double& r : rt) {
-        unique_rt_set.insert(r);
-      }
-      
-      std::vector<double> unique_rt(unique_rt_set.begin(), unique_rt_set.end());
-      
-      if (verbose) {
-        Rcpp::Rcout << "Unique rt vals:  "; 
-        for (const double& x : unique_rt) {
-          Rcpp::Rcout << x << " ";
-        }
-        Rcpp::Rcout << std::endl;
-      }
-      
-      std::set<double> unique_pre_ce_set;
-      
-      for (const double& c : pre_ce) {
-        unique_pre_ce_set.insert(c);
-      }
-      
-      std::vector<double> unique_pre_ce(unique_pre_ce_set.begin(), unique_pre_ce_set.end());
-      
-      if (verbose) {
-        Rcpp::Rcout << "Unique pre_ce vals:  "; 
-        for (const double& x : unique_pre_ce) {
-          Rcpp::Rcout << x << " ";
-        }
-        Rcpp::Rcout << std::endl;
-      }
-      
-      // list_out["unique_rt"] = unique_rt;
-
-      // list_out["unique_pre_ce"] = unique_pre_ce;
-      
-      rt_ptr = rt.data();
-      pre_ce_ptr = pre_ce.data();
-      mz_ptr = mz.data();
-      intensity_ptr = intensity.data();
-      
-      std::vector<double> mz_diff(n_idx - 1);
-      
-      for (int j = 1; j < n_idx; ++j) {
-        mz_diff[j - 1] = mz[j] - mz[j - 1];
-      }
-      
-      // list_out["mz_diff"] = mz_diff;
-      
-      // list_out["mz_diff_size"] = mz_diff.size();
-      
-      double itMzClust = mzClust;
-
-      int counter = 0;
-      
-      bool hasFromSameScan = true;
-      
-      
-      
-      
-      while (hasFromSameScan) {
-
-        counter = counter + 1;
-        
-        std::vector<double> new_mz;
-        
-        std::vector<double> new_intensity;
-
-        if (verbose) Rcpp::Rcout << "Using an mzClust of  " << itMzClust << " Da" << std::endl;
-
-        std::vector<int> all_clusters(mz_diff.size(), 0);
-        
-        for (size_t j = 0; j < mz_diff.size(); ++j) {
-          if (mz_diff[j] > itMzClust) all_clusters[j] = 1;
-        }
-        
-        std::partial_sum(all_clusters.begin(), all_clusters.end(), all_clusters.begin());
-        
-        all_clusters.insert(all_clusters.begin(), 0);
-        
-        // list_out["all_clusters_raw"] = all_clusters;
-        
-        for (int &val : all_clusters) {
-          val += 1;
-        }
-        
-        int n_all_clusters = all_clusters.size();
-        
-        // list_out["all_clusters"] = all_clusters;
-
-        std::vector<int> idx_clusters(all_clusters.size());
-        std::iota(idx_clusters.begin(), idx_clusters.end(), 0);
-        
-        std::set<int> clusters_set;
-        
-        for (const int& cl : all_clusters) {
-          clusters_set.insert(cl);
-        }
-        
-        std::vector<int> clusters(clusters_set.begin(), clusters_set.end());
-        
-        int n_clusters = clusters.size();
-        
-        // list_out["clusters"] = clusters;
-        
-        std::vector<bool> fromSameScan(n_clusters, true);
-        
-        for (int z=0; z<n_clusters; ++z) {
-          
-          if (verbose) Rcpp::Rcout << "Cluster  " << z << std::endl;
-          
-          // list_out["cluster"] = clusters[z];
-          
-          std::vector<int> temp_idx;
-          
-          for (int j=0; j<n_all_clusters; ++j) {
-            if (all_clusters[j] == clusters[z]) temp_idx.push_back(j);
-          }
-          
-          int n = temp_idx.size();
-          
-          // list_out["n"] = n;
-          
-          std::vector<double> temp_rt(n);
-          double* temp_rt_ptr = temp_rt.data();
-          
-          std::vector<double> temp_pre_ce(n);
-          double* temp_pre_ce_ptr = temp_pre_ce.data();
-          
-          std::vector<double> temp_mz(n);
-          double* temp_mz_ptr = temp_mz.data();
-          
-          std::vector<double> temp_intensity(n);
-          double* temp_intensity_ptr = temp_intensity.data();
-          
-          for (const int& x : temp_idx) {
-            *(temp_rt_ptr++) = *(rt_ptr + x);
-            *(temp_pre_ce_ptr++) = *(pre_ce_ptr + x);
-            *(temp_mz_ptr++) = *(mz_ptr + x);
-            *(temp_intensity_ptr++) = *(intensity_ptr + x);
-          }
-          
-          // list_out["temp_rt"] = temp_rt;
-          
-          std::set<double> unique_temp_rt_set;
-          
-          for (const double& r : temp_rt) {
-            unique_temp_rt_set.insert(r);
-          }
-          
-          std::vector<double> unique_temp_rt(unique_temp_rt_set.begin(), unique_temp_rt_set.end());
-          
-          if (verbose) {
-            Rcpp::Rcout << "Unique temp rt vals:  "; 
-            for (const double& x : unique_temp_rt) {
-              Rcpp::Rcout << x << " ";
-            }
-            Rcpp::Rcout << std::endl;
-          }
-          
-          // list_out["unique_temp_rt"] = unique_temp_rt;
-          
-          std::set<double> unique_temp_pre_ce_set;
-          
-          for (const double& r : temp_pre_ce) {
-            unique_temp_pre_ce_set.insert(r);
-          }
-          
-          std::vector<double> unique_temp_pre_ce(unique_temp_pre_ce_set.begin(), unique_temp_pre_ce_set.end());
-          
-          if (verbose) {
-            Rcpp::Rcout << "Unique temp pre_ce vals:  "; 
-            for (const double& x : unique_temp_pre_ce) {
-              Rcpp::Rcout << x << " ";
-            }
-            Rcpp::Rcout << std::endl;
-          }
-          
-          // list_out["unique_temp_pre_ce"] = unique_temp_pre_ce;
-
-          fromSameScan[z] = unique_temp_rt.size() < temp_rt.size();
-          
-          if (counter > 10) fromSameScan[z] = false;
-          
-          if (itMzClust < 0.0001) fromSameScan[z] = false;
-          
-          // when traces are twice in a given scan breaks the loop when decreases the itMzClust
-          if (fromSameScan[z]) {
-            
-            if (verbose) {
-              auto min_mz = std::min_element(temp_mz.begin(), temp_mz.end());
-              auto max_mz = std::max_element(temp_mz.begin(), temp_mz.end());
-              Rcpp::Rcout << "\n The m/z cluster " << *min_mz << " to " << *max_mz << " of " << *target_id << " has traces from the same scan at:\n";
-              for (const double& r : temp_rt) {
-                Rcpp::Rcout << r << " ";
-              }
-              Rcpp::Rcout << "\n";
-              for (const double& m : temp_mz) {
-                Rcpp::Rcout << m << " ";
-              }
-              Rcpp::Rcout << "\n\n";
-            }
-            
-            itMzClust = itMzClust - 0.0001;
-            
-            break;
-          }
-          
-          bool pre_ceHasNaN = false;
-          
-          for (const double& val : unique_pre_ce) {
-            if (std::isnan(val)) {
-              pre_ceHasNaN = true;
-              break;
-            }
-          }
-          
-          bool enough_presence = false;
-          
-          if (pre_ceHasNaN) {
-            enough_presence = unique_rt.size() * presence <= unique_temp_rt.size();
-            
-          } else {
-            // case when a trace is only present in a CE and not in others applied
-            if (unique_temp_pre_ce.size() < unique_pre_ce.size()) {
-              enough_presence = unique_rt.size() * (unique_temp_pre_ce.size() / unique_pre_ce.size()) * presence <= unique_temp_rt.size();
-              
-            } else {
-              enough_presence = unique_rt.size() * presence <= unique_temp_rt.size();
-            }
-          }
-          
-          // when is not enough present skips the m/z cluster
-          if (!enough_presence) continue;
-          
-          auto max_intensity_ptr = std::max_element(temp_intensity.begin(), temp_intensity.end());
-          new_intensity.push_back(*max_intensity_ptr);
-          
-          int size_temp_mz = temp_mz.size();
-          
-          float mz_sum = 0, mz_numWeight = 0;
-          
-          for (int w = 0; w < size_temp_mz; w++) {
-            mz_numWeight = mz_numWeight + temp_mz[w] * temp_intensity[w];
-            mz_sum = mz_sum + temp_intensity[w];
-          }
-          
-          double mean_mz = mz_numWeight / mz_sum;
-          
-          new_mz.push_back(mean_mz);
-          
-        } // end of clusters for loop
-        
-        if (verbose) Rcpp::Rcout << "Cluster with " << new_mz.size() << " traces." << std::endl;
-        
-        if (new_mz.size() > 0) {
-
-          double rt_mean = 0;
-          
-          for (double val : rt) {
-            rt_mean += val;
-          }
-          
-          rt_mean = rt_mean / rt.size();
-          
-          if (verbose) Rcpp::Rcout << "Average rt of " << rt_mean << " seconds." << std::endl;
-          
-          bool pre_mzHasNaN = false;
-          
-          for (const double& val : u_pre_mz) {
-            if (std::isnan(val)) {
-              pre_mzHasNaN = true;
-              break;
-            }
-          }
-          
-          if (has_pre_mz & !pre_mzHasNaN) {
-            
-            double pre_mz_mean = 0;
-            
-            std::vector<bool> is_pre(new_mz.size(), false);
-            
-            for (const double& val : u_pre_mz) {
-              pre_mz_mean += val;
-            }
-            
-            pre_mz_mean = pre_mz_mean / u_pre_mz.size();
-            
-            if (verbose) Rcpp::Rcout << "Average pre_mz of " << pre_mz_mean << " Da." << std::endl;
-            
-            // list_out["pre_mz"] = pre_mz_mean;
-            
-            if (!std::isnan(pre_mz_mean)) {
-              for (size_t p = 0; p < new_mz.size(); p++) {
-                if ((new_mz[p] >= pre_mz_mean - mzClust) && (new_mz[p] <= pre_mz_mean + mzClust)) {
-                  is_pre[p] = true;
-                }
-              }
-            }
-            
-            spectra_out[i] = Rcpp::DataFrame::create(
-              Rcpp::Named("analysis") = analysis[0],
-                Rcpp::Named("id") = id[0],
-                Rcpp::Named("polarity") = polarity[0],
-                Rcpp::Named("pre_mz") = pre_mz_mean,
-                Rcpp::Named("rt") = rt_mean,
-                Rcpp::Named("mz") = new_mz,
-                Rcpp::Named("intensity") = new_intensity,
-                Rcpp::Named("is_pre") = is_pre
-            );
-            
-          } else {
-            spectra_out[i] = Rcpp::DataFrame::create(
-              Rcpp::Named("analysis") = analysis[0],
-              Rcpp::Named("id") = id[0],
-              Rcpp::Named("polarity") = polarity[0],
-              Rcpp::Named("rt") = rt_mean,
-              Rcpp::Named("mz") = new_mz,
-              Rcpp::Named("intensity") = new_intensity
-            );
-            
-            
-            
-          }
-        } else {
-          spectra_out[i] = Rcpp::DataFrame::create();
-        }
-        
-        hasFromSameScan = false;
-        
-        for (const bool& l : fromSameScan) {
-          if (l) {
-            hasFromSameScan = true;
-            break;
-          }
-        }
-        
-        if (!hasFromSameScan) if (verbose) Rcpp::Rcout << "Done! \n\n";
-
-      } // end of while loop
-      
-    } // if u_mz is not empty
-
-  } // end main for loop
-  
   return(spectra_out);
 }
@@ -214,11 +214,11 @@ Rcpp::List rcpp_parse_ms_spectra(Rcpp::List analysis,
 
   const int n_tg = targets.nrow();
 
-  sc::MS_FILE ana(file);
-
   if (n_tg == 0)
   {
 
+    sc::MS_FILE ana(file);
+
     const std::vector<int> &polarity = hd["polarity"];
     const std::vector<int> &configuration = hd["configuration"];
     const std::vector<int> &level = hd["level"];
@@ -375,7 +375,7 @@ Rcpp::List rcpp_parse_ms_spectra(Rcpp::List analysis,
     headers.activation_ce = hd_pre_ce;
     headers.mobility = hd_mobility;
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(tg, headers, minIntLv1, minIntLv2);
+    sc::MS_TARGETS_SPECTRA res = sc::extract_spectra_targets(file, tg, headers, minIntLv1, minIntLv2);
 
     out["id"] = res.id;
     out["polarity"] = res.polarity;
@@ -397,6 +397,45 @@ Rcpp::List rcpp_parse_ms_spectra(Rcpp::List analysis,
   return empty_df;
 };
 
+// MARK: rcpp_ms_build_spectra_index
+// [[Rcpp::export]]
+Rcpp::List rcpp_ms_build_spectra_index(Rcpp::List analysis, float binWidth = 0.01, bool overwrite = false)
+{
+
+  const std::string file = analysis["file"];
+
+  if (!std::filesystem::exists(file))
+    throw std::runtime_error("File " + file + " not found!");
+
+  const std::string index_path = sc::get_mz_rt_index_path(file);
+
+  std::shared_ptr<const sc::MS_MZ_RT_INDEX> index;
+
+  if (!overwrite)
+    index = sc::load_mz_rt_index(file);
+
+  if (index == nullptr || index->bin_width != binWidth)
+  {
+    sc::MS_FILE ana(file);
+
+    const sc::MS_SPECTRA_HEADERS headers = ana.get_spectra_headers();
+
+    const sc::MS_MZ_RT_INDEX new_index = ana.build_mz_rt_index(headers, binWidth);
+
+    index = sc::save_mz_rt_index(file, new_index);
+  }
+
+  Rcpp::List out = Rcpp::List::create(
+      Rcpp::Named("file") = file,
+      Rcpp::Named("index") = index_path,
+      Rcpp::Named("bin_width") = index->bin_width,
+      Rcpp::Named("min_mz") = index->min_mz,
+      Rcpp::Named("number_bins") = index->number_bins,
+      Rcpp::Named("number_traces") = static_cast<double>(index->size()));
+
+  return out;
+};
+
 // MARK: rcpp_parse_ms_chromatograms
 // [[Rcpp::export]]
 Rcpp::List rcpp_parse_ms_chromatograms(Rcpp::List analysis, std::vector<int> idx)
@@ -504,199 +543,169 @@ Rcpp::List rcpp_ms_annotate_features(Rcpp::List feature_list,
                                      int maxGaps = 1)
 {
 
-  nts::MS_ISOTOPE_SET isotopes;
-
-  std::vector<std::string> elements = {"C", "H", "N", "O", "S", "Cl", "Br", "Si"};
-
-  isotopes.filter(elements);
+  const std::vector<std::string> elements = {"C", "H", "N", "O", "S", "Cl", "Br", "Si"};
 
   const int max_number_elements = 5;
 
-  Rcpp::Rcout << "Building combinatorial isotopic chains with length " << max_number_elements << "...";
-  nts::MS_ISOTOPE_COMBINATIONS combinations(isotopes, max_number_elements);
-  Rcpp::Rcout << "Done!" << std::endl;
+  const nts::MS_ISOTOPE_COMBINATIONS &combinations = nts::get_isotope_combinations(elements, max_number_elements);
 
   const int number_analyses = feature_list.size();
 
-  if (number_analyses == 0)
-    return feature_list;
+  std::vector<nts::MS_FEATURES_MZ_SORTED> analyses_fdf;
+  std::vector<nts::MS_ANNOTATION> analyses_af;
+
+  analyses_fdf.reserve(number_analyses);
+  analyses_af.reserve(number_analyses);
+
+  int total_features = 0;
 
   for (int a = 0; a < number_analyses; a++)
   {
-
     Rcpp::List features = feature_list[a];
+    analyses_fdf.emplace_back(features);
+    analyses_af.emplace_back(analyses_fdf[a].n);
+    total_features += analyses_fdf[a].n;
+  }
 
-    const nts::MS_FEATURES_MZ_SORTED fdf(features);
+  Rcpp::Rcout << "Annotating isotopes and adducts in " << total_features << " features of " << number_analyses << " analyses...";
 
-    const std::vector<std::string> fts = features["feature"];
+  nts::annotate_analyses_features(analyses_af, analyses_fdf, combinations, rtWindowAlignment, maxIsotopes, maxCharge, maxGaps);
 
-    const int number_features = fdf.n;
+  Rcpp::Rcout << "Done!" << std::endl;
 
-    nts::MS_ANNOTATION af(number_features);
+  std::vector<std::string> analyses_names(number_analyses);
 
-    Rcpp::Rcout << "Annotating isotopes in " << number_features << " features...";
+  if (number_analyses > 0)
+    analyses_names = Rcpp::as<std::vector<std::string>>(feature_list.names());
+
+  nts::MS_CATEGORIES analysis_levels;
+  nts::MS_CATEGORIES iso_cat_levels;
+  nts::MS_CATEGORIES iso_isotope_levels;
+  nts::MS_CATEGORIES adduct_element_levels;
+  nts::MS_CATEGORIES adduct_cat_levels;
+
+  std::vector<int> out_analysis(total_features);
+  std::vector<int> out_iso_cat(total_features);
+  std::vector<int> out_iso_isotope(total_features);
+  std::vector<int> out_adduct_element(total_features);
+  std::vector<int> out_adduct_cat(total_features);
+
+  std::vector<int> out_index;
+  std::vector<std::string> out_feature;
+  std::vector<std::string> out_component_feature;
+  std::vector<int> out_iso_size;
+  std::vector<int> out_iso_charge;
+  std::vector<int> out_iso_step;
+  std::vector<float> out_iso_mzr;
+  std::vector<float> out_iso_relative_intensity;
+  std::vector<float> out_iso_theoretical_min_relative_intensity;
+  std::vector<float> out_iso_theoretical_max_relative_intensity;
+  std::vector<float> out_iso_mass_distance;
+  std::vector<float> out_iso_theoretical_mass_distance;
+  std::vector<float> out_iso_mass_distance_error;
+  std::vector<float> out_iso_time_error;
+  std::vector<float> out_iso_number_carbons;
+  std::vector<float> out_adduct_time_error;
+  std::vector<float> out_adduct_mass_error;
+
+  out_feature.reserve(total_features);
+  out_component_feature.reserve(total_features);
+
+  int offset = 0;
 
-    for (int f = 0; f < number_features; f++)
-    {
+  for (int a = 0; a < number_analyses; a++)
+  {
 
-      const int &index = fdf.index[f];
+    const nts::MS_ANNOTATION &af = analyses_af[a];
 
-      if (af.iso_step[index] > 0)
-        continue; // already isotope
+    const int number_features = af.size();
 
-      const std::string &feature = fdf.feature[f];
-      const int &polarity = fdf.polarity[f];
-      const float &rt = fdf.rt[f];
-      float rtmin = fdf.rtmin[f];
-      float rtmax = fdf.rtmax[f];
-      const float &mz = fdf.mz[f];
-      const float &mzmin = fdf.mzmin[f];
-      const float &mzmax = fdf.mzmax[f];
-      const float max_mz_chain = (mz + maxIsotopes) * 1.05;
+    if (number_features == 0)
+      continue;
 
-      std::vector<int> candidates = nts::find_isotopic_candidates(
-          number_features,
-          fdf.feature, fdf.mz, fdf.rt, fdf.polarity,
-          polarity, feature, mz, mzmin, mzmax, rt, rtmin, rtmax,
-          rtWindowAlignment, max_mz_chain);
+    Rcpp::List features = feature_list[a];
 
-      const int number_candidates = candidates.size();
+    const std::vector<std::string> fts = features["feature"];
 
-      if (number_candidates > 0)
-      {
+    // codes of the analysis dictionaries are remapped to the dictionaries of the whole output
+    const int code_analysis = analysis_levels.code(analyses_names[a]);
 
-        candidates.insert(candidates.begin(), f);
+    std::vector<int> map_iso_cat(af.iso_cat_levels.size());
+    std::vector<int> map_iso_isotope(af.iso_isotope_levels.size());
+    std::vector<int> map_adduct_element(af.adduct_element_levels.size());
+    std::vector<int> map_adduct_cat(af.adduct_cat_levels.size());
 
-        nts::MS_CANDIDATE_CHAIN candidates_chain(candidates, fdf.feature, fdf.index, fdf.mz, fdf.mzmin, fdf.mzmax, fdf.rt, fdf.intensity);
+    for (size_t c = 0; c < map_iso_cat.size(); c++)
+      map_iso_cat[c] = iso_cat_levels.code(af.iso_cat_levels.level(c));
 
-        annotate_isotopes(af, combinations, candidates_chain, maxIsotopes, maxCharge, maxGaps);
-      }
-      else
-      {
-        af.index[index] = index;
-        af.feature[index] = feature;
-        af.component_feature[index] = feature;
-        af.iso_step[index] = 0;
-        af.iso_cat[index] = "M+0";
-        af.iso_isotope[index] = "";
-        af.iso_charge[index] = 1;
-        af.iso_mzr[index] = 0;
-        af.iso_mass_distance[index] = 0;
-        af.iso_theoretical_mass_distance[index] = 0;
-        af.iso_mass_distance_error[index] = 0;
-        af.iso_time_error[index] = 0;
-        af.iso_relative_intensity[index] = 1;
-        af.iso_theoretical_min_relative_intensity[index] = 0;
-        af.iso_theoretical_max_relative_intensity[index] = 0;
-        af.iso_number_carbons[index] = 0;
-        af.iso_size[index] = 0;
-      }
-    }
+    for (size_t c = 0; c < map_iso_isotope.size(); c++)
+      map_iso_isotope[c] = iso_isotope_levels.code(af.iso_isotope_levels.level(c));
 
-    Rcpp::Rcout << "Done!" << std::endl;
+    for (size_t c = 0; c < map_adduct_element.size(); c++)
+      map_adduct_element[c] = adduct_element_levels.code(af.adduct_element_levels.level(c));
 
-    Rcpp::Rcout << "Annotating adducts in " << number_features << " features...";
+    for (size_t c = 0; c < map_adduct_cat.size(); c++)
+      map_adduct_cat[c] = adduct_cat_levels.code(af.adduct_cat_levels.level(c));
 
-    for (int f = 0; f < number_features; f++)
+    for (int i = 0; i < number_features; i++)
     {
-
-      const int &index = fdf.index[f];
-
-      if (af.iso_step[index] > 0)
-        continue; // already isotope
-
-      if (af.adduct_cat[index] != "")
-        continue; // already adduct
-
-      const int &polarity = fdf.polarity[f];
-      const float &rt = fdf.rt[f];
-      float rtmin = fdf.rtmin[f];
-      float rtmax = fdf.rtmax[f];
-      const float &mz = fdf.mz[f];
-      const float &mzmin = fdf.mzmin[f];
-      const float &mzmax = fdf.mzmax[f];
-      const float max_mz_adducts = (mz + 100);
-
-      std::vector<int> candidates = nts::find_adduct_candidates(
-          number_features, fdf.mz, fdf.rt, fdf.polarity, af.iso_step, polarity, mz, mzmin, mzmax, rt, rtmin, rtmax, rtWindowAlignment, max_mz_adducts);
-
-      const int number_candidates = candidates.size();
-
-      if (number_candidates > 0)
-      {
-        candidates.insert(candidates.begin(), f);
-        nts::MS_CANDIDATE_CHAIN candidates_chain(candidates, fdf.feature, fdf.index, fdf.mz, fdf.mzmin, fdf.mzmax, fdf.rt, fdf.intensity);
-        nts::annotate_adducts(af, candidates_chain, polarity);
-      }
+      const int k = offset + i;
+      out_analysis[k] = code_analysis;
+      out_iso_cat[k] = map_iso_cat[af.iso_cat[i]];
+      out_iso_isotope[k] = map_iso_isotope[af.iso_isotope[i]];
+      out_adduct_element[k] = map_adduct_element[af.adduct_element[i]];
+      out_adduct_cat[k] = map_adduct_cat[af.adduct_cat[i]];
+      out_feature.push_back(fts[i]);
+      out_component_feature.push_back(fts[af.component_index[i]]);
     }
 
-    Rcpp::Rcout << "Done!" << std::endl;
-
-    Rcpp::List list_annotation(number_features);
+    out_index.insert(out_index.end(), af.index.begin(), af.index.end());
+    out_iso_size.insert(out_iso_size.end(), af.iso_size.begin(), af.iso_size.end());
+    out_iso_charge.insert(out_iso_charge.end(), af.iso_charge.begin(), af.iso_charge.end());
+    out_iso_step.insert(out_iso_step.end(), af.iso_step.begin(), af.iso_step.end());
+    out_iso_mzr.insert(out_iso_mzr.end(), af.iso_mzr.begin(), af.iso_mzr.end());
+    out_iso_relative_intensity.insert(out_iso_relative_intensity.end(), af.iso_relative_intensity.begin(), af.iso_relative_intensity.end());
+    out_iso_theoretical_min_relative_intensity.insert(out_iso_theoretical_min_relative_intensity.end(), af.iso_theoretical_min_relative_intensity.begin(), af.iso_theoretical_min_relative_intensity.end());
+    out_iso_theoretical_max_relative_intensity.insert(out_iso_theoretical_max_relative_intensity.end(), af.iso_theoretical_max_relative_intensity.begin(), af.iso_theoretical_max_relative_intensity.end());
+    out_iso_mass_distance.insert(out_iso_mass_distance.end(), af.iso_mass_distance.begin(), af.iso_mass_distance.end());
+    out_iso_theoretical_mass_distance.insert(out_iso_theoretical_mass_distance.end(), af.iso_theoretical_mass_distance.begin(), af.iso_theoretical_mass_distance.end());
+    out_iso_mass_distance_error.insert(out_iso_mass_distance_error.end(), af.iso_mass_distance_error.begin(), af.iso_mass_distance_error.end());
+    out_iso_time_error.insert(out_iso_time_error.end(), af.iso_time_error.begin(), af.iso_time_error.end());
+    out_iso_number_carbons.insert(out_iso_number_carbons.end(), af.iso_number_carbons.begin(), af.iso_number_carbons.end());
+    out_adduct_time_error.insert(out_adduct_time_error.end(), af.adduct_time_error.begin(), af.adduct_time_error.end());
+    out_adduct_mass_error.insert(out_adduct_mass_error.end(), af.adduct_mass_error.begin(), af.adduct_mass_error.end());
+
+    offset += number_features;
+  }
 
-    for (int f = 0; f < number_features; f++)
-    {
+  Rcpp::List list_out;
 
-      const int &index = fdf.index[f];
-
-      Rcpp::List temp = Rcpp::List::create(
-          Rcpp::Named("index") = index,
-          Rcpp::Named("feature") = af.feature[f],
-          Rcpp::Named("component_feature") = af.component_feature[f],
-          Rcpp::Named("iso_size") = af.iso_size[f],
-          Rcpp::Named("iso_charge") = af.iso_charge[f],
-          Rcpp::Named("iso_step") = af.iso_step[f],
-          Rcpp::Named("iso_cat") = af.iso_cat[f],
-          Rcpp::Named("iso_isotope") = af.iso_isotope[f],
-          Rcpp::Named("iso_mzr") = af.iso_mzr[f],
-          Rcpp::Named("iso_relative_intensity") = af.iso_relative_intensity[f],
-          Rcpp::Named("iso_theoretical_min_relative_intensity") = af.iso_theoretical_min_relative_intensity[f],
-          Rcpp::Named("iso_theoretical_max_relative_intensity") = af.iso_theoretical_max_relative_intensity[f],
-          Rcpp::Named("iso_mass_distance") = af.iso_mass_distance[f],
-          Rcpp::Named("iso_theoretical_mass_distance") = af.iso_theoretical_mass_distance[f],
-          Rcpp::Named("iso_mass_error") = af.iso_mass_distance_error[f],
-          Rcpp::Named("iso_time_error") = af.iso_time_error[f],
-          Rcpp::Named("iso_number_carbons") = af.iso_number_carbons[f],
-          Rcpp::Named("adduct_element") = af.adduct_element[f],
-          Rcpp::Named("adduct_cat") = af.adduct_cat[f],
-          Rcpp::Named("adduct_time_error") = af.adduct_time_error[f],
-          Rcpp::Named("adduct_mass_error") = af.adduct_mass_error[f]);
-
-      temp.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
-
-      list_annotation[index] = temp;
-    }
+  list_out["analysis"] = analysis_levels.factor(out_analysis);
+  list_out["index"] = out_index;
+  list_out["feature"] = out_feature;
+  list_out["component_feature"] = out_component_feature;
+  list_out["iso_size"] = out_iso_size;
+  list_out["iso_charge"] = out_iso_charge;
+  list_out["iso_step"] = out_iso_step;
+  list_out["iso_cat"] = iso_cat_levels.factor(out_iso_cat);
+  list_out["iso_isotope"] = iso_isotope_levels.factor(out_iso_isotope);
+  list_out["iso_mzr"] = out_iso_mzr;
+  list_out["iso_relative_intensity"] = out_iso_relative_intensity;
+  list_out["iso_theoretical_min_relative_intensity"] = out_iso_theoretical_min_relative_intensity;
+  list_out["iso_theoretical_max_relative_intensity"] = out_iso_theoretical_max_relative_intensity;
+  list_out["iso_mass_distance"] = out_iso_mass_distance;
+  list_out["iso_theoretical_mass_distance"] = out_iso_theoretical_mass_distance;
+  list_out["iso_mass_error"] = out_iso_mass_distance_error;
+  list_out["iso_time_error"] = out_iso_time_error;
+  list_out["iso_number_carbons"] = out_iso_number_carbons;
+  list_out["adduct_element"] = adduct_element_levels.factor(out_adduct_element);
+  list_out["adduct_cat"] = adduct_cat_levels.factor(out_adduct_cat);
+  list_out["adduct_time_error"] = out_adduct_time_error;
+  list_out["adduct_mass_error"] = out_adduct_mass_error;
 
-    features["annotation"] = list_annotation;
-
-    feature_list[a] = features;
-
-    // list_out["index"] = af.index;
-    // list_out["feature"] = af.feature;
-    // list_out["mz"] = fdf.mz;
-    // list_out["rt"] = fdf.rt;
-    // list_out["intensity"] = fdf.intensity;
-    // list_out["component_feature"] = af.component_feature;
-    // list_out["iso_size"] = af.iso_size;
-    // list_out["iso_charge"] = af.iso_charge;
-    // list_out["iso_step"] = af.iso_step;
-    // list_out["iso_cat"] = af.iso_cat;
-    // list_out["iso_isotope"] = af.iso_isotope;
-    // list_out["iso_mzr"] = af.iso_mzr;
-    // list_out["iso_relative_intensity"] = af.iso_relative_intensity;
-    // list_out["iso_theoretical_min_relative_intensity"] = af.iso_theoretical_min_relative_intensity;
-    // list_out["iso_theoretical_max_relative_intensity"] = af.iso_theoretical_max_relative_intensity;
-    // list_out["iso_mass_distance"] = af.iso_mass_distance;
-    // list_out["iso_theoretical_mass_distance"] = af.iso_theoretical_mass_distance;
-    // list_out["iso_error"] = af.iso_mass_distance_error;
-    // list_out["iso_number_carbons"] = af.iso_number_carbons;
-    // list_out["adduct_element"] = af.adduct_element;
-    // list_out["adduct_cat"] = af.adduct_cat;
-    // list_out["adduct_error"] = af.adduct_error;
-    // list_out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
-  }
+  list_out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
 
-  return feature_list;
+  return list_out;
 };
 
 // MARK: rcpp_ms_load_features_eic
@@ -730,6 +739,10 @@ Rcpp::List rcpp_ms_load_features_eic(Rcpp::List analyses,
 
   std::vector<std::string> features_analyses_names = features.names();
 
+  std::vector<nts::MS_ANALYSIS_TARGETS> analyses_targets(number_analyses);
+
+  std::vector<std::vector<int>> features_targets(number_analyses);
+
   for (int i = 0; i < number_analyses; i++)
   {
 
@@ -772,21 +785,20 @@ Rcpp::List rcpp_ms_load_features_eic(Rcpp::List analyses,
     const std::vector<std::string> &fts_id = features_i["feature"];
     const std::vector<bool> &fts_filtered = features_i["filtered"];
     const std::vector<int> &fts_polarity = features_i["polarity"];
-    const std::vector<float> &fts_rt = features_i["rt"];
     const std::vector<float> &fts_rtmin = features_i["rtmin"];
     const std::vector<float> &fts_rtmax = features_i["rtmax"];
-    const std::vector<float> &fts_mz = features_i["mz"];
     const std::vector<float> &fts_mzmin = features_i["mzmin"];
     const std::vector<float> &fts_mzmax = features_i["mzmax"];
-    const std::vector<float> &fts_intensity = features_i["intensity"];
-    std::vector<Rcpp::List> fts_eic = features_i["eic"];
+    const std::vector<Rcpp::List> fts_eic = features_i["eic"];
 
     const int n_features = fts_id.size();
 
     if (n_features == 0)
       return features;
 
-    sc::MS_TARGETS targets;
+    sc::MS_TARGETS &targets = analyses_targets[i].targets;
+
+    features_targets[i].resize(n_features, -1);
 
     int counter = 0;
     for (int j = 0; j < n_features; j++)
@@ -800,6 +812,7 @@ Rcpp::List rcpp_ms_load_features_eic(Rcpp::List analyses,
       if (eic_size > 0)
         continue;
 
+      features_targets[i][j] = counter;
       targets.index.push_back(counter);
       counter++;
       targets.id.push_back(fts_id[j]);
@@ -818,32 +831,46 @@ Rcpp::List rcpp_ms_load_features_eic(Rcpp::List analyses,
       continue;
 
     const Rcpp::List &analysis = analyses[i];
+    const std::string file = analysis["file"];
+    analyses_targets[i].file = file;
+    analyses_targets[i].headers = nts::get_ms_analysis_list_headers(analysis);
+  }
 
-    sc::MS_SPECTRA_HEADERS headers = nts::get_ms_analysis_list_headers(analysis);
+  nts::extract_analyses_targets(analyses_targets, minTracesIntensity, 0, true);
 
-    const std::string file = analysis["file"];
+  for (int i = 0; i < number_analyses; i++)
+  {
 
-    if (!std::filesystem::exists(file))
+    if (analyses_targets[i].targets.id.size() == 0)
       continue;
 
-    sc::MS_FILE ana(file);
+    if (!std::filesystem::exists(analyses_targets[i].file))
+      continue;
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(targets, headers, minTracesIntensity, 0);
+    Rcpp::List features_i = features[i];
+
+    const std::vector<std::string> &fts_id = features_i["feature"];
+    std::vector<Rcpp::List> fts_eic = features_i["eic"];
+
+    const int n_features = fts_id.size();
 
     for (int j = 0; j < n_features; j++)
     {
 
-      if (!filtered)
-        if (fts_filtered[j])
-          continue;
+      const int t = features_targets[i][j];
 
-      const std::string &id_j = fts_id[j];
+      if (t < 0)
+        continue;
 
-      sc::MS_TARGETS_SPECTRA res_j = res[id_j];
+      const std::string &id_j = fts_id[j];
 
-      nts::merge_traces_within_rt(res_j.rt, res_j.mz, res_j.intensity);
+      const sc::MS_TARGETS_SPECTRA &res_j = analyses_targets[i].spectra[t];
 
       const int n = res_j.rt.size();
+
+      if (n == 0)
+        continue;
+
       const std::vector<std::string> id_vec = std::vector<std::string>(n, id_j);
       const std::vector<int> level_vec = std::vector<int>(n, res_j.level[0]);
       const std::vector<int> polarity_vec = std::vector<int>(n, res_j.polarity[0]);
@@ -901,6 +928,10 @@ Rcpp::List rcpp_ms_load_features_ms1(Rcpp::List analyses,
 
   std::vector<std::string> features_analyses_names = features.names();
 
+  std::vector<nts::MS_ANALYSIS_TARGETS> analyses_targets(number_analyses);
+
+  std::vector<std::vector<int>> features_targets(number_analyses);
+
   int rtWindowMax_idx = nts::find_max_index(rtWindow);
   int rtWindowMin_idx = nts::find_min_index(rtWindow);
   int mzWindowMax_idx = nts::find_max_index(mzWindow);
@@ -950,19 +981,21 @@ Rcpp::List rcpp_ms_load_features_ms1(Rcpp::List analyses,
     const std::vector<int> &fts_polarity = features_i["polarity"];
     const std::vector<float> &fts_rt = features_i["rt"];
     const std::vector<float> &fts_mz = features_i["mz"];
-    const std::vector<float> &fts_intensity = features_i["intensity"];
-    std::vector<Rcpp::List> fts_ms1 = features_i["ms1"];
+    const std::vector<Rcpp::List> fts_ms1 = features_i["ms1"];
 
     const int n_features = fts_id.size();
 
     if (n_features == 0)
       return features;
 
-    sc::MS_TARGETS targets;
+    sc::MS_TARGETS &targets = analyses_targets[i].targets;
+
+    features_targets[i].resize(n_features, -1);
 
     int counter = 0;
     for (int j = 0; j < n_features; j++)
     {
+
       if (!filtered)
         if (fts_filtered[j])
           continue;
@@ -971,6 +1004,7 @@ Rcpp::List rcpp_ms_load_features_ms1(Rcpp::List analyses,
       if (ms1_size > 0)
         continue;
 
+      features_targets[i][j] = counter;
       targets.index.push_back(counter);
       counter++;
       targets.id.push_back(fts_id[j]);
@@ -989,28 +1023,40 @@ Rcpp::List rcpp_ms_load_features_ms1(Rcpp::List analyses,
       continue;
 
     const Rcpp::List &analysis = analyses[i];
+    const std::string file = analysis["file"];
+    analyses_targets[i].file = file;
+    analyses_targets[i].headers = nts::get_ms_analysis_list_headers(analysis);
+  }
 
-    sc::MS_SPECTRA_HEADERS headers = nts::get_ms_analysis_list_headers(analysis);
+  nts::extract_analyses_targets(analyses_targets, minTracesIntensity, 0, false);
 
-    const std::string file = analysis["file"];
+  for (int i = 0; i < number_analyses; i++)
+  {
 
-    if (!std::filesystem::exists(file))
+    if (analyses_targets[i].targets.id.size() == 0)
       continue;
 
-    sc::MS_FILE ana(file);
+    if (!std::filesystem::exists(analyses_targets[i].file))
+      continue;
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(targets, headers, minTracesIntensity, 0);
+    Rcpp::List features_i = features[i];
+
+    const std::vector<std::string> &fts_id = features_i["feature"];
+    std::vector<Rcpp::List> fts_ms1 = features_i["ms1"];
+
+    const int n_features = fts_id.size();
 
     for (int j = 0; j < n_features; j++)
     {
 
-      if (!filtered)
-        if (fts_filtered[j])
-          continue;
+      const int t = features_targets[i][j];
+
+      if (t < 0)
+        continue;
 
       const std::string &id_j = fts_id[j];
 
-      sc::MS_TARGETS_SPECTRA res_j = res[id_j];
+      const sc::MS_TARGETS_SPECTRA &res_j = analyses_targets[i].spectra[t];
 
       const int n_res_j = res_j.rt.size();
 
@@ -1075,6 +1121,10 @@ Rcpp::List rcpp_ms_load_features_ms2(Rcpp::List analyses,
 
   std::vector<std::string> features_analyses_names = features.names();
 
+  std::vector<nts::MS_ANALYSIS_TARGETS> analyses_targets(number_analyses);
+
+  std::vector<std::vector<int>> features_targets(number_analyses);
+
   for (int i = 0; i < number_analyses; i++)
   {
 
@@ -1117,19 +1167,19 @@ Rcpp::List rcpp_ms_load_features_ms2(Rcpp::List analyses,
     const std::vector<std::string> &fts_id = features_i["feature"];
     const std::vector<bool> &fts_filtered = features_i["filtered"];
     const std::vector<int> &fts_polarity = features_i["polarity"];
-    const std::vector<float> &fts_rt = features_i["rt"];
     const std::vector<float> &fts_rtmin = features_i["rtmin"];
     const std::vector<float> &fts_rtmax = features_i["rtmax"];
     const std::vector<float> &fts_mz = features_i["mz"];
-    const std::vector<float> &fts_intensity = features_i["intensity"];
-    std::vector<Rcpp::List> fts_ms2 = features_i["ms2"];
+    const std::vector<Rcpp::List> fts_ms2 = features_i["ms2"];
 
     const int n_features = fts_id.size();
 
     if (n_features == 0)
       return features;
 
-    sc::MS_TARGETS targets;
+    sc::MS_TARGETS &targets = analyses_targets[i].targets;
+
+    features_targets[i].resize(n_features, -1);
 
     int counter = 0;
     for (int j = 0; j < n_features; j++)
@@ -1143,6 +1193,7 @@ Rcpp::List rcpp_ms_load_features_ms2(Rcpp::List analyses,
       if (ms2_size > 0)
         continue;
 
+      features_targets[i][j] = counter;
       targets.index.push_back(counter);
       counter++;
       targets.id.push_back(fts_id[j]);
@@ -1161,28 +1212,40 @@ Rcpp::List rcpp_ms_load_features_ms2(Rcpp::List analyses,
       continue;
 
     const Rcpp::List &analysis = analyses[i];
+    const std::string file = analysis["file"];
+    analyses_targets[i].file = file;
+    analyses_targets[i].headers = nts::get_ms_analysis_list_headers(analysis);
+  }
 
-    sc::MS_SPECTRA_HEADERS headers = nts::get_ms_analysis_list_headers(analysis);
+  nts::extract_analyses_targets(analyses_targets, 0, minTracesIntensity, false);
 
-    const std::string file = analysis["file"];
+  for (int i = 0; i < number_analyses; i++)
+  {
 
-    if (!std::filesystem::exists(file))
+    if (analyses_targets[i].targets.id.size() == 0)
       continue;
 
-    sc::MS_FILE ana(file);
+    if (!std::filesystem::exists(analyses_targets[i].file))
+      continue;
+
+    Rcpp::List features_i = features[i];
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(targets, headers, 0, minTracesIntensity);
+    const std::vector<std::string> &fts_id = features_i["feature"];
+    std::vector<Rcpp::List> fts_ms2 = features_i["ms2"];
+
+    const int n_features = fts_id.size();
 
     for (int j = 0; j < n_features; j++)
     {
 
-      if (!filtered)
-        if (fts_filtered[j])
-          continue;
+      const int t = features_targets[i][j];
+
+      if (t < 0)
+        continue;
 
       const std::string &id_j = fts_id[j];
 
-      sc::MS_TARGETS_SPECTRA res_j = res[id_j];
+      const sc::MS_TARGETS_SPECTRA &res_j = analyses_targets[i].spectra[t];
 
       const int n_res_j = res_j.rt.size();
 
@@ -1462,47 +1525,50 @@ Rcpp::List rcpp_ms_fill_features(Rcpp::List analyses,
 
   Rcpp::Rcout << "Done!" << std::endl;
 
-  for (int j = 0; j < number_analyses; j++)
-  {
+  std::vector<nts::MS_ANALYSIS_TARGETS> analyses_targets(number_analyses);
 
-    Rcpp::List out_analyses;
+  int n_analyses_targets = 0;
 
-    int n_j_targets = ana_targets[j].id.size();
+  for (int j = 0; j < number_analyses; j++)
+  {
 
-    if (n_j_targets == 0)
+    if (ana_targets[j].id.size() == 0)
       continue;
 
-    Rcpp::Rcout << "Extracting " << ana_targets[j].id.size() << " EICs from analysis " << analyses_names[j] << "...";
-
     const Rcpp::List &analysis = analyses[j];
-
-    const sc::MS_SPECTRA_HEADERS headers = nts::get_ms_analysis_list_headers(analysis);
-
     const std::string file = analysis["file"];
+    analyses_targets[j].file = file;
+    analyses_targets[j].headers = nts::get_ms_analysis_list_headers(analysis);
+    analyses_targets[j].targets = ana_targets[j];
+    n_analyses_targets++;
+  }
 
-    if (!std::filesystem::exists(file))
-      continue;
+  Rcpp::Rcout << "Extracting EICs from " << n_analyses_targets << " analyses...";
 
-    sc::MS_FILE ana(file);
+  nts::extract_analyses_targets(analyses_targets, minTracesIntensity, 0, true);
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(ana_targets[j], headers, minTracesIntensity, 0);
+  Rcpp::Rcout << " Done! " << std::endl;
 
-    const int n_traces = res.id.size();
+  for (int j = 0; j < number_analyses; j++)
+  {
 
-    Rcpp::Rcout << " Done! " << std::endl;
+    Rcpp::List out_analyses;
 
-    for (int i = n_j_targets - 1; i >= 0; --i)
-    {
+    int n_j_targets = ana_targets[j].id.size();
+
+    if (n_j_targets == 0)
+      continue;
 
-      const std::string &id_i = ana_targets[j].id[i];
+    if (!std::filesystem::exists(analyses_targets[j].file))
+      continue;
 
-      int count = 0;
+    std::vector<sc::MS_TARGETS_SPECTRA> &res = analyses_targets[j].spectra;
+    const std::vector<int> &res_counts = analyses_targets[j].number_traces;
 
-      for (int z = 0; z < n_traces; z++)
-        if (res.id[z] == id_i)
-          count++;
+    for (int i = n_j_targets - 1; i >= 0; --i)
+    {
 
-      if (count < minNumberTraces)
+      if (res_counts[i] < minNumberTraces)
       {
         ana_targets[j].index.erase(ana_targets[j].index.begin() + i);
         ana_targets[j].id.erase(ana_targets[j].id.begin() + i);
@@ -1517,6 +1583,7 @@ Rcpp::List rcpp_ms_fill_features(Rcpp::List analyses,
         ana_targets[j].mobilitymax.erase(ana_targets[j].mobilitymax.begin() + i);
         ana_targets_groups[j].erase(ana_targets_groups[j].begin() + i);
         ana_targets_replicates[j].erase(ana_targets_replicates[j].begin() + i);
+        res.erase(res.begin() + i);
       }
     }
 
@@ -1524,32 +1591,32 @@ Rcpp::List rcpp_ms_fill_features(Rcpp::List analyses,
 
     Rcpp::Rcout << "Filling " << n_j_targets << " features from analysis " << analyses_names[j] << "...";
 
-    const std::vector<std::string> tg_id = ana_targets[j].id;
-
+    std::vector<int64_t> fit_offsets(n_j_targets + 1, 0);
     for (int i = 0; i < n_j_targets; i++)
-    {
-
-      const std::string &id_i = tg_id[i];
-
-      sc::MS_TARGETS_SPECTRA res_i = res[id_i];
-
-      const int n_res_i = res_i.id.size();
+      fit_offsets[i + 1] = fit_offsets[i] + res[i].rt.size();
 
-      if (n_res_i < minNumberTraces)
-        continue;
+    std::vector<float> fit_rt;
+    std::vector<float> fit_intensity;
+    fit_rt.reserve(fit_offsets.back());
+    fit_intensity.reserve(fit_offsets.back());
 
-      nts::merge_traces_within_rt(res_i.rt, res_i.mz, res_i.intensity);
+    for (int i = 0; i < n_j_targets; i++)
+    {
+      fit_rt.insert(fit_rt.end(), res[i].rt.begin(), res[i].rt.end());
+      fit_intensity.insert(fit_intensity.end(), res[i].intensity.begin(), res[i].intensity.end());
+    }
 
-      Rcpp::List quality = nts::calculate_gaussian_fit(id_i, res_i.rt, res_i.intensity, baseCut);
+    const nts::MS_FEATURES_QUALITY fit = nts::calculate_gaussian_fit(fit_offsets, fit_rt, fit_intensity, baseCut);
 
-      const float &sn = quality["sn"];
+    for (int i = 0; i < n_j_targets; i++)
+    {
 
-      const float &gauss_f = quality["gauss_f"];
+      const sc::MS_TARGETS_SPECTRA &res_i = res[i];
 
-      if (sn < minSignalToNoiseRatio)
+      if (fit.sn[i] < minSignalToNoiseRatio)
         continue;
 
-      if (gauss_f < minGaussianFit)
+      if (fit.gauss_f[i] < minGaussianFit)
         continue;
 
       const float area_i = nts::trapezoidal_area(res_i.rt, res_i.intensity);
@@ -1594,8 +1661,16 @@ Rcpp::List rcpp_ms_fill_features(Rcpp::List analyses,
       Rcpp::List list_eic;
       list_eic.push_back(eic);
 
+      Rcpp::List quality = Rcpp::List::create(
+          Rcpp::Named("feature") = feature,
+          Rcpp::Named("noise") = fit.noise[i],
+          Rcpp::Named("sn") = fit.sn[i],
+          Rcpp::Named("gauss_a") = fit.gauss_a[i],
+          Rcpp::Named("gauss_u") = fit.gauss_u[i],
+          Rcpp::Named("gauss_s") = fit.gauss_s[i],
+          Rcpp::Named("gauss_f") = fit.gauss_f[i]);
+
       Rcpp::List list_quality;
-      quality["feature"] = feature;
       quality.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
       list_quality.push_back(quality);
 
@@ -1675,6 +1750,10 @@ Rcpp::List rcpp_ms_calculate_features_quality(Rcpp::List analyses,
 
   std::vector<std::string> features_analyses_names = features.names();
 
+  std::vector<nts::MS_ANALYSIS_TARGETS> analyses_targets(number_analyses);
+
+  std::vector<std::vector<int>> features_targets(number_analyses);
+
   for (int i = 0; i < number_analyses; i++)
   {
     if (features_analyses_names[i] != analyses_names[i])
@@ -1716,27 +1795,23 @@ Rcpp::List rcpp_ms_calculate_features_quality(Rcpp::List analyses,
     const std::vector<std::string> &fts_id = features_i["feature"];
     const std::vector<bool> &fts_filtered = features_i["filtered"];
     const std::vector<int> &fts_polarity = features_i["polarity"];
-    const std::vector<float> &fts_rt = features_i["rt"];
     const std::vector<float> &fts_rtmin = features_i["rtmin"];
     const std::vector<float> &fts_rtmax = features_i["rtmax"];
-    const std::vector<float> &fts_mz = features_i["mz"];
     const std::vector<float> &fts_mzmin = features_i["mzmin"];
     const std::vector<float> &fts_mzmax = features_i["mzmax"];
-    const std::vector<float> &fts_intensity = features_i["intensity"];
 
-    std::vector<Rcpp::List> fts_quality = features_i["quality"];
-    std::vector<Rcpp::List> fts_eic = features_i["eic"];
+    const std::vector<Rcpp::List> fts_quality = features_i["quality"];
+    const std::vector<Rcpp::List> fts_eic = features_i["eic"];
 
     const int n_features = fts_id.size();
 
     if (n_features == 0)
       return features;
 
-    sc::MS_TARGETS targets;
-
-    std::vector<bool> has_quality(n_features, false);
+    sc::MS_TARGETS &targets = analyses_targets[i].targets;
 
-    std::vector<bool> has_eic(n_features, false);
+    // -1 has quality or is filtered, -2 has eic, otherwise the target index
+    features_targets[i].resize(n_features, -1);
 
     int counter = 0;
     for (int j = 0; j < n_features; j++)
@@ -1747,10 +1822,7 @@ Rcpp::List rcpp_ms_calculate_features_quality(Rcpp::List analyses,
       const int n_quality = quality.size();
 
       if (n_quality > 0)
-      {
-        has_quality[j] = true;
         continue;
-      }
 
       if (!filtered)
         if (fts_filtered[j])
@@ -1762,10 +1834,11 @@ Rcpp::List rcpp_ms_calculate_features_quality(Rcpp::List analyses,
 
       if (n_eic > 0)
       {
-        has_eic[j] = true;
+        features_targets[i][j] = -2;
         continue;
       }
 
+      features_targets[i][j] = counter;
       targets.index.push_back(counter);
       counter++;
       targets.id.push_back(fts_id[j]);
@@ -1784,85 +1857,309 @@ Rcpp::List rcpp_ms_calculate_features_quality(Rcpp::List analyses,
       continue;
 
     const Rcpp::List &analysis = analyses[i];
+    const std::string file = analysis["file"];
+    analyses_targets[i].file = file;
+    analyses_targets[i].headers = nts::get_ms_analysis_list_headers(analysis);
+  }
 
-    const sc::MS_SPECTRA_HEADERS headers = nts::get_ms_analysis_list_headers(analysis);
+  nts::extract_analyses_targets(analyses_targets, minTracesIntensity, 0, true);
 
-    const std::string file = analysis["file"];
+  // EICs with enough traces are packed in CSR for a single parallel fit over all analyses
+  std::vector<int64_t> fit_offsets = {0};
+  std::vector<float> fit_rt;
+  std::vector<float> fit_intensity;
+  std::vector<std::vector<int>> features_fit(number_analyses);
+
+  std::vector<std::vector<Rcpp::List>> analyses_eic(number_analyses);
+
+  for (int i = 0; i < number_analyses; i++)
+  {
 
-    if (!std::filesystem::exists(file))
+    if (analyses_targets[i].targets.id.size() == 0)
       continue;
 
-    sc::MS_FILE ana(file);
+    if (!std::filesystem::exists(analyses_targets[i].file))
+      continue;
+
+    const Rcpp::List &features_i = features[i];
+
+    const std::vector<std::string> &fts_id = features_i["feature"];
+    std::vector<Rcpp::List> fts_eic = features_i["eic"];
+
+    const int n_features = fts_id.size();
 
-    sc::MS_TARGETS_SPECTRA res = ana.get_spectra_targets(targets, headers, minTracesIntensity, 0);
+    features_fit[i].resize(n_features, -1);
 
     for (int j = 0; j < n_features; j++)
     {
 
-      if (has_quality[j])
-        continue;
+      const int t = features_targets[i][j];
 
-      if (!filtered)
-        if (fts_filtered[j])
-          continue;
+      if (t == -1)
+        continue;
 
       const std::string &id_j = fts_id[j];
 
       std::vector<float> rt;
-      std::vector<float> mz;
       std::vector<float> intensity;
 
-      if (has_eic[j])
+      if (t == -2)
       {
         const Rcpp::List &eic = fts_eic[j];
         const std::vector<float> &rt_ref = eic["rt"];
-        const std::vector<float> &mz_ref = eic["mz"];
         const std::vector<float> &intensity_ref = eic["intensity"];
         rt = rt_ref;
-        mz = mz_ref;
         intensity = intensity_ref;
       }
       else
       {
-        sc::MS_TARGETS_SPECTRA res_j = res[id_j];
+        const sc::MS_TARGETS_SPECTRA &res_j = analyses_targets[i].spectra[t];
         rt = res_j.rt;
-        mz = res_j.mz;
         intensity = res_j.intensity;
-        nts::merge_traces_within_rt(rt, mz, intensity);
         Rcpp::List eic = Rcpp::List::create(
             Rcpp::Named("feature") = id_j,
             Rcpp::Named("polarity") = res_j.polarity,
             Rcpp::Named("level") = res_j.level,
-            Rcpp::Named("rt") = rt,
-            Rcpp::Named("mz") = mz,
-            Rcpp::Named("intensity") = intensity);
+            Rcpp::Named("rt") = res_j.rt,
+            Rcpp::Named("mz") = res_j.mz,
+            Rcpp::Named("intensity") = res_j.intensity);
         eic.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
         fts_eic[j] = eic;
       }
 
-      Rcpp::List quality = Rcpp::List::create(
-          Rcpp::Named("feature") = id_j,
-          Rcpp::Named("noise") = 0,
-          Rcpp::Named("sn") = 0,
-          Rcpp::Named("gauss_a") = 0,
-          Rcpp::Named("gauss_u") = 0,
-          Rcpp::Named("gauss_s") = 0,
-          Rcpp::Named("gauss_f") = 0);
-
       const int n = rt.size();
 
       if (n > minNumberTraces)
-        quality = nts::calculate_gaussian_fit(id_j, rt, intensity, baseCut);
+      {
+        features_fit[i][j] = fit_offsets.size() - 1;
+        fit_rt.insert(fit_rt.end(), rt.begin(), rt.end());
+        fit_intensity.insert(fit_intensity.end(), intensity.begin(), intensity.end());
+        fit_offsets.push_back(fit_rt.size());
+      }
+    }
+
+    analyses_eic[i] = fts_eic;
+  }
+
+  const nts::MS_FEATURES_QUALITY fit = nts::calculate_gaussian_fit(fit_offsets, fit_rt, fit_intensity, baseCut);
+
+  for (int i = 0; i < number_analyses; i++)
+  {
+
+    if (features_fit[i].size() == 0)
+      continue;
+
+    Rcpp::List features_i = features[i];
+
+    const std::vector<std::string> &fts_id = features_i["feature"];
+    std::vector<Rcpp::List> fts_quality = features_i["quality"];
+
+    const int n_features = fts_id.size();
+
+    for (int j = 0; j < n_features; j++)
+    {
+
+      if (features_targets[i][j] == -1)
+        continue;
+
+      const std::string &id_j = fts_id[j];
+
+      const int k = features_fit[i][j];
+
+      Rcpp::List quality;
+
+      if (k >= 0)
+      {
+        quality = Rcpp::List::create(
+            Rcpp::Named("feature") = id_j,
+            Rcpp::Named("noise") = fit.noise[k],
+            Rcpp::Named("sn") = fit.sn[k],
+            Rcpp::Named("gauss_a") = fit.gauss_a[k],
+            Rcpp::Named("gauss_u") = fit.gauss_u[k],
+            Rcpp::Named("gauss_s") = fit.gauss_s[k],
+            Rcpp::Named("gauss_f") = fit.gauss_f[k]);
+      }
+      else
+      {
+        quality = Rcpp::List::create(
+            Rcpp::Named("feature") = id_j,
+            Rcpp::Named("noise") = 0,
+            Rcpp::Named("sn") = 0,
+            Rcpp::Named("gauss_a") = 0,
+            Rcpp::Named("gauss_u") = 0,
+            Rcpp::Named("gauss_s") = 0,
+            Rcpp::Named("gauss_f") = 0);
+      }
 
       quality.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
 
       fts_quality[j] = quality;
     }
 
-    features_i["eic"] = fts_eic;
+    features_i["eic"] = analyses_eic[i];
     features_i["quality"] = fts_quality;
     features[i] = features_i;
   }
 
   return features;
 };
+
+// MARK: rcpp_ms_calculate_spectra_charges
+// [[Rcpp::export]]
+Rcpp::List rcpp_ms_calculate_spectra_charges(Rcpp::List spectra, double roundVal = 35, double relLowCut = 0.2, double absLowCut = 300)
+{
+  const int number_spectra = spectra.size();
+
+  std::vector<std::vector<double>> mz(number_spectra);
+  std::vector<std::vector<double>> intensity(number_spectra);
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    Rcpp::List spectrum = spectra[i];
+
+    if (spectrum.size() == 0)
+      continue;
+
+    const std::vector<std::string> cols = spectrum.names();
+
+    if (std::find(cols.begin(), cols.end(), "mz") == cols.end() || std::find(cols.begin(), cols.end(), "intensity") == cols.end())
+      throw std::runtime_error("The spectra must have the columns mz and intensity!");
+
+    mz[i] = Rcpp::as<std::vector<double>>(spectrum["mz"]);
+    intensity[i] = Rcpp::as<std::vector<double>>(spectrum["intensity"]);
+  }
+
+  std::vector<nts::MS_SPECTRUM_CHARGES> charges(number_spectra);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < number_spectra; i++)
+    charges[i] = nts::calculate_spectrum_charges(mz[i], intensity[i], roundVal, relLowCut, absLowCut);
+
+  Rcpp::List list_out(number_spectra);
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    // idx is the 1-based row of the spectrum at the apex of each charge
+    std::vector<int> idx = charges[i].idx;
+    for (int &k : idx)
+      k++;
+
+    Rcpp::List charges_i = Rcpp::List::create(
+        Rcpp::Named("idx") = idx,
+        Rcpp::Named("cluster") = charges[i].cluster,
+        Rcpp::Named("z") = charges[i].z,
+        Rcpp::Named("mass") = charges[i].mass,
+        Rcpp::Named("z_step") = charges[i].z_step);
+
+    charges_i.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+
+    list_out[i] = charges_i;
+  }
+
+  list_out.names() = spectra.names();
+
+  return list_out;
+};
+
+// MARK: rcpp_ms_deconvolute_spectra
+// [[Rcpp::export]]
+Rcpp::List rcpp_ms_deconvolute_spectra(Rcpp::List spectra, Rcpp::List charges, double clustVal = 0.1, double window = 20)
+{
+  const int number_spectra = spectra.size();
+
+  if (charges.size() != number_spectra)
+    throw std::runtime_error("The spectra and charges must have the same length!");
+
+  const std::vector<std::string> must_have_names = {"id", "polarity", "rt", "mz", "intensity"};
+
+  std::vector<std::vector<double>> rt(number_spectra);
+  std::vector<std::vector<double>> mz(number_spectra);
+  std::vector<std::vector<double>> intensity(number_spectra);
+  std::vector<std::vector<double>> pre_ce(number_spectra);
+  std::vector<std::vector<double>> pre_mz(number_spectra);
+  std::vector<std::vector<double>> charge_mz(number_spectra);
+  std::vector<std::vector<double>> charge_z(number_spectra);
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    Rcpp::List spectrum = spectra[i];
+    Rcpp::List charges_i = charges[i];
+
+    if (spectrum.size() == 0 || charges_i.size() == 0)
+      continue;
+
+    const std::vector<std::string> cols = spectrum.names();
+
+    for (const std::string &name : must_have_names)
+      if (std::find(cols.begin(), cols.end(), name) == cols.end())
+        throw std::runtime_error("The spectra must have the columns id, polarity, rt, mz and intensity!");
+
+    const std::vector<std::string> charges_cols = charges_i.names();
+
+    if (std::find(charges_cols.begin(), charges_cols.end(), "mz") == charges_cols.end() || std::find(charges_cols.begin(), charges_cols.end(), "z") == charges_cols.end())
+      throw std::runtime_error("The charges must have the columns mz and z!");
+
+    rt[i] = Rcpp::as<std::vector<double>>(spectrum["rt"]);
+    mz[i] = Rcpp::as<std::vector<double>>(spectrum["mz"]);
+    intensity[i] = Rcpp::as<std::vector<double>>(spectrum["intensity"]);
+
+    // without collision energies all traces are taken as from the same energy
+    if (std::find(cols.begin(), cols.end(), "pre_ce") != cols.end())
+      pre_ce[i] = Rcpp::as<std::vector<double>>(spectrum["pre_ce"]);
+
+    if (std::find(cols.begin(), cols.end(), "pre_mz") != cols.end())
+      pre_mz[i] = Rcpp::as<std::vector<double>>(spectrum["pre_mz"]);
+
+    charge_mz[i] = Rcpp::as<std::vector<double>>(charges_i["mz"]);
+    charge_z[i] = Rcpp::as<std::vector<double>>(charges_i["z"]);
+  }
+
+  std::vector<nts::MS_CLUSTERED_SPECTRUM<double>> deconvoluted(number_spectra);
+  std::vector<int> first(number_spectra, -1);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < number_spectra; i++)
+    deconvoluted[i] = nts::deconvolute_spectrum(rt[i], mz[i], intensity[i], pre_ce[i], pre_mz[i], charge_mz[i], charge_z[i], clustVal, window, first[i]);
+
+  Rcpp::List list_out(number_spectra);
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    const nts::MS_CLUSTERED_SPECTRUM<double> &res = deconvoluted[i];
+
+    if (res.size() == 0)
+    {
+      list_out[i] = Rcpp::DataFrame::create();
+      continue;
+    }
+
+    Rcpp::List spectrum = spectra[i];
+    const std::vector<std::string> id = spectrum["id"];
+    const std::vector<int> polarity = spectrum["polarity"];
+
+    if (!std::isnan(res.pre_mz))
+    {
+      list_out[i] = Rcpp::DataFrame::create(
+          Rcpp::Named("id") = id[first[i]],
+          Rcpp::Named("polarity") = polarity[first[i]],
+          Rcpp::Named("pre_mz") = res.pre_mz,
+          Rcpp::Named("rt") = res.rt,
+          Rcpp::Named("mass") = res.mz,
+          Rcpp::Named("intensity") = res.intensity,
+          Rcpp::Named("is_pre") = res.is_pre);
+    }
+    else
+    {
+      list_out[i] = Rcpp::DataFrame::create(
+          Rcpp::Named("id") = id[first[i]],
+          Rcpp::Named("polarity") = polarity[first[i]],
+          Rcpp::Named("rt") = res.rt,
+          Rcpp::Named("mass") = res.mz,
+          Rcpp::Named("intensity") = res.intensity);
+    }
+  }
+
+  list_out.names() = spectra.names();
+
+  return list_out;
+};
@@ -7,241 +7,150 @@
 #include <sstream>
 #include <iomanip>
 #include <cmath>
+#include <unordered_map>
+#include <limits>
 #include <Rcpp.h>
+#include "NTS_utils.h"
 
-double round_to(double value, int decimals) {
-  double factor = std::pow(10.0, decimals);
-  return std::round(value * factor) / factor;
-}
-
-// Utility function to create an ordered index based on a vector
-std::vector<int> order_index(const std::vector<float>& x) {
-  int n = x.size();
-  std::vector<int> idx(n);
-  // for (int i = 0; i < n; i++) idx[i] = i;
-  std::iota(idx.begin(), idx.end(), 0);
-  
-  std::sort(idx.begin(), idx.end(), [&](int i, int j) {
-    return x[i] < x[j];
-  });
-  
-  // double tol = 1e-9;
-  // 
-  // std::stable_sort(idx.begin(), idx.end(), [&](int i, int j) {
-  //   // Compare with tolerance to handle precision issues
-  //   return (std::fabs(x[i] - x[j]) > tol) ? (x[i] < x[j]) : (i < j);
-  // });
-  
-  return idx;
-}
-
-// Function to compute mass clusters using sorted indices
-std::vector<float> compute_mass_clusters(const std::vector<int>& mass_order,
-                                          const std::vector<float>& mass,
-                                          const std::vector<float>& massmax) {
-  int n = mass_order.size();
-  std::vector<float> massclust(n, 0.0);
-  
-  for (int i = 1; i < n; ++i) {
-    int curr_idx = mass_order[i];
-    int prev_idx = mass_order[i - 1];
-    
-    if (mass[curr_idx] < massmax[prev_idx]) {
-      massclust[curr_idx] = massclust[prev_idx];
-    } else {
-      massclust[curr_idx] = massclust[prev_idx] + 1;
+// [[Rcpp::export]]
+Rcpp::List rcpp_ms_group_features(Rcpp::DataFrame features, float rt_dev = 10, float mass_dev = 0.005, bool verbose = false) {
+  
+  const std::vector<std::string> must_have_names = {"analysis", "mass", "rt", "intensity"};
+  
+  const std::vector<std::string> features_cols = features.names();
+  
+  for (const std::string& name : must_have_names) {
+    if (std::find(features_cols.begin(), features_cols.end(), name) == features_cols.end()) {
+      throw std::runtime_error("Features DataFrame does not have all required columns!");
     }
   }
-  return massclust;
-}
-
-// Function to compute RT clusters using sorted indices
-std::vector<float> compute_rt_clusters(const std::vector<int>& rt_order,
-                                       const std::vector<float>& rt,
-                                       const float& rt_dev) {
-  int n = rt_order.size();
-  std::vector<float> rtclust(n, 0.0);
-  
-  float rtmax_i = rt[rt_order[0]] + rt_dev;
-  
-  for (int i = 1; i < n; ++i) {
-    int curr_idx = rt_order[i];
-    int prev_idx = rt_order[i - 1];
-    
-    if (rt[curr_idx] < rtmax_i) {
-      rtclust[curr_idx] = rtclust[prev_idx];
-    } else {
-      rtclust[curr_idx] = rtclust[prev_idx] + 1;
-      rtmax_i = rt[curr_idx] + rt_dev;
-    }
+  
+  const std::vector<std::string> analysis = features["analysis"];
+  const std::vector<float> mass = features["mass"];
+  const std::vector<float> rt = features["rt"];
+  const std::vector<float> intensity = features["intensity"];
+  
+  const int n = mass.size();
+  
+  // analyses are integer coded once, the engine only compares codes
+  std::unordered_map<std::string, int> analysis_codes;
+  std::vector<int> analysis_code(n);
+  
+  for (int i = 0; i < n; ++i) {
+    analysis_code[i] = analysis_codes.emplace(analysis[i], analysis_codes.size()).first->second;
   }
-  return rtclust;
+  
+  const std::vector<int> group = nts::group_features(analysis_code, mass, rt, intensity, mass_dev, rt_dev);
+  
+  if (verbose) {
+    const int number_groups = n > 0 ? *std::max_element(group.begin(), group.end()) : 0;
+    Rcpp::Rcout << "Grouped " << n << " features from " << analysis_codes.size()
+                << " analyses into " << number_groups << " feature groups" << std::endl;
+  }
+  
+  Rcpp::List out;
+  out["analysis"] = analysis;
+  out["mass"] = mass;
+  out["rt"] = rt;
+  out["intensity"] = intensity;
+  out["group"] = group;
+  out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+  
+  return out;
 }
 
 // [[Rcpp::export]]
-Rcpp::DataFrame rcpp_ms_group_features(Rcpp::DataFrame features, float rt_dev = 10, bool verbose = false) {
+Rcpp::List rcpp_ms_align_features_rt(Rcpp::DataFrame features, float min_presence = 0.5, float span = 0.3, bool verbose = false) {
+  
+  const std::vector<std::string> must_have_names = {"analysis", "group", "rt", "rtmin", "rtmax"};
+  
+  const std::vector<std::string> features_cols = features.names();
   
-  std::vector<float> mass = features["mass"];
-  const std::vector<float>& mz = features["mz"];
-  const std::vector<float>& mzmin = features["mzmin"];
-  const std::vector<float>& mzmax = features["mzmax"];
+  for (const std::string& name : must_have_names) {
+    if (std::find(features_cols.begin(), features_cols.end(), name) == features_cols.end()) {
+      throw std::runtime_error("Features DataFrame does not have all required columns!");
+    }
+  }
+  
+  const std::vector<std::string> analysis = features["analysis"];
+  const std::vector<int> group = features["group"];
   std::vector<float> rt = features["rt"];
-  const std::vector<float>& rtmax = features["rtmax"];
-  const std::vector<float>& rtmin = features["rtmin"];
-  const std::vector<float>& intensity = features["intensity"];
+  std::vector<float> rtmin = features["rtmin"];
+  std::vector<float> rtmax = features["rtmax"];
   
-  int n = mass.size();
-
-  std::vector<int> mass_order = order_index(mass);  
+  const int n = rt.size();
   
-  std::vector<float> massmax(n);
+  std::unordered_map<std::string, int> analysis_codes;
+  std::vector<std::string> analysis_names;
+  std::vector<int> analysis_code(n);
   
-  for (int i = 0; i < n; ++i) massmax[i] = mzmax[i] - mzmin[i] + mass[i];
+  for (int i = 0; i < n; ++i) {
+    const auto it = analysis_codes.emplace(analysis[i], analysis_names.size());
+    if (it.second) analysis_names.push_back(analysis[i]);
+    analysis_code[i] = it.first->second;
+  }
   
-  std::vector<float> massclust = compute_mass_clusters(mass_order, mass, massmax);
+  const int number_analyses = analysis_names.size();
   
-  std::vector<int> rt_order = order_index(rt);
+  const std::vector<nts::MS_RT_WARP> warps = nts::align_rt(analysis_code, rt, group, number_analyses, min_presence, span);
   
-  std::vector<float> rtclust = compute_rt_clusters(rt_order, rt, rt_dev);
+  const std::vector<float> rt_raw = rt;
   
   for (int i = 0; i < n; ++i) {
-    massclust[i] += 1;
-    rtclust[i] += 1;
+    const nts::MS_RT_WARP& warp = warps[analysis_code[i]];
+    rt[i] = warp(rt[i]);
+    rtmin[i] = warp(rtmin[i]);
+    rtmax[i] = warp(rtmax[i]);
   }
   
-  // std::vector<float> rtmax2(n);
-  // 
-  // for (int i = 0; i < n; ++i) {
-  //   rtmax2[i] = ((rtmax[i] - rtmin[i]) / 3) + rt[i];
-  // }
-  // 
-  // std::vector<float> rtclust = compute_rt_clusters(rt_order, rt, rtmax2);
-  // 
-  // std::vector<double> new_mass(n);
-  // std::vector<double> new_rt(n);
-  // 
-  // for (int i = 0; i < n; ++i) {
-  //   new_mass[i] = mass[mass_order[i]];
-  //   new_rt[i] = rt[rt_order[i]];
-  // }
-  // 
-  std::vector<std::string> group2(n);
-  for (int i = 0; i < n; ++i) {
-    group2[i] = std::to_string((int)massclust[i]) + "_" + std::to_string((int)rtclust[i]);
+  // the warps are returned as knots so that other retention times, e.g. of spectra headers, are only aligned when needed
+  std::vector<std::string> warps_analysis;
+  std::vector<float> warps_rt_raw;
+  std::vector<float> warps_rt_aligned;
+  
+  for (int a = 0; a < number_analyses; ++a) {
+    if (verbose && warps[a].rt_raw.empty()) {
+      Rcpp::Rcout << "Not enough landmark feature groups to align " << analysis_names[a] << std::endl;
+    }
+    for (size_t k = 0; k < warps[a].rt_raw.size(); ++k) {
+      warps_analysis.push_back(analysis_names[a]);
+      warps_rt_raw.push_back(warps[a].rt_raw[k]);
+      warps_rt_aligned.push_back(warps[a].rt_aligned[k]);
+    }
   }
   
-  // Return as a new dataframe with added columns
-  return Rcpp::DataFrame::create(
-    // Rcpp::Named("mass_order") = mass_order,
-    // Rcpp::Named("mass_1") = new_mass,
-    Rcpp::Named("mass") = mass,
-    // Rcpp::Named("massmax_2") = massmax,
-    Rcpp::Named("massclust") = massclust,
-    // Rcpp::Named("rt_order") = rt_order,
-    // Rcpp::Named("rt_1") = new_rt,
-    Rcpp::Named("rt") = rt,
-    // Rcpp::Named("rtmax_2") = rtmax2,
-    Rcpp::Named("rtclust") = rtclust,
-    Rcpp::Named("intensity") = intensity,
-    Rcpp::Named("group2") = group2
-  );
-  
-  // // Step 4: Create index sorted by retention time (rt)
-  // std::vector<int> rt_order = order_index(rt);
-  
-  // // Step 5: Compute RT clusters
-  // std::vector<float> rtclust = compute_rt_clusters(rt_order, rt, rtmax);
-  
-  // // Step 1: Create index sorted by mass
-  // std::vector<int> mass_order = order_index(mass);
-  
-  // // Step 2: Compute mass difference and massdev
-  // std::vector<float> massmax(n);
-  // 
-  // for (int i = 0; i < n; ++i) {
-  //   massmax[i] = mzmax[i] - mzmin[i] + mass[i];
-  // }
-  
-  // massdiff[mass_order[0]] = 0;  // First difference is 0
-  // for (int i = 1; i < n; ++i) {
-  //   massdiff[mass_order[i]] = mass[mass_order[i]] - mass[mass_order[i - 1]];
-  // }
-  
-  // // Step 3: Compute mass clusters using the sorted mass order
-  // std::vector<float> massclust = compute_mass_clusters(mass_order, mass, massmax);
-  // 
-  // // Step 6: Create final group2 (combining massclust and rtclust)
-  // std::vector<std::string> group2(n);
-  // for (int i = 0; i < n; ++i) {
-  //   group2[i] = std::to_string((int)massclust[i]) + "_" + std::to_string((int)rtclust[i]);
-  // }
-  
-  // Return the updated dataframe
-  // return features;
-  
-  // const std::vector<std::string> features_cols = features.names();
-  // 
-  // const int n_features = features.nrows();
-  // 
-  // const int n_features_cols = features_cols.size();
-  // 
-  // if (n_features == 0 || n_features_cols == 0) {
-  //   throw std::runtime_error("Features DataFrame is empty!");
-  // }
-  // 
-  // const std::vector<std::string> must_have_names = {
-  //   "feature", "analysis", "rt", "rtmax", "rtmin",
-  //   "mass", "mz", "mzmax", "mzmin", "intensity"
-  // };
-  // 
-  // const int n_must_have_names = must_have_names.size();
-  // 
-  // std::vector<bool> has_must_have_names(n_must_have_names, false);
-  // 
-  // for (size_t i = 0; i < must_have_names.size(); ++i) {
-  //   for (size_t j = 0; j < features_cols.size(); ++j) {
-  //     if (must_have_names[i] == features_cols[j]) has_must_have_names[i] = true;
-  //   }
-  // }
-  // 
-  // for (bool value : has_must_have_names) {
-  //   if (!value) {
-  //     throw std::runtime_error("Features DataFrame does not have all required columns!");
-  //   }
-  // }
-  // 
-  // std::vector<int> idx(n_features);
-  // std::iota(all_idx.begin(), idx.end(), 0);
-  // 
-  // const std::vector<float>& mass = features["mass"];
-  // const float* all_mass_ptr = mass.data();
-  // 
-  // const std::vector<float>& mzmin = features["mzmin"];
-  // const float* all_mzmin_ptr = mzmin.data();
-  // 
-  // const std::vector<float>& mzmax = features["mzmax"];
-  // const float* all_mzmax_ptr = mzmax.data();
-  // 
-  // const std::vector<float>& rt = features["rt"];
-  // const float* all_rt_ptr = mzmax.data();
-  // 
-  // const std::vector<float>& rtmin = features["rtmin"];
-  // const float* all_rtmin_ptr = rtmin.data();
-  // 
-  // const std::vector<float>& rtmax = features["rtmax"];
-  // const float* all_rtmax_ptr = rtmax.data();
-  // 
-  // const std::vector<float>& intensity = features["intensity"];
-  // const float* all_intensity_ptr = intensity.data();
-  // 
-  // std::vector<float> mass_dev(0, n_features);
-  // 
-  // for (int i = 0; i < n_features; i++) {
-  //   mass_dev[i] = mzmax[i] - mzmin[i];
-  // }
-  // 
-  // std::vector<float> mass_clust(0, n_features);
-  // std::vector<float> rt_clust(0, n_features);
+  Rcpp::List features_out;
+  features_out["analysis"] = analysis;
+  features_out["group"] = group;
+  features_out["rt_raw"] = rt_raw;
+  features_out["rt"] = rt;
+  features_out["rtmin"] = rtmin;
+  features_out["rtmax"] = rtmax;
+  features_out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+  
+  Rcpp::List warps_out;
+  warps_out["analysis"] = warps_analysis;
+  warps_out["rt_raw"] = warps_rt_raw;
+  warps_out["rt_aligned"] = warps_rt_aligned;
+  warps_out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+  
+  Rcpp::List out;
+  out["features"] = features_out;
+  out["warps"] = warps_out;
+  
+  return out;
+}
+
+// [[Rcpp::export]]
+std::vector<float> rcpp_ms_warp_rt(std::vector<float> rt, std::vector<float> rt_raw, std::vector<float> rt_aligned) {
+  
+  nts::MS_RT_WARP warp;
+  warp.rt_raw = rt_raw;
+  warp.rt_aligned = rt_aligned;
+  warp.validate();
+  warp.apply(rt);
+  
+  return rt;
 }
 
 // [[Rcpp::export]]
@@ -299,135 +208,115 @@ bool rcpp_ms_groups_correspondence(Rcpp::DataFrame groups,
   }
   
   const std::vector<std::string>& all_feature_group = features["group"];
-  
   const std::vector<std::string>& all_analysis = features["analysis"];
-  const std::string* all_analysis_ptr = all_analysis.data();
-  
   const std::vector<double>& all_rtmin = features["rtmin"];
-  const double* all_rtmin_ptr = all_rtmin.data();
-  
   const std::vector<double>& all_rtmax = features["rtmax"];
-  const double* all_rtmax_ptr = all_rtmax.data();
-  
   const std::vector<double>& all_mass = features["mass"];
-  const double* all_mass_ptr = all_mass.data();
-  
   const std::vector<double>& all_mz = features["mz"];
-  const double* all_mz_ptr = all_mz.data();
-  
   const std::vector<double>& all_mzmin = features["mzmin"];
-  const double* all_mzmin_ptr = all_mzmin.data();
-  
   const std::vector<double>& all_mzmax = features["mzmax"];
-  const double* all_mzmax_ptr = all_mzmax.data();
-  
   const std::vector<double>& all_intensity = features["intensity"];
-  const double* all_intensity_ptr = all_intensity.data();
-  
-  std::vector<std::string> all_group = groups["group"];
   
-  std::vector<double> all_group_rt = groups["rt"];
-  
-  std::vector<double> all_group_mass = groups["mass"];
+  const std::vector<std::string> all_group = groups["group"];
+  const std::vector<double> all_group_rt = groups["rt"];
+  const std::vector<double> all_group_mass = groups["mass"];
   
   const int number_of_features = features.nrows();
   
   const int number_of_groups = groups.nrows();
   
-  std::string* g_id;
+  std::unordered_map<std::string, int> group_index;
+  group_index.reserve(number_of_groups);
   
-  double* g_rt;
+  for (int i = 0; i < number_of_groups; ++i) group_index.emplace(all_group[i], i);
   
-  double* g_mass;
+  // features of each group in CSR, filled in a single pass over the features
+  std::vector<int> feature_group(number_of_features, -1);
+  std::vector<int> offsets(number_of_groups + 1, 0);
   
-  std::string* ana;
+  for (int z = 0; z < number_of_features; ++z) {
+    const auto it = group_index.find(all_feature_group[z]);
+    if (it == group_index.end()) continue;
+    feature_group[z] = it->second;
+    offsets[it->second + 1]++;
+  }
   
-  for (int i=0; i<number_of_groups; ++i) {
-    
-    g_id = &all_group[i];
-    
-    g_rt = &all_group_rt[i];
-    
-    g_mass = &all_group_mass[i];
-    
-    std::vector<int> which_idx;
-    
-    for (int z=0; z<number_of_features; z++) {
-      if (all_feature_group[z] == *g_id) which_idx.push_back(z);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  
+  std::vector<int> bucket(offsets.back());
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  
+  for (int z = 0; z < number_of_features; ++z) {
+    if (feature_group[z] >= 0) bucket[fill[feature_group[z]]++] = z;
+  }
+  
+  // intensity columns of the groups are resolved once per analysis
+  std::unordered_map<std::string, int> analysis_index;
+  std::vector<std::vector<double>> analysis_intensity;
+  std::vector<int> feature_analysis(number_of_features, -1);
+  
+  for (int z = 0; z < number_of_features; ++z) {
+    if (feature_group[z] < 0) continue;
+    const auto it = analysis_index.emplace(all_analysis[z], analysis_intensity.size());
+    if (it.second) {
+      if (std::find(groups_cols.begin(), groups_cols.end(), all_analysis[z]) == groups_cols.end()) {
+        throw std::runtime_error("Groups DataFrame does not have an intensity column for analysis " + all_analysis[z] + "!");
+      }
+      const std::vector<double> g_intensity = groups[all_analysis[z]];
+      analysis_intensity.push_back(g_intensity);
     }
+    feature_analysis[z] = it.first->second;
+  }
+  
+  for (int i = 0; i < number_of_groups; ++i) {
     
-    const int n_idx = which_idx.size();
-    
-    std::vector<std::string> analysis(n_idx);
-    std::string* analysis_ptr = analysis.data();
-    
-    
-    std::vector<double> rtmin(n_idx);
-    double* rtmin_ptr = rtmin.data();
-    
-    std::vector<double> rtmax(n_idx);
-    double* rtmax_ptr = rtmax.data();
-    
-    std::vector<double> mass(n_idx);
-    double* mass_ptr = mass.data();
-    
-    std::vector<double> massmin(n_idx);
-    double* massmin_ptr = massmin.data();
-    
-    std::vector<double> massmax(n_idx);
-    double* massmax_ptr = massmax.data();
-    
-    std::vector<double> intensity(n_idx);
-    double* intensity_ptr = intensity.data();
+    const std::string& g_id = all_group[i];
     
-    for (const int& x : which_idx) {
-      *(analysis_ptr++) = *(all_analysis_ptr + x);
-      *(rtmin_ptr++) = *(all_rtmin_ptr + x);
-      *(rtmax_ptr++) = *(all_rtmax_ptr + x);
-      *(mass_ptr++) = *(all_mass_ptr + x);
-      *(massmin_ptr++) = *(all_mass_ptr + x) - (*(all_mz_ptr + x) - *(all_mzmin_ptr + x));
-      *(massmax_ptr++) = *(all_mass_ptr + x) + (*(all_mzmax_ptr + x) - *(all_mz_ptr + x));
-      *(intensity_ptr++) = *(all_intensity_ptr + x);
+    if (offsets[i] == offsets[i + 1]) {
+      Rcpp::Rcout << "\n !! The feature group " << g_id << " (n " << i << ")"
+                  << " does not have features!! \n";
+      
+      valid = false;
+      continue;
     }
     
+    double rtmin_val = std::numeric_limits<double>::max();
+    double rtmax_val = std::numeric_limits<double>::lowest();
+    double massmin_val = std::numeric_limits<double>::max();
+    double massmax_val = std::numeric_limits<double>::lowest();
     
-    auto rtmin_val = std::min_element(rtmin.begin(), rtmin.end());
-    auto rtmax_val = std::max_element(rtmax.begin(), rtmax.end());
+    for (int k = offsets[i]; k < offsets[i + 1]; ++k) {
+      const int x = bucket[k];
+      rtmin_val = std::min(rtmin_val, all_rtmin[x]);
+      rtmax_val = std::max(rtmax_val, all_rtmax[x]);
+      massmin_val = std::min(massmin_val, all_mass[x] - (all_mz[x] - all_mzmin[x]));
+      massmax_val = std::max(massmax_val, all_mass[x] + (all_mzmax[x] - all_mz[x]));
+    }
     
-    if (*g_rt > *rtmax_val + 2 || *g_rt < *rtmin_val - 2) {
-      Rcpp::Rcout << "\n !! The feature group " << *g_id << " (n " << i << ")"
+    if (all_group_rt[i] > rtmax_val + 2 || all_group_rt[i] < rtmin_val - 2) {
+      Rcpp::Rcout << "\n !! The feature group " << g_id << " (n " << i << ")"
                   << " does not match retention time range in features!! \n";
       
       valid = false;
     }
     
-    auto massmin_val = std::min_element(massmin.begin(), massmin.end());
-    auto massmax_val = std::max_element(massmax.begin(), massmax.end());
-    
-    if (*g_mass > *massmax_val + 0.0005 || *g_mass < *massmin_val - 0.0005) {
-      Rcpp::Rcout << "\n !! The feature group " << *g_id << " (n " << i << ")"
+    if (all_group_mass[i] > massmax_val + 0.0005 || all_group_mass[i] < massmin_val - 0.0005) {
+      Rcpp::Rcout << "\n !! The feature group " << g_id << " (n " << i << ")"
                   << " does not match mass range in features!! \n";
       
       valid = false;
     }
     
-    for (int t = 0; t < n_idx; t++) {
-      
-      ana = &analysis[t];
-      
-      const std::vector<double>& g_intensity = groups[*ana];
-      
-      double g_int = g_intensity[i];
-      
-      g_int = std::round(g_int / 1) * 1;
+    for (int k = offsets[i]; k < offsets[i + 1]; ++k) {
+      const int x = bucket[k];
       
-      double f_int = intensity[t];
+      const double g_int = std::round(analysis_intensity[feature_analysis[x]][i]);
       
-      f_int = std::round(f_int / 1) * 1;
+      const double f_int = std::round(all_intensity[x]);
       
       if (g_int != f_int) {
-        Rcpp::Rcout << "\n !! The feature group " << *g_id << " (n " << i << ")"
-                    << " does not match intensity in feature from analysis " << *ana << "! \n";
+        Rcpp::Rcout << "\n !! The feature group " << g_id << " (n " << i << ")"
+                    << " does not match intensity in feature from analysis " << all_analysis[x] << "! \n";
         
         valid = false;
       }
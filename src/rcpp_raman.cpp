@@ -1,22 +1,19 @@
 #include <Rcpp.h>
 #include <fstream>
-#include <sstream>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <cctype>
 #include <map>
 #include <iterator>
+#include <stdexcept>
+#include <charconv>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <omp.h>
 
 
-// Function to trim whitespace from both ends of a string
-std::string trim_whitespaces_before_and_after(const std::string& str) {
-  size_t first = str.find_first_not_of(" \t\n\r");
-  size_t last = str.find_last_not_of(" \t\n\r");
-  if (first < 100) std::string str_sub = str.substr(first, (last - first + 1));
-  return str;
-}
-
 std::string extractFileName(const std::string& filePath) {
   size_t lastSlash = filePath.find_last_of("/");
   std::string baseName = (lastSlash != std::string::npos) ? filePath.substr(lastSlash + 1) : filePath;
@@ -40,59 +37,124 @@ std::string extractFileExtension(const std::string& filePath) {
   return extension;
 }
 
-// [[Rcpp::export]]
-Rcpp::List rcpp_parse_asc_file(std::string file_path) {
-  
-  Rcpp::List list_out;
+// Parsed content of an .asc file, metadata in order of appearance and data by column
+struct RamanAscFile {
+  std::vector<std::string> metadata_keys;
+  std::vector<std::string> metadata_values;
+  std::vector<std::vector<double>> columns;
+};
+
+// Parses a number as std::stod would, skipping leading whitespace and ignoring trailing characters
+double parse_asc_number(const char* first, const char* last) {
+  while (first < last && (std::isspace(static_cast<unsigned char>(*first)) || *first == '+')) ++first;
+  double value = 0;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  if (std::from_chars(first, last, value).ec != std::errc()) {
+    throw std::runtime_error("Invalid number " + std::string(first, last) + " in the .asc file!");
+  }
+#else
+  const std::string token(first, last);
+  char* token_end = nullptr;
+  value = std::strtod(token.c_str(), &token_end);
+  if (token_end == token.c_str()) {
+    throw std::runtime_error("Invalid number " + token + " in the .asc file!");
+  }
+#endif
+  return value;
+}
+
+// Reads the whole file at once and parses it in a single pass over its lines. Lines with ":" are
+// metadata, lines with ";" are data rows read until the first token without digits.
+RamanAscFile read_asc_file(const std::string& file_path) {
   
-  std::string file_info = extractFileName(file_path);
+  RamanAscFile asc;
   
-  std::ifstream file(file_path);
+  std::ifstream file(file_path, std::ios::binary | std::ios::ate);
   
-  std::string line;
+  if (!file.is_open()) throw std::runtime_error("The file " + file_path + " could not be opened!");
   
-  Rcpp::List metadata_list;
+  std::string content(static_cast<size_t>(file.tellg()), '\0');
+  file.seekg(0);
+  file.read(&content[0], content.size());
   
-  std::vector<std::vector<double>> data_values;
+  const char* p = content.data();
+  const char* end = p + content.size();
   
-  // int line_number = 0;
+  bool has_data = false;
+  size_t number_columns = 0;
+  std::vector<double> row;
   
-  while (std::getline(file, line)) {
+  while (p < end) {
     
-    // line_number++;
-    // 
-    // Rcpp::Rcout << line_number << " ";
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (eol == nullptr) eol = end;
     
-    if (line.find(":") != std::string::npos) {
-      std::istringstream iss(line);
-      std::string key, value;
-      std::getline(iss, key, ':');
-      std::getline(iss, value);
+    const char* colon = static_cast<const char*>(std::memchr(p, ':', eol - p));
+    
+    if (colon != nullptr) {
+      
+      if (colon + 1 < eol) {
+        const char* value_first = colon + 1;
+        const char* value_last = eol;
+        while (value_first < value_last && std::isspace(static_cast<unsigned char>(*value_first))) ++value_first;
+        while (value_last > value_first && std::isspace(static_cast<unsigned char>(*(value_last - 1)))) --value_last;
+        
+        const std::string key(p, colon);
+        const std::string value(value_first, value_last);
+        
+        auto it = std::find(asc.metadata_keys.begin(), asc.metadata_keys.end(), key);
+        if (it == asc.metadata_keys.end()) {
+          asc.metadata_keys.push_back(key);
+          asc.metadata_values.push_back(value);
+        } else {
+          asc.metadata_values[it - asc.metadata_keys.begin()] = value;
+        }
+      }
       
-      if (value.length() > 0) metadata_list[key] = trim_whitespaces_before_and_after(value);
+    } else if (std::memchr(p, ';', eol - p) != nullptr) {
       
-    } else if (line.find(";") != std::string::npos) {
-      std::istringstream iss(line);
-      std::string token;
-      std::vector<double> row;
-      while (std::getline(iss, token, ';')) {
-        if (std::none_of(token.begin(), token.end(), ::isdigit)) break;
-        row.push_back(std::stod(token));
+      row.clear();
+      
+      const char* token = p;
+      while (token < eol) {
+        const char* token_end = static_cast<const char*>(std::memchr(token, ';', eol - token));
+        if (token_end == nullptr) token_end = eol;
+        if (std::none_of(token, token_end, [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) break;
+        row.push_back(parse_asc_number(token, token_end));
+        token = token_end + 1;
+      }
+      
+      // the number of columns is given by the first row, missing values are zero
+      if (!has_data) {
+        has_data = true;
+        number_columns = row.size();
+        asc.columns.resize(number_columns);
+      }
+      
+      for (size_t j = 0; j < number_columns; ++j) {
+        asc.columns[j].push_back(j < row.size() ? row[j] : 0);
       }
-      data_values.push_back(row);
     }
+    
+    p = eol + 1;
   }
   
-  Rcpp::NumericMatrix data_matrix(data_values.size(), data_values[0].size());
-  for (size_t i = 0; i < data_values.size(); ++i) {
-    for (size_t j = 0; j < data_values[i].size(); ++j) {
-      data_matrix(i, j) = data_values[i][j];
-    }
+  return asc;
+}
+
+Rcpp::List asc_metadata_to_list(const RamanAscFile& asc) {
+  Rcpp::List metadata_list;
+  for (size_t i = 0; i < asc.metadata_keys.size(); ++i) {
+    metadata_list[asc.metadata_keys[i]] = asc.metadata_values[i];
   }
+  return metadata_list;
+}
+
+Rcpp::List asc_columns_to_spectra(const std::vector<std::vector<double>>& columns) {
   
-  Rcpp::List data_list(data_matrix.ncol());
-  for (int i = 0; i < data_matrix.ncol(); ++i) {
-    data_list[i] = data_matrix(Rcpp::_, i);
+  Rcpp::List data_list(columns.size());
+  for (size_t i = 0; i < columns.size(); ++i) {
+    data_list[i] = columns[i];
   }
   
   if (data_list.size() == 3) {
@@ -103,14 +165,47 @@ Rcpp::List rcpp_parse_asc_file(std::string file_path) {
   
   data_list.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
   
- list_out = Rcpp::List::create(
+  return data_list;
+}
+
+// Writes the metadata sorted by key, two empty lines and the data rows separated by ";"
+void write_asc_file(const std::string& file, const std::map<std::string, std::string>& metadata_map, const std::vector<std::vector<double>>& columns) {
+  
+  std::ofstream table_stream(file);
+  
+  if (!table_stream.is_open()) throw std::runtime_error("The file " + file + " could not be opened for writing!");
+  
+  for (const auto& kv : metadata_map) {
+    table_stream << kv.first << ": " << kv.second << '\n';
+  }
+  
+  table_stream << '\n' << '\n';
+  
+  const size_t number_rows = columns.empty() ? 0 : columns[0].size();
+  
+  for (size_t i = 0; i < number_rows; ++i) {
+    for (size_t j = 0; j < columns.size(); ++j) {
+      table_stream << columns[j][i];
+      if (j < columns.size() - 1) {
+        table_stream << ";";
+      }
+    }
+    table_stream << '\n';
+  }
+}
+
+Rcpp::List asc_to_analysis(const std::string& file_path, const RamanAscFile& asc) {
+  
+  std::string file_info = extractFileName(file_path);
+  
+  Rcpp::List list_out = Rcpp::List::create(
     Rcpp::Named("name") = file_info,
     Rcpp::Named("replicate") = file_info,
     Rcpp::Named("blank") = "",
     Rcpp::Named("file") = file_path,
     Rcpp::Named("type") = "raman",
-    Rcpp::Named("metadata") = metadata_list,
-    Rcpp::Named("spectra") = data_list
+    Rcpp::Named("metadata") = asc_metadata_to_list(asc),
+    Rcpp::Named("spectra") = asc_columns_to_spectra(asc.columns)
   );
   
   list_out.attr("class") = Rcpp::CharacterVector::create("RamanAnalysis", "Analysis");
@@ -118,6 +213,49 @@ Rcpp::List rcpp_parse_asc_file(std::string file_path) {
   return list_out;
 }
 
+// Parses the files in parallel, the first error is thrown after all files are parsed
+std::vector<RamanAscFile> read_asc_files(const std::vector<std::string>& file_paths) {
+  
+  const int number_files = file_paths.size();
+  
+  std::vector<RamanAscFile> parsed(number_files);
+  std::vector<std::string> errors(number_files);
+  
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < number_files; ++i) {
+    try {
+      parsed[i] = read_asc_file(file_paths[i]);
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  }
+  
+  for (const std::string& error : errors) {
+    if (!error.empty()) throw std::runtime_error(error);
+  }
+  
+  return parsed;
+}
+
+// [[Rcpp::export]]
+Rcpp::List rcpp_parse_asc_file(std::string file_path) {
+  return asc_to_analysis(file_path, read_asc_file(file_path));
+}
+
+// [[Rcpp::export]]
+Rcpp::List rcpp_parse_asc_files(std::vector<std::string> file_paths) {
+  
+  std::vector<RamanAscFile> parsed = read_asc_files(file_paths);
+  
+  Rcpp::List list_out(file_paths.size());
+  
+  for (size_t i = 0; i < file_paths.size(); ++i) {
+    list_out[i] = asc_to_analysis(file_paths[i], parsed[i]);
+  }
+  
+  return list_out;
+}
+
 // [[Rcpp::export]]
 void rcpp_write_asc_file(const std::string& file, Rcpp::List metadata_list, Rcpp::NumericMatrix spectra) {
   
@@ -129,29 +267,115 @@ void rcpp_write_asc_file(const std::string& file, Rcpp::List metadata_list, Rcpp
     metadata_map[std::string(keys[i])] = Rcpp::as<std::string>(metadata_list[i]);
   }
   
-  std::vector<std::string> metadata_lines;
-  std::transform(metadata_map.begin(), metadata_map.end(), std::back_inserter(metadata_lines),
-    [](const auto& kv) { return kv.first + ": " + kv.second; });
+  std::vector<std::vector<double>> columns(spectra.ncol(), std::vector<double>(spectra.nrow()));
+  for (int i = 0; i < spectra.nrow(); ++i) {
+    for (int j = 0; j < spectra.ncol(); ++j) {
+      columns[j][i] = spectra(i, j);
+    }
+  }
+  
+  write_asc_file(file, metadata_map, columns);
+}
+
+// Merges the analyses of a time series into one analysis with the columns rt, shift and intensity.
+// The analyses are taken as loaded in R, so the files are not parsed again. The rt of each analysis is the
+// cumulative "Accumulate Cycle Time (secs)" and the first preCut analyses are excluded. The merged analysis
+// is written to new_file with the metadata of the first analysis.
+// [[Rcpp::export]]
+Rcpp::List rcpp_merge_raman_analyses(Rcpp::List analyses, std::string name, std::string new_file, int preCut = 2) {
+  
+  const int number_analyses = analyses.size();
+  
+  if (number_analyses == 0) throw std::runtime_error("No analyses to merge!");
   
-  std::ofstream metadata_stream(file);
-  for (const auto& line : metadata_lines) {
-    metadata_stream << line << std::endl;
+  if (preCut < 0 || preCut >= number_analyses) {
+    throw std::runtime_error("The preCut must be between 0 and the number of analyses to merge minus one!");
   }
-  metadata_stream.close();
   
-  std::ofstream append_stream(file, std::ios::app);
-  append_stream << std::endl << std::endl;
-  append_stream.close();
+  std::vector<double> rt_out, shift_out, intensity_out;
   
-  std::ofstream table_stream(file, std::ios::app);
-  for (int i = 0; i < spectra.nrow(); ++i) {
-    for (int j = 0; j < spectra.ncol(); ++j) {
-      table_stream << spectra(i, j);
-      if (j < spectra.ncol() - 1) {
-        table_stream << ";";
+  double rt = 0;
+  
+  for (int a = 0; a < number_analyses; ++a) {
+    
+    Rcpp::List analysis = analyses[a];
+    Rcpp::List metadata = analysis["metadata"];
+    
+    // without a cycle time every following rt would be NA, so the analysis is rejected
+    double cycle_time = NA_REAL;
+    
+    if (metadata.containsElementNamed("Accumulate Cycle Time (secs)")) {
+      SEXP value = metadata["Accumulate Cycle Time (secs)"];
+      if (TYPEOF(value) == STRSXP && Rf_length(value) == 1 && STRING_ELT(value, 0) != NA_STRING) {
+        try {
+          cycle_time = std::stod(Rcpp::as<std::string>(value));
+        } catch (...) {
+          cycle_time = NA_REAL;
+        }
+      } else if ((TYPEOF(value) == REALSXP || TYPEOF(value) == INTSXP) && Rf_length(value) == 1) {
+        cycle_time = Rcpp::as<double>(value);
       }
     }
-    table_stream << std::endl;
+    
+    if (!std::isfinite(cycle_time)) {
+      throw std::runtime_error("The metadata of the analyses must have a numeric Accumulate Cycle Time (secs)!");
+    }
+    
+    rt += cycle_time;
+    
+    if (a < preCut) continue;
+    
+    Rcpp::List spectra = analysis["spectra"];
+    
+    if (!spectra.containsElementNamed("shift") || !spectra.containsElementNamed("intensity")) {
+      throw std::runtime_error("The spectra of the analyses must have the columns shift and intensity!");
+    }
+    
+    if (spectra.containsElementNamed("rt")) {
+      throw std::runtime_error("The spectra of the analyses must not have an rt column, as the rt is given by the cycle time!");
+    }
+    
+    const std::vector<double> shift = Rcpp::as<std::vector<double>>(spectra["shift"]);
+    const std::vector<double> intensity = Rcpp::as<std::vector<double>>(spectra["intensity"]);
+    
+    rt_out.insert(rt_out.end(), shift.size(), rt);
+    shift_out.insert(shift_out.end(), shift.begin(), shift.end());
+    intensity_out.insert(intensity_out.end(), intensity.begin(), intensity.end());
+  }
+  
+  std::vector<std::vector<double>> columns = {rt_out, shift_out, intensity_out};
+  
+  Rcpp::List first = analyses[0];
+  Rcpp::List first_metadata = first["metadata"];
+  
+  std::map<std::string, std::string> metadata_map;
+  
+  if (first_metadata.size() > 0) {
+    Rcpp::CharacterVector keys = first_metadata.names();
+    for (int i = 0; i < keys.size(); ++i) {
+      SEXP value = first_metadata[i];
+      if (!Rf_isVectorAtomic(value) || Rf_length(value) != 1) {
+        throw std::runtime_error("The metadata entry " + std::string(keys[i]) + " is not a single value and cannot be written!");
+      }
+      metadata_map[std::string(keys[i])] = CHAR(Rf_asChar(value));
+    }
   }
-  table_stream.close();
+  
+  write_asc_file(new_file, metadata_map, columns);
+  
+  Rcpp::CharacterVector na_charvec(1, NA_STRING);
+  
+  Rcpp::List list_out = Rcpp::List::create(
+    Rcpp::Named("name") = name,
+    Rcpp::Named("replicate") = name,
+    Rcpp::Named("blank") = na_charvec,
+    Rcpp::Named("file") = new_file,
+    Rcpp::Named("type") = "raman",
+    Rcpp::Named("metadata") = first_metadata,
+    Rcpp::Named("spectra") = asc_columns_to_spectra(columns)
+  );
+  
+  list_out.attr("class") = Rcpp::CharacterVector::create("RamanAnalysis", "Analysis");
+  
+  return list_out;
 }
@@ -0,0 +1,438 @@
+#include <vector>
+#include <string>
+#include <Rcpp.h>
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include "StreamCraft_lib.h"
+#include "NTS_utils.h"
+
+// traces are passed from R as CSR, offsets are 0-based with the total number of values as last element
+static std::vector<int64_t> check_trace_offsets(const std::vector<double> &offsets, const size_t &number_values)
+{
+  if (offsets.empty() || offsets.front() != 0 || offsets.back() != static_cast<double>(number_values))
+    throw std::runtime_error("Offsets must start at 0 and end at the number of values!");
+
+  std::vector<int64_t> out(offsets.size());
+
+  for (size_t i = 0; i < offsets.size(); i++)
+  {
+    out[i] = static_cast<int64_t>(offsets[i]);
+    if (i > 0 && out[i] < out[i - 1])
+      throw std::runtime_error("Offsets must be nondecreasing!");
+  }
+
+  return out;
+};
+
+// MARK: rcpp_smooth_savgol
+// [[Rcpp::export]]
+std::vector<double> rcpp_smooth_savgol(std::vector<double> offsets, std::vector<double> intensity, int fl = 11, int forder = 4, int dorder = 0)
+{
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  const std::vector<double> coefficients = sc::savgol_coefficients(fl, forder, dorder);
+
+  return sc::smooth_savgol(trace_offsets, intensity, coefficients);
+};
+
+// MARK: rcpp_smooth_moving_average
+// [[Rcpp::export]]
+std::vector<double> rcpp_smooth_moving_average(std::vector<double> offsets, std::vector<double> intensity, int windowSize = 5)
+{
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  return sc::smooth_moving_average(trace_offsets, intensity, windowSize);
+};
+
+// MARK: rcpp_baseline_als
+// [[Rcpp::export]]
+std::vector<double> rcpp_baseline_als(std::vector<double> offsets, std::vector<double> intensity, double lambda = 5, double p = 0.05, int maxit = 10)
+{
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  // lambda is given as log10, as in baseline::baseline.als
+  return sc::baseline_als(trace_offsets, intensity, std::pow(10.0, lambda), p, maxit);
+};
+
+// MARK: rcpp_baseline_airpls
+// [[Rcpp::export]]
+std::vector<double> rcpp_baseline_airpls(std::vector<double> offsets, std::vector<double> intensity, double lambda = 10, int differences = 1, int itermax = 20)
+{
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  return sc::baseline_airpls(trace_offsets, intensity, lambda, differences, itermax);
+};
+
+// peaks as a data.table, trace, peak and idx are 1-based and idx is the position of the apex within the trace
+static Rcpp::List trace_peaks_to_list(const std::vector<nts::MS_TRACE_PEAK> &peaks)
+{
+  const int number_peaks = peaks.size();
+
+  std::vector<int> trace(number_peaks);
+  std::vector<int> peak(number_peaks);
+  std::vector<int> idx(number_peaks);
+  std::vector<double> x(number_peaks);
+  std::vector<double> min(number_peaks);
+  std::vector<double> max(number_peaks);
+  std::vector<double> intensity(number_peaks);
+  std::vector<double> width(number_peaks);
+  std::vector<double> height_left(number_peaks);
+  std::vector<double> height_right(number_peaks);
+  std::vector<double> area(number_peaks);
+  std::vector<double> sn(number_peaks);
+
+  for (int i = 0; i < number_peaks; i++)
+  {
+    const nts::MS_TRACE_PEAK &pk = peaks[i];
+    trace[i] = pk.trace + 1;
+    peak[i] = (i > 0 && peaks[i - 1].trace == pk.trace) ? peak[i - 1] + 1 : 1;
+    idx[i] = pk.apex + 1;
+    x[i] = pk.x;
+    min[i] = pk.min;
+    max[i] = pk.max;
+    intensity[i] = pk.intensity;
+    width[i] = pk.width;
+    height_left[i] = pk.height_left;
+    height_right[i] = pk.height_right;
+    area[i] = pk.area;
+    sn[i] = pk.sn;
+  }
+
+  Rcpp::List list_out;
+  list_out["trace"] = trace;
+  list_out["peak"] = peak;
+  list_out["idx"] = idx;
+  list_out["x"] = x;
+  list_out["min"] = min;
+  list_out["max"] = max;
+  list_out["intensity"] = intensity;
+  list_out["width"] = width;
+  list_out["height_left"] = height_left;
+  list_out["height_right"] = height_right;
+  list_out["area"] = area;
+  list_out["sn"] = sn;
+  list_out.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+
+  return list_out;
+};
+
+// MARK: rcpp_find_maxima
+// [[Rcpp::export]]
+Rcpp::List rcpp_find_maxima(std::vector<double> offsets, std::vector<double> x, std::vector<double> intensity, double minWidth = 0, double maxWidth = 0, double minHeight = 0)
+{
+  if (x.size() != intensity.size())
+    throw std::runtime_error("The x and intensity must have the same length!");
+
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  const std::vector<nts::MS_TRACE_PEAK> peaks = nts::find_peaks(
+      trace_offsets, x, intensity,
+      [&](const double *tx, const double *ty, const int &n, std::vector<nts::MS_TRACE_PEAK> &out)
+      { nts::find_trace_maxima(tx, ty, n, minWidth, maxWidth, minHeight, out); });
+
+  return trace_peaks_to_list(peaks);
+};
+
+// MARK: rcpp_find_peaks
+// [[Rcpp::export]]
+Rcpp::List rcpp_find_peaks(std::vector<double> offsets,
+                           std::vector<double> x,
+                           std::vector<double> intensity,
+                           bool merge = true,
+                           double closeByThreshold = 45,
+                           double minPeakHeight = 0,
+                           double minPeakDistance = 10,
+                           double minPeakWidth = 5,
+                           double maxPeakWidth = 120,
+                           double minSN = 10)
+{
+  if (x.size() != intensity.size())
+    throw std::runtime_error("The x and intensity must have the same length!");
+
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  const std::vector<nts::MS_TRACE_PEAK> peaks = nts::find_peaks(
+      trace_offsets, x, intensity,
+      [&](const double *tx, const double *ty, const int &n, std::vector<nts::MS_TRACE_PEAK> &out)
+      { nts::find_trace_peaks(tx, ty, n, merge, closeByThreshold, minPeakHeight, minPeakDistance, minPeakWidth, maxPeakWidth, minSN, out); });
+
+  return trace_peaks_to_list(peaks);
+};
+
+// MARK: rcpp_normalize_spectra
+// [[Rcpp::export]]
+std::vector<double> rcpp_normalize_spectra(std::vector<double> offsets, std::vector<double> intensity, std::string method = "minmax", bool liftToZero = false)
+{
+  const std::vector<int64_t> trace_offsets = check_trace_offsets(offsets, intensity.size());
+
+  return sc::normalize_traces(trace_offsets, intensity, method, liftToZero);
+};
+
+// MARK: rcpp_average_spectra
+// [[Rcpp::export]]
+Rcpp::List rcpp_average_spectra(Rcpp::List spectra, std::vector<int> replicate, int numberReplicates, bool collapseTime = false)
+{
+  const int number_spectra = spectra.size();
+
+  if (static_cast<int>(replicate.size()) != number_spectra)
+    throw std::runtime_error("The replicate must have the same length as the spectra!");
+
+  std::vector<std::string> average_cols = {"intensity", "raw", "baseline"};
+  if (collapseTime)
+    average_cols.push_back("rt");
+
+  // means are taken over rows with equal spectral axis columns and rows differing in any other column are kept,
+  // as assigning the group mean and then taking the unique rows over all columns
+  std::vector<std::string> key_cols = {"bins", "mass", "mz", "shift"};
+  if (!collapseTime)
+    key_cols.push_back("rt");
+
+  // columns of each replicate in order of first appearance, as when binding the spectra with fill,
+  // with the column of each member analysis or R_NilValue when the analysis does not have it
+  std::vector<std::vector<int>> members(numberReplicates);
+  std::vector<std::vector<std::string>> cols(numberReplicates);
+  std::vector<std::vector<int>> types(numberReplicates);
+  std::vector<std::vector<std::vector<SEXP>>> member_cols(numberReplicates);
+
+  for (int i = 0; i < number_spectra; i++)
+  {
+    Rcpp::List spectrum = spectra[i];
+
+    if (spectrum.size() == 0 || Rf_length(spectrum[0]) == 0)
+      continue;
+
+    if (replicate[i] < 1 || replicate[i] > numberReplicates)
+      throw std::runtime_error("The replicate must be between 1 and the number of replicates!");
+
+    const int g = replicate[i] - 1;
+    members[g].push_back(i);
+    member_cols[g].push_back(std::vector<SEXP>(cols[g].size(), R_NilValue));
+
+    const std::vector<std::string> names = spectrum.names();
+
+    for (size_t j = 0; j < names.size(); j++)
+    {
+      if (names[j] == "analysis" || names[j] == "replicate")
+        continue;
+
+      SEXP col = spectrum[j];
+      const int type = TYPEOF(col);
+
+      if (type != LGLSXP && type != INTSXP && type != REALSXP && type != STRSXP)
+        throw std::runtime_error("The spectra column " + names[j] + " is not logical, integer, numeric or character!");
+
+      const size_t c = std::find(cols[g].begin(), cols[g].end(), names[j]) - cols[g].begin();
+
+      if (c == cols[g].size())
+      {
+        cols[g].push_back(names[j]);
+        types[g].push_back(type);
+        for (std::vector<SEXP> &m : member_cols[g])
+          m.push_back(R_NilValue);
+      }
+      else if ((types[g][c] == STRSXP) != (type == STRSXP))
+      {
+        throw std::runtime_error("The spectra column " + names[j] + " is character in some analyses and numeric in others!");
+      }
+      else
+      {
+        types[g][c] = std::max(types[g][c], type);
+      }
+
+      member_cols[g].back()[c] = col;
+    }
+  }
+
+  std::vector<std::vector<std::vector<std::vector<uint64_t>>>> keys(numberReplicates);
+  std::vector<std::vector<std::vector<std::vector<uint64_t>>>> other_keys(numberReplicates);
+  std::vector<std::vector<std::vector<std::vector<double>>>> values(numberReplicates);
+
+  for (int g = 0; g < numberReplicates; g++)
+  {
+    if (members[g].empty())
+      continue;
+
+    if (std::find(cols[g].begin(), cols[g].end(), "intensity") == cols[g].end())
+      throw std::runtime_error("The spectra must have the column intensity!");
+
+    for (size_t m = 0; m < members[g].size(); m++)
+    {
+      Rcpp::List spectrum = spectra[members[g][m]];
+      const int number_rows = Rf_length(spectrum[0]);
+
+      std::vector<std::vector<uint64_t>> keys_m;
+      std::vector<std::vector<uint64_t>> other_keys_m;
+      std::vector<std::vector<double>> values_m;
+
+      for (size_t c = 0; c < cols[g].size(); c++)
+      {
+        SEXP col = member_cols[g][m][c];
+
+        if (std::find(average_cols.begin(), average_cols.end(), cols[g][c]) != average_cols.end())
+        {
+          if (col == R_NilValue)
+            values_m.push_back(std::vector<double>(number_rows, NA_REAL));
+          else
+            values_m.push_back(Rcpp::as<std::vector<double>>(col));
+          continue;
+        }
+
+        // keys are compared as bit patterns of the values in the common type of the column,
+        // character values by their address in the R string cache
+        std::vector<uint64_t> key(number_rows);
+
+        if (types[g][c] == STRSXP)
+        {
+          for (int r = 0; r < number_rows; r++)
+            key[r] = reinterpret_cast<uintptr_t>(col == R_NilValue ? NA_STRING : STRING_ELT(col, r));
+        }
+        else if (types[g][c] == REALSXP)
+        {
+          std::vector<double> col_values(number_rows, NA_REAL);
+          if (col != R_NilValue)
+            col_values = Rcpp::as<std::vector<double>>(col);
+          for (int r = 0; r < number_rows; r++)
+          {
+            const double value = col_values[r] == 0 ? 0 : col_values[r];
+            std::memcpy(&key[r], &value, sizeof(double));
+          }
+        }
+        else
+        {
+          for (int r = 0; r < number_rows; r++)
+            key[r] = static_cast<uint32_t>(col == R_NilValue ? NA_INTEGER : INTEGER(col)[r]);
+        }
+
+        if (std::find(key_cols.begin(), key_cols.end(), cols[g][c]) != key_cols.end())
+          keys_m.push_back(key);
+        else
+          other_keys_m.push_back(key);
+      }
+
+      keys[g].push_back(keys_m);
+      other_keys[g].push_back(other_keys_m);
+      values[g].push_back(values_m);
+    }
+  }
+
+  std::vector<sc::SPECTRA_AVERAGE> averages(numberReplicates);
+  std::vector<sc::SPECTRA_AVERAGE> uniques(numberReplicates);
+  std::vector<std::vector<int64_t>> unique_group(numberReplicates);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int g = 0; g < numberReplicates; g++)
+  {
+    averages[g] = sc::average_spectra(keys[g], values[g]);
+
+    if (members[g].empty() || other_keys[g][0].empty())
+      continue;
+
+    // the unique rows over the spectral axis and other columns, each with the mean of its spectral axis group
+    std::vector<std::vector<std::vector<uint64_t>>> all_keys = keys[g];
+    for (size_t m = 0; m < all_keys.size(); m++)
+      all_keys[m].insert(all_keys[m].end(), other_keys[g][m].begin(), other_keys[g][m].end());
+
+    uniques[g] = sc::average_spectra(all_keys, values[g]);
+
+    const size_t number_keys = keys[g][0].size();
+
+    auto key_of = [&](const int &a, const int64_t &r)
+    {
+      std::vector<uint64_t> key(number_keys);
+      for (size_t k = 0; k < number_keys; k++)
+        key[k] = keys[g][a][k][r];
+      return key;
+    };
+
+    auto key_hash = [](const std::vector<uint64_t> &key)
+    {
+      uint64_t hash = 0x9E3779B97F4A7C15ULL;
+      for (const uint64_t &k : key)
+        hash ^= k + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+      return static_cast<size_t>(hash);
+    };
+
+    std::unordered_map<std::vector<uint64_t>, int64_t, decltype(key_hash)> group_index(averages[g].row.size(), key_hash);
+
+    for (size_t a = 0; a < averages[g].row.size(); a++)
+      group_index.emplace(key_of(averages[g].analysis[a], averages[g].row[a]), a);
+
+    unique_group[g].resize(uniques[g].row.size());
+
+    for (size_t u = 0; u < uniques[g].row.size(); u++)
+      unique_group[g][u] = group_index.at(key_of(uniques[g].analysis[u], uniques[g].row[u]));
+  }
+
+  Rcpp::List list_out(numberReplicates);
+
+  for (int g = 0; g < numberReplicates; g++)
+  {
+    Rcpp::List average_g;
+
+    if (!members[g].empty())
+    {
+      const bool has_other = !unique_group[g].empty();
+      const sc::SPECTRA_AVERAGE &rows_out = has_other ? uniques[g] : averages[g];
+      const int number_rows = rows_out.row.size();
+      int v = 0;
+
+      for (size_t c = 0; c < cols[g].size(); c++)
+      {
+        if (std::find(average_cols.begin(), average_cols.end(), cols[g][c]) != average_cols.end())
+        {
+          if (has_other)
+          {
+            std::vector<double> mean_out(number_rows);
+            for (int r = 0; r < number_rows; r++)
+              mean_out[r] = averages[g].values[v][unique_group[g][r]];
+            average_g.push_back(mean_out, cols[g][c]);
+          }
+          else
+          {
+            average_g.push_back(averages[g].values[v], cols[g][c]);
+          }
+          v++;
+          continue;
+        }
+
+        // key and other columns are taken from the first row of each unique row
+        Rcpp::RObject col_out = Rf_allocVector(types[g][c], number_rows);
+
+        for (int r = 0; r < number_rows; r++)
+        {
+          SEXP col = member_cols[g][rows_out.analysis[r]][c];
+          const int64_t row = rows_out.row[r];
+
+          if (types[g][c] == STRSXP)
+          {
+            SET_STRING_ELT(col_out, r, col == R_NilValue ? NA_STRING : STRING_ELT(col, row));
+          }
+          else if (types[g][c] == REALSXP)
+          {
+            double value = NA_REAL;
+            if (col != R_NilValue && TYPEOF(col) == REALSXP)
+              value = REAL(col)[row];
+            else if (col != R_NilValue && INTEGER(col)[row] != NA_INTEGER)
+              value = INTEGER(col)[row];
+            REAL(col_out)[r] = value;
+          }
+          else
+          {
+            INTEGER(col_out)[r] = col == R_NilValue ? NA_INTEGER : INTEGER(col)[row];
+          }
+        }
+
+        average_g.push_back(col_out, cols[g][c]);
+      }
+    }
+
+    average_g.attr("class") = Rcpp::CharacterVector::create("data.table", "data.frame");
+
+    list_out[g] = average_g;
+  }
+
+  return list_out;
+};